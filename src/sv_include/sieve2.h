@@ -9,9 +9,12 @@
 #ifndef SIEVE2_H
 #define SIEVE2_H
 
+#include <stddef.h>
 #include "sieve2_error.h"
 
 typedef struct sieve2_context sieve2_context_t;
+typedef struct sieve2_script sieve2_script_t;
+typedef struct sieve2_index sieve2_index_t;
 
 /* At a minimum, you must register redirect, keep,
  * getsize and either getheader or getallheaders.
@@ -52,6 +55,8 @@ typedef enum {
 	SIEVE2_ERRCALL_HEADER,        // NEW in 2.2.6
 	SIEVE2_ERRCALL_ADDRESS,       // NEW in 2.2.6
 
+	SIEVE2_MESSAGE_GETHEADERS,    // NEW in 2.3.1
+
 	SIEVE2_VALUE_LAST             // Use this as an API version check
 } sieve2_values_t;
 
@@ -65,6 +70,148 @@ typedef struct {
 	sieve2_callback_func func;
 } sieve2_callback_t;
 
+/* Version 3 callbacks are handed a struct with the values for their
+ * callback in it, instead of asking for each one by name. Fill in the
+ * fields marked as replies before returning. The values are good
+ * until the callback returns; replies must last just as long as they
+ * would if they were given with sieve2_setvalue_*. */
+typedef struct {
+	const char *address;
+} sieve2_redirect_t;               /* SIEVE2_ACTION_REDIRECT */
+
+typedef struct {
+	const char *message;
+} sieve2_reject_t;                 /* SIEVE2_ACTION_REJECT */
+
+typedef struct {
+	const char *mailbox;
+	char **flags;
+} sieve2_fileinto_t;               /* SIEVE2_ACTION_FILEINTO */
+
+typedef struct {
+	char **flags;
+} sieve2_keep_t;                   /* SIEVE2_ACTION_KEEP */
+
+typedef struct {
+	const char *id;
+	const char *method;
+	const char *priority;
+	const char *message;
+	char **options;
+} sieve2_notify_t;                 /* SIEVE2_ACTION_NOTIFY */
+
+typedef struct {
+	const char *address;
+	const char *fromaddr;
+	const char *subject;
+	const char *message;
+	const char *hash;
+	int days;
+	int mime;
+} sieve2_vacation_t;               /* SIEVE2_ACTION_VACATION */
+
+typedef struct {
+	int lineno;                /* -1 for runtime and address errors */
+	const char *message;
+} sieve2_error_t;                  /* SIEVE2_ERRCALL_* */
+
+typedef struct {
+	int level;
+	const char *module;
+	const char *file;
+	const char *function;
+	const char *message;
+} sieve2_trace_t;                  /* SIEVE2_DEBUG_TRACE */
+
+typedef struct {
+	const char *path;
+	const char *name;
+	const char *script;        /* reply */
+} sieve2_getscript_t;              /* SIEVE2_SCRIPT_GETSCRIPT */
+
+typedef struct {
+	const char *header;
+	char **body;               /* reply */
+} sieve2_getheader_t;              /* SIEVE2_MESSAGE_GETHEADER */
+
+/* Every header the script could ask for, before it runs, so that they
+ * can be fetched all at once. Put each body in bodies[i], where i is
+ * where its name is in headers, just as getheader would reply; an
+ * empty list if the message has none. Any left NULL are asked for with
+ * getheader, if it's needed. Version 2 callbacks set each body with
+ * sieve2_setvalue_stringlist, naming it by its header. */
+typedef struct {
+	char **headers;
+	char ***bodies;            /* reply */
+} sieve2_getheaders_t;             /* SIEVE2_MESSAGE_GETHEADERS */
+
+/* The headers are read where they are, not copied, so the reply
+ * must stay put until the call executing the script returns. Each
+ * execution asks for the headers of its own message again. */
+typedef struct {
+	const char *allheaders;    /* reply */
+} sieve2_getallheaders_t;          /* SIEVE2_MESSAGE_GETALLHEADERS */
+
+typedef struct {
+	const char *env;
+	const char *from;          /* reply */
+	const char *to;            /* reply */
+} sieve2_getenvelope_t;            /* SIEVE2_MESSAGE_GETENVELOPE */
+
+typedef struct {
+	int size;                  /* reply */
+} sieve2_getsize_t;                /* SIEVE2_MESSAGE_GETSIZE */
+
+typedef struct {
+	const char *address;
+	const char *user;          /* reply */
+	const char *detail;        /* reply */
+	const char *localpart;     /* reply */
+	const char *domain;        /* reply */
+} sieve2_getsubaddress_t;          /* SIEVE2_MESSAGE_GETSUBADDRESS */
+
+/* values points to the struct for the callback's value, or to
+ * nothing in particular for those which have no values. */
+typedef int (*sieve2_callback3_func) (
+	sieve2_context_t * sieve2_context,
+	void * user_data,
+	void * values
+);
+
+typedef struct {
+	sieve2_values_t value;
+	sieve2_callback3_func func;
+} sieve2_callback3_t;
+
+/* One entry of the action list from sieve2_getactionlist. The values
+ * are those the action's callback would have been given, and last
+ * until the next execution with the same context, sieve2_reset or
+ * sieve2_free. */
+typedef struct {
+	sieve2_values_t code;      /* SIEVE2_ACTION_* */
+	int implicit;              /* the keep no other action cancelled */
+	union {
+		sieve2_redirect_t redirect;
+		sieve2_reject_t reject;
+		sieve2_fileinto_t fileinto;
+		sieve2_keep_t keep;
+		sieve2_notify_t notify;
+		sieve2_vacation_t vacation;
+	} u;
+} sieve2_action_t;
+
+
+/* Where libSieve gets its memory, if not from malloc, realloc and free.
+ * Each function is passed user_data. Neither realloc_fn nor free_fn
+ * is ever passed NULL, and a NULL from either allocating function is
+ * taken as SIEVE2_ERROR_NOMEM. */
+typedef struct {
+	void *(*malloc_fn)(size_t size, void *user_data);
+	void *(*realloc_fn)(void *ptr, size_t size, void *user_data);
+	void (*free_fn)(void *ptr, void *user_data);
+	void *user_data;
+} sieve2_allocator_t;
+
 
 /* From here below only functions thar be! */
 #if defined(c_plusplus) || defined(__cplusplus)
@@ -78,15 +225,52 @@ typedef struct {
 extern int sieve2_alloc(sieve2_context_t **sieve2_context);
 extern int sieve2_free(sieve2_context_t **sieve2_context);
 
+/* Allocate a context which gets all of its memory from allocator,
+ * which is copied. Whatever it allocates for a message, while
+ * compiling a script or executing one, comes from there, too; so do
+ * the scripts it compiles, though they may be executed with others.
+ * What a script keeps from being executed, such as the states its
+ * regexes build up, comes from the allocator it was compiled with. */
+extern int sieve2_alloc_with(sieve2_context_t **sieve2_context,
+                             const sieve2_allocator_t *allocator);
+
+/* Set the allocator for contexts allocated by sieve2_alloc, for scripts
+ * loaded by sieve2_script_load and for indexes; NULL goes back to the C
+ * library's. Call this first, before anything is allocated: memory is
+ * given back to whichever allocator it came from, so that has to stay
+ * usable until then. It is not safe to call while other threads are
+ * using libSieve. */
+extern int sieve2_setallocator(const sieve2_allocator_t *allocator);
+
+/* Forget the message last executed on, and everything that came of
+ * it, such as the action list and the headers fetched for it; but keep
+ * the memory it took, for the next message. Callbacks and settings are
+ * kept, too. Call this between messages when a context is used for
+ * many of them, so that it doesn't grow. */
+extern int sieve2_reset(sieve2_context_t *sieve2_context);
+
 /* Attach the callbacks array to the libSieve context. */
 extern int sieve2_callbacks(sieve2_context_t *sieve2_context,
                             sieve2_callback_t *callbacks);
 
+/* Attach version 3 callbacks; these may be mixed with the others,
+ * and whichever was attached last for a value is the one called. */
+extern int sieve2_callbacks3(sieve2_context_t *sieve2_context,
+                             sieve2_callback3_t *callbacks);
+
 /* Get a space separated list of extensions that libSieve
  * supports and for which you have registered a callback. */
-/* libSieve will free this memory for you, don't worry about it. */
+/* libSieve will free this memory for you, don't worry about it;
+ * it lasts until sieve2_reset or sieve2_free. */
 extern char * sieve2_listextensions(sieve2_context_t *sieve2_context);
 
+/* Limit how deeply blocks and tests may nest in a script. Deeper
+ * scripts fail to parse, and compiled scripts nesting their tests
+ * deeper fail to execute. Nothing in libSieve recurses any deeper
+ * than this, so set it low if you run scripts on small stacks. */
+#define SIEVE2_DEFAULT_MAXDEPTH 64
+extern int sieve2_setmaxdepth(sieve2_context_t *sieve2_context, int depth);
+
 /* Validate a script for syntax and feature support */
 extern int sieve2_validate(sieve2_context_t *sieve2_context,
                            void *user_data);
@@ -95,6 +279,81 @@ extern int sieve2_validate(sieve2_context_t *sieve2_context,
 extern int sieve2_execute(sieve2_context_t *sieve2_context,
                           void *user_data);
 
+/* Parse a script once into a handle which can be executed
+ * over any number of messages without being parsed again. */
+/* The handle does not refer back to the context which compiled
+ * it, so it may be executed with another context, too. */
+extern int sieve2_compile(sieve2_context_t *sieve2_context,
+                          void *user_data,
+                          sieve2_script_t **sieve2_script);
+
+/* Execute a compiled script on a message, producing an action list */
+extern int sieve2_execute_script(sieve2_context_t *sieve2_context,
+                                 sieve2_script_t *sieve2_script,
+                                 void *user_data);
+
+/* Execute the compiled scripts of many recipients on one message.
+ * The headers are fetched once, with user_data[0], and shared; each
+ * script then gets its own user_data in its envelope and action
+ * callbacks. Each script's result is put in results[i]. */
+extern int sieve2_execute_scripts(sieve2_context_t *sieve2_context,
+                                  sieve2_script_t **sieve2_scripts,
+                                  void **user_data, int count,
+                                  int *results);
+
+/* Index the compiled scripts of many users, so that a test of the
+ * message which any number of them have in common is only worked out
+ * once. The index takes a reference to each script, and may be shared
+ * by threads like a script. The scripts to run over a message are
+ * picked by their position in the array the index was built from;
+ * any number of recipients may share one, and envelope tests are still
+ * worked out for each of them with their own user_data. */
+extern int sieve2_index_build(sieve2_script_t **sieve2_scripts, int count,
+                              sieve2_index_t **sieve2_index);
+extern int sieve2_index_free(sieve2_index_t **sieve2_index);
+extern int sieve2_execute_index(sieve2_context_t *sieve2_context,
+                                sieve2_index_t *sieve2_index,
+                                const int *which, void **user_data,
+                                int count, int *results);
+
+/* Instead of calling back for each action as the script runs, keep
+ * a list of them for after each execution. A keep is put on the end
+ * of the list unless something in the script cancelled it, so the
+ * list holds everything that's left to do: if it is empty, the
+ * message was discarded. Fileinto the same mailbox, redirect to the
+ * same address and keep are each only listed once, with their flags
+ * merged. If the script fails, the list is just the keep. No action
+ * callbacks are needed, and every action is supported, while on. */
+extern int sieve2_setactionlist(sieve2_context_t *sieve2_context, int on);
+
+/* The list of the last execution. After sieve2_execute_scripts or
+ * sieve2_execute_index, which picks the script by its place among
+ * those run; otherwise it must be 0. */
+extern int sieve2_getactionlist(sieve2_context_t *sieve2_context, int which,
+                                const sieve2_action_t **actions, int *count);
+
+/* Compiled scripts are reference counted and are never modified
+ * while executing, so one handle may be executed by many threads at
+ * once, each with its own context, unless libSieve was configured with
+ * --disable-threads. Take a reference for each user. */
+extern int sieve2_script_ref(sieve2_script_t *sieve2_script);
+
+/* Drops one reference and sets the pointer to NULL;
+ * the script is freed when the last reference is dropped. */
+extern int sieve2_script_free(sieve2_script_t **sieve2_script);
+
+/* Save a compiled script to a file, and map it back in later without
+ * parsing it again. The file is only good for this version of libSieve
+ * on machines with the same byte order; compile the script again if
+ * sieve2_script_load returns SIEVE2_ERROR_BYTECODE. */
+extern int sieve2_script_write(sieve2_script_t *sieve2_script,
+                               const char *filename);
+extern int sieve2_script_load(const char *filename,
+                              sieve2_script_t **sieve2_script);
+
+/* The values for version 2 callbacks, by name. These are the
+ * fields of the version 3 structs above, by the same names. */
+
 /* libSieve will free this memory for you, don't worry about it. */
 extern const char * 
 sieve2_getvalue_string(
@@ -26,7 +26,8 @@
 #define SIEVE2_ERROR_HEADER            11
 #define SIEVE2_ERROR_GETSCRIPT         12
 #define SIEVE2_ERROR_ADDRESS           13
-#define SIEVE2_ERROR_LAST              14
+#define SIEVE2_ERROR_BYTECODE          14
+#define SIEVE2_ERROR_LAST              15
 
 static const char * const sieve2_error_text[] = {
     "Sieve OK",
@@ -43,6 +44,7 @@ static const char * const sieve2_error_text[] = {
     "Sieve Error: header could not be parsed",
     "Sieve Error: script was not retrieved",
     "Sieve Error: address could not be parsed",
+    "Sieve Error: compiled script is invalid",
      (void*) 0
 };
 
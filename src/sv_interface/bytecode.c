@@ -0,0 +1,1241 @@
+/* bytecode.c -- compiled script format
+ * $Id$
+ */
+/* * * *
+ * Licensed under the GNU Lesser General Public License (LGPL)
+ * version 2.1, and other versions at the author's discretion.
+ * * * */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* sv_interface */
+#include "bytecode.h"
+#include "context2.h"
+#include "message.h"
+#include "script.h"
+#include "tree.h"
+#include "src/sv_parser/sieve.h"
+
+/* sv_regex */
+#include "src/sv_regex/regex.h"
+
+/* sv_util */
+#include "src/sv_util/util.h"
+
+#define THIS_MODULE "sv_interface"
+
+/* The image is put together in three pieces,
+ * which are copied into one block at the end. */
+struct bc_emitter {
+    bc_word_t *code;
+    size_t code_len, code_alloc;
+    bc_word_t *regex;
+    size_t regex_len, regex_alloc;
+    char *str;
+    size_t str_len, str_alloc;
+    bc_word_t *hash;         /* string references, by hash of the string */
+    size_t hash_used, hash_alloc;
+    size_t *memo;            /* where the first test with each memo slot is */
+    size_t memo_len, memo_alloc;
+    bc_word_t *memo_hash;    /* memo slots plus one, by hash of the test */
+    size_t memo_hash_alloc;
+    int nomem;
+};
+
+static int static_grow(void **buf, size_t *alloc, size_t need, size_t size)
+{
+    void *tmp;
+    size_t n = *alloc ? *alloc : 64;
+
+    if (need <= *alloc)
+        return 1;
+    while (n < need)
+        n *= 2;
+    tmp = libsieve_realloc(*buf, n * size);
+    if (tmp == NULL)
+        return 0;
+    *buf = tmp;
+    *alloc = n;
+    return 1;
+}
+
+/* Returns the index of the word. */
+static size_t static_emit(struct bc_emitter *e, bc_word_t w)
+{
+    if (!static_grow((void **)&e->code, &e->code_alloc, e->code_len + 1, sizeof(bc_word_t))) {
+        e->nomem = 1;
+        return 0;
+    }
+    e->code[e->code_len] = w;
+    return e->code_len++;
+}
+
+static unsigned long static_hash(const char *s)
+{
+    unsigned long h = 5381;
+
+    while (*s)
+        h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+/* Scripts repeat the same header names and folders over and over,
+ * so each string is only stored once. Returns the hash table slot
+ * holding the string, or the empty slot where it belongs. */
+static bc_word_t *static_string_slot(struct bc_emitter *e, const char *s)
+{
+    size_t i = static_hash(s) & (e->hash_alloc - 1);
+
+    while (e->hash[i] && strcmp(e->str + e->hash[i] - 1, s) != 0)
+        i = (i + 1) & (e->hash_alloc - 1);
+    return &e->hash[i];
+}
+
+/* Keep the table no more than half full. */
+static int static_string_rehash(struct bc_emitter *e)
+{
+    bc_word_t *old = e->hash;
+    size_t i, n = e->hash_alloc;
+
+    e->hash_alloc = n ? 2 * n : 64;
+    e->hash = (bc_word_t *)libsieve_malloc(e->hash_alloc * sizeof(bc_word_t));
+    if (e->hash == NULL) {
+        e->hash = old;
+        e->hash_alloc = n;
+        return 0;
+    }
+    memset(e->hash, 0, e->hash_alloc * sizeof(bc_word_t));
+    for (i = 0; i < n; i++) {
+        if (old[i])
+            *static_string_slot(e, e->str + old[i] - 1) = old[i];
+    }
+    libsieve_free(old);
+    return 1;
+}
+
+static bc_word_t static_string(struct bc_emitter *e, const char *s)
+{
+    size_t len, ref;
+    bc_word_t *slot;
+
+    if (s == NULL)
+        return 0;
+
+    if (2 * (e->hash_used + 1) > e->hash_alloc && !static_string_rehash(e)) {
+        e->nomem = 1;
+        return 0;
+    }
+    slot = static_string_slot(e, s);
+    if (*slot)
+        return *slot;
+
+    len = strlen(s) + 1;
+    if (!static_grow((void **)&e->str, &e->str_alloc, e->str_len + len, sizeof(char))) {
+        e->nomem = 1;
+        return 0;
+    }
+    memcpy(e->str + e->str_len, s, len);
+    ref = e->str_len + 1;
+    e->str_len += len;
+    e->hash_used++;
+    return *slot = (bc_word_t)ref;
+}
+
+static void static_emit_string(struct bc_emitter *e, const char *s)
+{
+    static_emit(e, static_string(e, s));
+}
+
+static void static_emit_sl(struct bc_emitter *e, stringlist_t *sl)
+{
+    stringlist_t *s;
+    bc_word_t count = 0;
+
+    for (s = sl; s != NULL; s = s->next)
+        count++;
+    static_emit(e, count);
+    for (s = sl; s != NULL; s = s->next)
+        static_emit_string(e, s->s);
+}
+
+/* Regexes go into their own table, so they can be compiled on load. */
+static void static_emit_pl(struct bc_emitter *e, patternlist_t *pl, int comptag, int compid)
+{
+    patternlist_t *p;
+    bc_word_t count = 0;
+    int cflags = REG_EXTENDED | REG_NOSUB;
+
+    if (comptag != REGEX) {
+        static_emit_sl(e, (stringlist_t *)pl);
+        return;
+    }
+
+    if (compid == COMPARATOR_ASCII_CASEMAP)
+        cflags |= REG_ICASE;
+
+    for (p = pl; p != NULL; p = p->next)
+        count++;
+    static_emit(e, count);
+    for (p = pl; p != NULL; p = p->next) {
+        bc_word_t ref = static_string(e, p->s);
+        size_t i;
+
+        /* The same pattern is only compiled once, too. Strings are
+         * only stored once, so their references can be compared. */
+        for (i = 0; i < e->regex_len; i++) {
+            if (e->regex[2 * i] == ref && e->regex[2 * i + 1] == (bc_word_t)cflags)
+                break;
+        }
+        if (i == e->regex_len) {
+            if (!static_grow((void **)&e->regex, &e->regex_alloc,
+                        2 * (e->regex_len + 1), sizeof(bc_word_t))) {
+                e->nomem = 1;
+                return;
+            }
+            e->regex[2 * e->regex_len] = ref;
+            e->regex[2 * e->regex_len + 1] = cflags;
+            e->regex_len++;
+        }
+        static_emit(e, i);
+    }
+}
+
+static bc_word_t static_match(int comptag)
+{
+    bc_word_t rel = comptag >> 10;
+
+    switch (comptag & ((1 << 10) - 1)) {
+    case IS: return BC_MATCH_IS;
+    case CONTAINS: return BC_MATCH_CONTAINS;
+    case MATCHES: return BC_MATCH_MATCHES;
+    case REGEX: return BC_MATCH_REGEX;
+    case VALUE: return BC_MATCH_VALUE | (rel << 10);
+    case COUNT: return BC_MATCH_COUNT | (rel << 10);
+    }
+    return 0;
+}
+
+int libsieve_bc_comptag(bc_word_t match)
+{
+    int rel = (int)(match >> 10) << 10;
+
+    switch (match & ((1 << 10) - 1)) {
+    case BC_MATCH_IS: return IS;
+    case BC_MATCH_CONTAINS: return CONTAINS;
+    case BC_MATCH_MATCHES: return MATCHES;
+    case BC_MATCH_REGEX: return REGEX;
+    case BC_MATCH_VALUE: return VALUE | rel;
+    case BC_MATCH_COUNT: return COUNT | rel;
+    }
+    return 0;
+}
+
+static bc_word_t static_addrpart(int addrpart)
+{
+    switch (addrpart) {
+    case LOCALPART: return ADDRESS_LOCALPART;
+    case DOMAIN: return ADDRESS_DOMAIN;
+    case USER: return ADDRESS_USER;
+    case DETAIL: return ADDRESS_DETAIL;
+    }
+    return ADDRESS_ALL;
+}
+
+/* Tests of the message alone always give the same answer for the
+ * same message, so each one which is written the same way as an
+ * earlier one shares its memo slot. Since strings and regexes are
+ * only stored once, the same test is emitted as the same words. */
+static int static_memo_equal(struct bc_emitter *e, size_t a, size_t b)
+{
+    size_t alen = e->code[a + 1] - a, blen = e->code[b + 1] - b;
+
+    return e->code[a] == e->code[b] && alen == blen
+        && memcmp(e->code + a + 3, e->code + b + 3, (alen - 3) * sizeof(bc_word_t)) == 0;
+}
+
+static bc_word_t *static_memo_slot(struct bc_emitter *e, size_t pos)
+{
+    size_t i, end = e->code[pos + 1];
+    unsigned long h = e->code[pos];
+
+    for (i = pos + 3; i < end; i++)
+        h = h * 33 + e->code[i];
+
+    i = h & (e->memo_hash_alloc - 1);
+    while (e->memo_hash[i] && !static_memo_equal(e, e->memo[e->memo_hash[i] - 1], pos))
+        i = (i + 1) & (e->memo_hash_alloc - 1);
+    return &e->memo_hash[i];
+}
+
+static void static_memo(struct bc_emitter *e, size_t pos)
+{
+    bc_word_t *slot, *old = e->memo_hash;
+    size_t i, n = e->memo_hash_alloc;
+
+    if (e->nomem)
+        return;
+
+    /* Keep the table no more than half full. */
+    if (2 * (e->memo_len + 1) > e->memo_hash_alloc) {
+        e->memo_hash_alloc = n ? 2 * n : 64;
+        e->memo_hash = (bc_word_t *)libsieve_malloc(e->memo_hash_alloc * sizeof(bc_word_t));
+        if (e->memo_hash == NULL) {
+            e->memo_hash = old;
+            e->memo_hash_alloc = n;
+            e->nomem = 1;
+            return;
+        }
+        memset(e->memo_hash, 0, e->memo_hash_alloc * sizeof(bc_word_t));
+        for (i = 0; i < n; i++) {
+            if (old[i])
+                *static_memo_slot(e, e->memo[old[i] - 1]) = old[i];
+        }
+        libsieve_free(old);
+    }
+
+    slot = static_memo_slot(e, pos);
+    if (*slot == 0) {
+        if (!static_grow((void **)&e->memo, &e->memo_alloc, e->memo_len + 1, sizeof(size_t))) {
+            e->nomem = 1;
+            return;
+        }
+        e->memo[e->memo_len++] = pos;
+        *slot = e->memo_len;
+    }
+    e->code[pos + 2] = *slot - 1;
+}
+
+static void static_emit_test(struct bc_emitter *e, test_t *t)
+{
+    testlist_t *tl;
+    bc_word_t count;
+    size_t pos;
+
+    /* A broken test never matches, as in libsieve_eval. */
+    if (t == NULL) {
+        pos = static_emit(e, BC_FALSE);
+        static_emit(e, 0);
+        e->code[pos + 1] = e->code_len;
+        return;
+    }
+
+    switch (t->type) {
+    case ANYOF:
+    case ALLOF:
+        pos = static_emit(e, t->type == ANYOF ? BC_ANYOF : BC_ALLOF);
+        static_emit(e, 0);
+        for (count = 0, tl = t->u.tl; tl != NULL; tl = tl->next)
+            count++;
+        static_emit(e, count);
+        for (tl = t->u.tl; tl != NULL; tl = tl->next)
+            static_emit_test(e, tl->t);
+        break;
+    case NOT:
+        pos = static_emit(e, BC_NOT);
+        static_emit(e, 0);
+        static_emit_test(e, t->u.t);
+        break;
+    case EXISTS:
+        pos = static_emit(e, BC_EXISTS);
+        static_emit(e, 0);
+        static_emit(e, 0);
+        static_emit_sl(e, t->u.sl);
+        break;
+    case SFALSE:
+        pos = static_emit(e, BC_FALSE);
+        static_emit(e, 0);
+        break;
+    case STRUE:
+        pos = static_emit(e, BC_TRUE);
+        static_emit(e, 0);
+        break;
+    case SIZE:
+        pos = static_emit(e, BC_SIZE);
+        static_emit(e, 0);
+        static_emit(e, 0);
+        static_emit(e, t->u.sz.t == OVER);
+        static_emit(e, t->u.sz.n);
+        break;
+    case HEADER:
+        pos = static_emit(e, BC_HEADER);
+        static_emit(e, 0);
+        static_emit(e, 0);
+        static_emit(e, static_match(t->u.h.comptag));
+        static_emit(e, t->u.h.compid);
+        static_emit_sl(e, t->u.h.sl);
+        static_emit_pl(e, t->u.h.pl, t->u.h.comptag, t->u.h.compid);
+        break;
+    case ADDRESS:
+    case ENVELOPE:
+        pos = static_emit(e, t->type == ADDRESS ? BC_ADDRESS : BC_ENVELOPE);
+        static_emit(e, 0);
+        static_emit(e, 0);
+        static_emit(e, static_match(t->u.ae.comptag));
+        static_emit(e, t->u.ae.compid);
+        static_emit(e, static_addrpart(t->u.ae.addrpart));
+        static_emit_sl(e, t->u.ae.sl);
+        static_emit_pl(e, t->u.ae.pl, t->u.ae.comptag, t->u.ae.compid);
+        break;
+    case HASFLAG:
+        pos = static_emit(e, BC_HASFLAG);
+        static_emit(e, 0);
+        static_emit_sl(e, t->u.hf.sl);
+        break;
+    default:
+        pos = static_emit(e, BC_FALSE);
+        static_emit(e, 0);
+        break;
+    }
+
+    if (!e->nomem)
+        e->code[pos + 1] = e->code_len;
+
+    switch (t->type) {
+    case EXISTS:
+    case SIZE:
+    case HEADER:
+    case ADDRESS:
+    case ENVELOPE:
+        static_memo(e, pos);
+        break;
+    }
+}
+
+/* Blocks recurse here, but never deeper than the parser allowed. */
+static void static_emit_commands(struct bc_emitter *e, commandlist_t *c)
+{
+    commandlist_t *i;
+    size_t pos, jmp, chain;
+
+    for (; c != NULL && !e->nomem; c = c->next) {
+        switch (c->type) {
+        case IF:
+            /* An elsif chain is emitted in this loop rather than by
+             * recursing. The jumps out of each arm are chained through
+             * their targets until the end of the chain is known. */
+            chain = 0;
+            for (i = c; i != NULL; ) {
+                pos = static_emit(e, BC_IF);
+                static_emit(e, 0);
+                static_emit_test(e, i->u.i.t);
+                static_emit_commands(e, i->u.i.do_then);
+                if (i->u.i.do_else) {
+                    jmp = static_emit(e, BC_JMP);
+                    static_emit(e, chain);
+                    chain = jmp + 1;
+                }
+                if (e->nomem)
+                    return;
+                e->code[pos + 1] = e->code_len;
+
+                if (i->u.i.do_else && i->u.i.do_else->type == IF
+                 && i->u.i.do_else->next == NULL) {
+                    i = i->u.i.do_else;
+                } else {
+                    static_emit_commands(e, i->u.i.do_else);
+                    i = NULL;
+                }
+            }
+            if (e->nomem)
+                return;
+            while (chain) {
+                jmp = chain - 1;
+                chain = e->code[jmp + 1];
+                e->code[jmp + 1] = e->code_len;
+            }
+            continue;
+        case REJCT:
+            pos = static_emit(e, BC_REJECT);
+            static_emit(e, 0);
+            static_emit_string(e, c->u.str);
+            break;
+        case FILEINTO:
+            pos = static_emit(e, BC_FILEINTO);
+            static_emit(e, 0);
+            static_emit_string(e, c->u.f.mailbox);
+            static_emit_sl(e, c->u.f.slflags);
+            break;
+        case REDIRECT:
+            pos = static_emit(e, BC_REDIRECT);
+            static_emit(e, 0);
+            static_emit_string(e, c->u.str);
+            break;
+        case KEEP:
+            pos = static_emit(e, BC_KEEP);
+            static_emit(e, 0);
+            static_emit_sl(e, c->u.f.slflags);
+            break;
+        case VACATION:
+            pos = static_emit(e, BC_VACATION);
+            static_emit(e, 0);
+            static_emit_string(e, c->u.v.subject);
+            static_emit_string(e, c->u.v.from);
+            static_emit_string(e, c->u.v.handle);
+            static_emit_string(e, c->u.v.message);
+            static_emit(e, c->u.v.days);
+            static_emit(e, c->u.v.mime);
+            static_emit_sl(e, c->u.v.addresses);
+            break;
+        case STOP:
+            pos = static_emit(e, BC_STOP);
+            static_emit(e, 0);
+            break;
+        case DISCARD:
+            pos = static_emit(e, BC_DISCARD);
+            static_emit(e, 0);
+            break;
+        case SETFLAG:
+        case ADDFLAG:
+        case REMOVEFLAG:
+            pos = static_emit(e, c->type == SETFLAG ? BC_SETFLAG
+                               : c->type == ADDFLAG ? BC_ADDFLAG : BC_REMOVEFLAG);
+            static_emit(e, 0);
+            static_emit_sl(e, c->u.sl);
+            break;
+        case NOTIFY:
+            pos = static_emit(e, BC_NOTIFY);
+            static_emit(e, 0);
+            static_emit_string(e, c->u.n.id);
+            static_emit_string(e, c->u.n.method);
+            static_emit_string(e, c->u.n.priority);
+            static_emit_string(e, c->u.n.message);
+            static_emit_sl(e, c->u.n.options);
+            break;
+        default:
+            /* Nothing to do at runtime, e.g. valid_notif. */
+            continue;
+        }
+
+        if (!e->nomem)
+            e->code[pos + 1] = e->code_len;
+    }
+}
+
+static bc_word_t static_require(struct support2 *r)
+{
+    bc_word_t bits = 0;
+
+    if (r->reject) bits |= BC_REQUIRE_REJECT;
+    if (r->notify) bits |= BC_REQUIRE_NOTIFY;
+    if (r->fileinto) bits |= BC_REQUIRE_FILEINTO;
+    if (r->vacation) bits |= BC_REQUIRE_VACATION;
+    if (r->envelope) bits |= BC_REQUIRE_ENVELOPE;
+    if (r->imap4flags) bits |= BC_REQUIRE_IMAP4FLAGS;
+    if (r->regex) bits |= BC_REQUIRE_REGEX;
+    if (r->subaddress) bits |= BC_REQUIRE_SUBADDRESS;
+    if (r->relational) bits |= BC_REQUIRE_RELATIONAL;
+
+    return bits;
+}
+
+int libsieve_bc_emit(commandlist_t *cmds, struct support2 *require,
+                     struct bc_header **image)
+{
+    struct bc_emitter e;
+    struct bc_header *h;
+    char *p;
+
+    memset(&e, 0, sizeof(struct bc_emitter));
+
+    static_emit_commands(&e, cmds);
+
+    h = NULL;
+    if (!e.nomem)
+        h = (struct bc_header *)libsieve_malloc(sizeof(struct bc_header)
+                + sizeof(bc_word_t) * (e.code_len + 2 * e.regex_len)
+                + e.str_len);
+
+    if (h != NULL) {
+        memset(h, 0, sizeof(struct bc_header));
+        memcpy(h->magic, BC_MAGIC, sizeof(BC_MAGIC));
+        h->version = BC_VERSION;
+        h->byteorder = BC_BYTEORDER;
+        h->require = static_require(require);
+        h->code_len = e.code_len;
+        h->regex_len = e.regex_len;
+        h->str_len = e.str_len;
+        h->memo_len = e.memo_len;
+
+        p = (char *)(h + 1);
+        if (e.code_len)
+            memcpy(p, e.code, sizeof(bc_word_t) * e.code_len);
+        p += sizeof(bc_word_t) * e.code_len;
+        if (e.regex_len)
+            memcpy(p, e.regex, sizeof(bc_word_t) * 2 * e.regex_len);
+        p += sizeof(bc_word_t) * 2 * e.regex_len;
+        if (e.str_len)
+            memcpy(p, e.str, e.str_len);
+    }
+
+    libsieve_free(e.code);
+    libsieve_free(e.regex);
+    libsieve_free(e.str);
+    libsieve_free(e.hash);
+    libsieve_free(e.memo);
+    libsieve_free(e.memo_hash);
+
+    *image = h;
+
+    return h ? SIEVE2_OK : SIEVE2_ERROR_NOMEM;
+}
+
+/* The image may have come from disk, so all of it is checked once
+ * when it is bound. After that, the evaluator trusts every word. */
+static int static_check_string(const struct bc_header *h, bc_word_t ref, int optional)
+{
+    return ref ? ref <= h->str_len : optional;
+}
+
+/* Checks the list at pc, and returns the word after it, or 0. */
+static bc_word_t static_check_list(const struct bc_header *h, bc_word_t pc,
+                                   bc_word_t end, int regex)
+{
+    const bc_word_t *code = BC_CODE(h);
+    bc_word_t i, n;
+
+    if (pc >= end || code[pc] > end - pc - 1)
+        return 0;
+
+    n = code[pc];
+    for (i = 1; i <= n; i++) {
+        if (regex ? code[pc + i] >= h->regex_len
+                  : !static_check_string(h, code[pc + i], 0))
+            return 0;
+    }
+
+    return pc + 1 + n;
+}
+
+/* Nested tests are checked with a stack of their own, grown as
+ * needed, since an image from disk might nest them arbitrarily deep. */
+struct bc_checker {
+    const struct bc_header *h;
+    struct {
+        bc_word_t end, left;
+    } *stack;
+    int top, size;
+    int depth;          /* the deepest the stack got */
+    int nomem;
+};
+
+/* Checks the test at pc, and returns the word after it, or 0. */
+static bc_word_t static_check_test(struct bc_checker *v, bc_word_t pc)
+{
+    const struct bc_header *h = v->h;
+    const bc_word_t *code = BC_CODE(h);
+    bc_word_t end, p;
+    void *tmp;
+
+    v->top = 0;
+    for (;;) {
+        if (pc + 2 > h->code_len)
+            return 0;
+        end = code[pc + 1];
+        if (end < pc + 2 || end > h->code_len)
+            return 0;
+
+        switch (code[pc]) {
+        case BC_NOT:
+        case BC_ANYOF:
+        case BC_ALLOF:
+            p = pc + (code[pc] == BC_NOT ? 2 : 3);
+            if (p > end)
+                return 0;
+            if (code[pc] != BC_NOT && code[pc + 2] == 0)
+                break;
+            if (v->top == v->size) {
+                tmp = libsieve_realloc(v->stack, 2 * (v->size + 8) * sizeof(*v->stack));
+                if (tmp == NULL) {
+                    v->nomem = 1;
+                    return 0;
+                }
+                v->stack = tmp;
+                v->size = 2 * (v->size + 8);
+            }
+            v->stack[v->top].end = end;
+            v->stack[v->top].left = (code[pc] == BC_NOT ? 1 : code[pc + 2]);
+            if (++v->top > v->depth)
+                v->depth = v->top;
+            pc = p;
+            continue;
+        case BC_TRUE:
+        case BC_FALSE:
+            p = pc + 2;
+            break;
+        case BC_HASFLAG:
+            p = static_check_list(h, pc + 2, end, 0);
+            break;
+        case BC_EXISTS:
+            p = 0;
+            if (pc + 3 <= end && code[pc + 2] < h->memo_len)
+                p = static_check_list(h, pc + 3, end, 0);
+            break;
+        case BC_SIZE:
+            p = pc + 5;
+            if (p > end || code[pc + 2] >= h->memo_len)
+                return 0;
+            break;
+        case BC_HEADER:
+        case BC_ADDRESS:
+        case BC_ENVELOPE:
+            p = pc + (code[pc] == BC_HEADER ? 5 : 6);
+            if (p > end
+             || code[pc + 2] >= h->memo_len
+             || libsieve_bc_comptag(code[pc + 3]) == 0
+             || code[pc + 4] < COMPARATOR_OCTET
+             || code[pc + 4] > COMPARATOR_ASCII_NUMERIC
+             || (code[pc] != BC_HEADER && code[pc + 5] > ADDRESS_DETAIL))
+                return 0;
+            p = static_check_list(h, p, end, 0);
+            if (p)
+                p = static_check_list(h, p, end, code[pc + 3] == BC_MATCH_REGEX);
+            break;
+        default:
+            return 0;
+        }
+
+        if (p != end)
+            return 0;
+
+        /* The last test inside a nested one has to end with it. */
+        while (v->top > 0 && --v->stack[v->top - 1].left == 0) {
+            if (p != v->stack[v->top - 1].end)
+                return 0;
+            v->top--;
+        }
+
+        if (v->top == 0)
+            return p;
+        pc = p;
+    }
+}
+
+/* Decodes the commands in order, then makes sure
+ * that every jump lands on one of them, or the end. */
+static int static_check_code(const struct bc_header *h, int *depth)
+{
+    const bc_word_t *code = BC_CODE(h);
+    bc_word_t pc, p, next, len = h->code_len;
+    struct bc_checker v;
+    unsigned char *start;
+    int ok = 1;
+
+    start = (unsigned char *)libsieve_malloc(len + 1);
+    if (start == NULL)
+        return SIEVE2_ERROR_NOMEM;
+    memset(&v, 0, sizeof(struct bc_checker));
+    v.h = h;
+    memset(start, 0, len + 1);
+    start[len] = 1;
+
+    for (pc = 0; pc < len && ok; pc = p) {
+        start[pc] = 1;
+        if (pc + 2 > len) {
+            ok = 0;
+            break;
+        }
+        next = code[pc + 1];
+        if (next < pc + 2 || next > len) {
+            ok = 0;
+            break;
+        }
+
+        switch (code[pc]) {
+        case BC_IF:
+            /* The then block starts right after the test. */
+            p = static_check_test(&v, pc + 2);
+            ok = (p != 0 && p <= next);
+            continue;
+        case BC_JMP:
+            p = pc + 2;
+            continue;
+        case BC_STOP:
+        case BC_DISCARD:
+            p = pc + 2;
+            break;
+        case BC_KEEP:
+        case BC_SETFLAG:
+        case BC_ADDFLAG:
+        case BC_REMOVEFLAG:
+            p = static_check_list(h, pc + 2, next, 0);
+            break;
+        case BC_REJECT:
+        case BC_REDIRECT:
+            p = 0;
+            if (pc + 3 <= next && static_check_string(h, code[pc + 2], 0))
+                p = pc + 3;
+            break;
+        case BC_FILEINTO:
+            p = 0;
+            if (pc + 3 <= next && static_check_string(h, code[pc + 2], 0))
+                p = static_check_list(h, pc + 3, next, 0);
+            break;
+        case BC_VACATION:
+            p = 0;
+            if (pc + 8 <= next
+             && static_check_string(h, code[pc + 2], 1)
+             && static_check_string(h, code[pc + 3], 1)
+             && static_check_string(h, code[pc + 4], 1)
+             && static_check_string(h, code[pc + 5], 0))
+                p = static_check_list(h, pc + 8, next, 0);
+            break;
+        case BC_NOTIFY:
+            p = 0;
+            if (pc + 6 <= next
+             && static_check_string(h, code[pc + 2], 1)
+             && static_check_string(h, code[pc + 3], 1)
+             && static_check_string(h, code[pc + 4], 1)
+             && static_check_string(h, code[pc + 5], 1))
+                p = static_check_list(h, pc + 6, next, 0);
+            break;
+        default:
+            p = 0;
+            break;
+        }
+
+        if (p != next)
+            ok = 0;
+    }
+
+    for (pc = 0; pc < len && ok; pc = p) {
+        next = code[pc + 1];
+        if (code[pc] == BC_IF) {
+            p = code[pc + 3];
+            ok = start[next];
+        } else if (code[pc] == BC_JMP) {
+            p = pc + 2;
+            ok = start[next];
+        } else {
+            p = next;
+        }
+    }
+
+    libsieve_free(start);
+    libsieve_free(v.stack);
+
+    *depth = v.depth;
+
+    if (v.nomem)
+        return SIEVE2_ERROR_NOMEM;
+    return ok ? SIEVE2_OK : SIEVE2_ERROR_BYTECODE;
+}
+
+/* Tests with a few patterns are quick enough one pattern at a time. */
+#define BC_REGEXSET_MIN 4
+
+/* Makes all the patterns of a :regex test into one regex, where they
+ * are all compiled the same way. Returns NULL if it can't be done. */
+static regex_t *static_bind_regexset(const struct bc_header *h,
+                                     const bc_word_t *patterns, const char **pats)
+{
+    const bc_word_t *rx = BC_REGEX(h);
+    bc_word_t j, cflags = rx[2 * patterns[1] + 1];
+    regex_t *reg;
+
+    for (j = 0; j < patterns[0]; j++) {
+        if (rx[2 * patterns[1 + j] + 1] != cflags)
+            return NULL;
+        pats[j] = BC_STRINGS(h) + rx[2 * patterns[1 + j]] - 1;
+    }
+
+    reg = (regex_t *)libsieve_malloc(sizeof(regex_t));
+    if (reg != NULL && libsieve_regcomp_set(reg, pats, patterns[0], cflags) != 0) {
+        libsieve_free(reg);
+        reg = NULL;
+    }
+
+    return reg;
+}
+
+/* Makes the patterns of each test ready for its comparator, and one
+ * regex for each :regex test with enough patterns. Any which can't be
+ * made are simply done the slow way. */
+static void static_bind_sets(struct sieve2_script *s)
+{
+    const struct bc_header *h = s->image;
+    const bc_word_t *code = BC_CODE(h), *w, *patterns;
+    const char **pats = NULL;
+    bc_word_t *tests, i, j;
+    void *tmp;
+    int comptag;
+
+    s->regexset = NULL;
+    s->patterns = NULL;
+    if (h->memo_len == 0)
+        return;
+
+    tests = (bc_word_t *)libsieve_malloc(h->memo_len * sizeof(bc_word_t));
+    if (tests == NULL)
+        return;
+    libsieve_bc_memo_tests(h, tests);
+
+    for (i = 0; i < h->memo_len; i++) {
+        w = code + tests[i];
+        if (tests[i] == 0 || (w[0] != BC_HEADER && w[0] != BC_ADDRESS && w[0] != BC_ENVELOPE))
+            continue;
+        comptag = libsieve_bc_comptag(w[3]);
+        patterns = w + (w[0] == BC_HEADER ? 5 : 6);
+        patterns += 1 + patterns[0];
+        if (patterns[0] == 0)
+            continue;
+
+        tmp = libsieve_realloc(pats, patterns[0] * sizeof(char *));
+        if (tmp == NULL)
+            break;
+        pats = (const char **)tmp;
+
+        if (comptag == REGEX) {
+            if (patterns[0] < BC_REGEXSET_MIN)
+                continue;
+            if (s->regexset == NULL) {
+                s->regexset = (regex_t **)libsieve_malloc(h->memo_len * sizeof(regex_t *));
+                if (s->regexset == NULL)
+                    break;
+                memset(s->regexset, 0, h->memo_len * sizeof(regex_t *));
+            }
+            s->regexset[i] = static_bind_regexset(h, patterns, pats);
+            continue;
+        }
+
+        if (s->patterns == NULL) {
+            s->patterns = (comparator_patterns_t **)libsieve_malloc(h->memo_len * sizeof(comparator_patterns_t *));
+            if (s->patterns == NULL)
+                break;
+            memset(s->patterns, 0, h->memo_len * sizeof(comparator_patterns_t *));
+        }
+        for (j = 0; j < patterns[0]; j++)
+            pats[j] = BC_STRINGS(h) + patterns[1 + j] - 1;
+        s->patterns[i] = libsieve_comparator_compile(w[4], comptag, pats, patterns[0]);
+    }
+
+    libsieve_free(pats);
+    libsieve_free(tests);
+}
+
+static void static_add_header(struct sieve2_script *s, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < s->nheaders; i++)
+        if (strcasecmp(s->headers[i], name) == 0)
+            return;
+    s->headers[s->nheaders++] = name;
+}
+
+/* Every header named by a test of the message, and those vacation
+ * looks at, for the getheaders callback. Tests which are the same
+ * share a memo slot, so it's enough to look at one test per slot. */
+static void static_bind_headers(struct sieve2_script *s)
+{
+    const struct bc_header *h = s->image;
+    const bc_word_t *code = BC_CODE(h), *w, *names;
+    bc_word_t *tests, i, j;
+    size_t max = 0;
+
+    s->headers = NULL;
+    s->nheaders = 0;
+    s->header_ids = NULL;
+
+    if (h->require & BC_REQUIRE_VACATION)
+        while (libsieve_vacation_headers[max])
+            max++;
+
+    tests = NULL;
+    if (h->memo_len > 0) {
+        tests = (bc_word_t *)libsieve_malloc(h->memo_len * sizeof(bc_word_t));
+        if (tests == NULL)
+            return;
+        libsieve_bc_memo_tests(h, tests);
+    }
+
+    /* Where the header names are in each test, if it has any. */
+    for (i = 0; i < h->memo_len; i++) {
+        w = code + tests[i];
+        if (tests[i] == 0)
+            continue;
+        switch (w[0]) {
+        case BC_EXISTS:
+            tests[i] += 3;
+            break;
+        case BC_HEADER:
+            tests[i] += 5;
+            break;
+        case BC_ADDRESS:
+            tests[i] += 6;
+            break;
+        default:
+            tests[i] = 0;
+            continue;
+        }
+        max += code[tests[i]];
+    }
+
+    if (max > 0) {
+        s->headers = (const char **)libsieve_malloc(max * sizeof(char *));
+        s->header_ids = (unsigned char *)libsieve_malloc(h->str_len + 1);
+        if (s->header_ids)
+            memset(s->header_ids, 0, h->str_len + 1);
+    }
+
+    for (i = 0; s->headers && i < h->memo_len; i++) {
+        if (tests[i] == 0)
+            continue;
+        names = code + tests[i];
+        for (j = 0; j < names[0]; j++) {
+            const char *name = BC_STRINGS(h) + names[1 + j] - 1;
+            static_add_header(s, name);
+            if (s->header_ids)
+                s->header_ids[names[1 + j]] = libsieve_header_id(name, strlen(name)) + 1;
+        }
+    }
+
+    if (s->headers && (h->require & BC_REQUIRE_VACATION))
+        for (j = 0; libsieve_vacation_headers[j]; j++)
+            static_add_header(s, libsieve_vacation_headers[j]);
+
+    libsieve_free(tests);
+}
+
+int libsieve_bc_bind(struct sieve2_script *s)
+{
+    const struct bc_header *h = s->image;
+    const bc_word_t *rx;
+    const char *strings;
+    bc_word_t i, ref;
+    struct support2 *r = &s->require;
+    int res;
+
+    if (s->length < sizeof(struct bc_header)
+     || memcmp(h->magic, BC_MAGIC, sizeof(BC_MAGIC)) != 0
+     || h->version != BC_VERSION
+     || h->byteorder != BC_BYTEORDER)
+        return SIEVE2_ERROR_BYTECODE;
+
+    /* Don't let the sizes overflow when they are added up. */
+    if (h->code_len > s->length / sizeof(bc_word_t)
+     || h->regex_len > s->length / sizeof(bc_word_t)
+     || h->str_len > s->length
+     || h->memo_len > h->code_len
+     || BC_LENGTH(h) != s->length)
+        return SIEVE2_ERROR_BYTECODE;
+
+    /* Then any reference into the string table is terminated. */
+    strings = BC_STRINGS(h);
+    if (h->str_len && strings[h->str_len - 1] != '\0')
+        return SIEVE2_ERROR_BYTECODE;
+
+    if ((res = static_check_code(h, &s->depth)) != SIEVE2_OK)
+        return res;
+
+    memset(r, 0, sizeof(struct support2));
+    r->reject = (h->require & BC_REQUIRE_REJECT) ? TRUE : FALSE;
+    r->notify = (h->require & BC_REQUIRE_NOTIFY) ? TRUE : FALSE;
+    r->fileinto = (h->require & BC_REQUIRE_FILEINTO) ? TRUE : FALSE;
+    r->vacation = (h->require & BC_REQUIRE_VACATION) ? TRUE : FALSE;
+    r->envelope = (h->require & BC_REQUIRE_ENVELOPE) ? TRUE : FALSE;
+    r->imap4flags = (h->require & BC_REQUIRE_IMAP4FLAGS) ? TRUE : FALSE;
+    r->regex = (h->require & BC_REQUIRE_REGEX) ? TRUE : FALSE;
+    r->subaddress = (h->require & BC_REQUIRE_SUBADDRESS) ? TRUE : FALSE;
+    r->relational = (h->require & BC_REQUIRE_RELATIONAL) ? TRUE : FALSE;
+
+    static_bind_sets(s);
+    static_bind_headers(s);
+
+    s->regex = NULL;
+    if (h->regex_len == 0)
+        return SIEVE2_OK;
+
+    /* Regexes are the one thing which can't be mapped in as they are. */
+    s->regex = (regex_t *)libsieve_malloc(h->regex_len * sizeof(regex_t));
+    if (s->regex == NULL)
+        return SIEVE2_ERROR_NOMEM;
+
+    rx = BC_REGEX(h);
+    for (i = 0; i < h->regex_len; i++) {
+        ref = rx[2 * i];
+        if (ref == 0 || ref > h->str_len
+         || libsieve_regcomp(&s->regex[i], strings + ref - 1, rx[2 * i + 1]) != 0) {
+            while (i > 0)
+                libsieve_regfree(&s->regex[--i]);
+            libsieve_free(s->regex);
+            s->regex = NULL;
+            return SIEVE2_ERROR_BYTECODE;
+        }
+    }
+
+    return SIEVE2_OK;
+}
+
+void libsieve_bc_unbind(struct sieve2_script *s)
+{
+    bc_word_t i;
+
+    libsieve_free(s->headers);
+    s->headers = NULL;
+    s->nheaders = 0;
+    libsieve_free(s->header_ids);
+    s->header_ids = NULL;
+
+    if (s->patterns) {
+        for (i = 0; i < s->image->memo_len; i++)
+            libsieve_comparator_free(s->patterns[i]);
+        libsieve_free(s->patterns);
+        s->patterns = NULL;
+    }
+
+    if (s->regexset) {
+        for (i = 0; i < s->image->memo_len; i++) {
+            if (s->regexset[i]) {
+                libsieve_regfree(s->regexset[i]);
+                libsieve_free(s->regexset[i]);
+            }
+        }
+        libsieve_free(s->regexset);
+        s->regexset = NULL;
+    }
+
+    if (s->regex) {
+        for (i = 0; i < s->image->regex_len; i++)
+            libsieve_regfree(&s->regex[i]);
+        libsieve_free(s->regex);
+        s->regex = NULL;
+    }
+}
+
+/* The image has been checked, so tests are simply walked in order:
+ * the tests inside a not, anyof or allof follow straight after it. */
+void libsieve_bc_memo_tests(const struct bc_header *h, bc_word_t *tests)
+{
+    const bc_word_t *code = BC_CODE(h);
+    bc_word_t pc, p, end;
+
+    memset(tests, 0, h->memo_len * sizeof(bc_word_t));
+
+    for (pc = 0; pc < h->code_len; ) {
+        if (code[pc] == BC_JMP) {
+            pc += 2;
+            continue;
+        } else if (code[pc] != BC_IF) {
+            pc = code[pc + 1];
+            continue;
+        }
+        /* The then block starts where the test ends. */
+        for (p = pc + 2, end = code[pc + 3]; p < end; ) {
+            switch (code[p]) {
+            case BC_NOT:
+                p += 2;
+                continue;
+            case BC_ANYOF:
+            case BC_ALLOF:
+                p += 3;
+                continue;
+            case BC_EXISTS:
+            case BC_SIZE:
+            case BC_HEADER:
+            case BC_ADDRESS:
+            case BC_ENVELOPE:
+                if (tests[code[p + 2]] == 0)
+                    tests[code[p + 2]] = p;
+                break;
+            }
+            p = code[p + 1];
+        }
+        pc = end;
+    }
+}
+
+/* Keys are a word for each word of the test, with each string or
+ * regex reference replaced by the string itself. */
+struct bc_key {
+    char *buf;
+    size_t len, used;
+};
+
+static void static_key(struct bc_key *k, const void *data, size_t len)
+{
+    if (k->used < k->len)
+        memcpy(k->buf + k->used, data, (k->len - k->used < len ? k->len - k->used : len));
+    k->used += len;
+}
+
+static void static_key_word(struct bc_key *k, bc_word_t w)
+{
+    static_key(k, &w, sizeof(bc_word_t));
+}
+
+/* Header names are folded, since case doesn't matter in them. */
+static void static_key_string(struct bc_key *k, const struct bc_header *h,
+                              bc_word_t ref, int fold)
+{
+    const char *s = BC_STRINGS(h) + ref - 1;
+    char c;
+
+    if (!fold) {
+        static_key(k, s, strlen(s) + 1);
+        return;
+    }
+    do {
+        c = tolower((unsigned char)*s);
+        static_key(k, &c, 1);
+    } while (*s++);
+}
+
+/* Returns the word after the list. */
+static bc_word_t static_key_list(struct bc_key *k, const struct bc_header *h,
+                                 bc_word_t pc, int regex, int fold)
+{
+    const bc_word_t *code = BC_CODE(h), *rx = BC_REGEX(h);
+    bc_word_t i, n = code[pc];
+
+    static_key_word(k, n);
+    for (i = 1; i <= n; i++) {
+        if (regex) {
+            static_key_string(k, h, rx[2 * code[pc + i]], 0);
+            static_key_word(k, rx[2 * code[pc + i] + 1]);
+        } else {
+            static_key_string(k, h, code[pc + i], fold);
+        }
+    }
+
+    return pc + 1 + n;
+}
+
+size_t libsieve_bc_test_key(const struct bc_header *h, bc_word_t pc,
+                            char *buf, size_t len)
+{
+    const bc_word_t *code = BC_CODE(h);
+    struct bc_key k;
+    bc_word_t p;
+
+    k.buf = buf;
+    k.len = len;
+    k.used = 0;
+
+    /* The memo slot is left out; it is only good within one image. */
+    static_key_word(&k, code[pc]);
+    switch (code[pc]) {
+    case BC_EXISTS:
+        static_key_list(&k, h, pc + 3, 0, 1);
+        break;
+    case BC_SIZE:
+        static_key_word(&k, code[pc + 3]);
+        static_key_word(&k, code[pc + 4]);
+        break;
+    case BC_HEADER:
+    case BC_ADDRESS:
+    case BC_ENVELOPE:
+        for (p = pc + 3; p < pc + (code[pc] == BC_HEADER ? 5 : 6); p++)
+            static_key_word(&k, code[p]);
+        p = static_key_list(&k, h, p, 0, 1);
+        static_key_list(&k, h, p, code[pc + 3] == BC_MATCH_REGEX, 0);
+        break;
+    }
+
+    return k.used;
+}
@@ -0,0 +1,143 @@
+/* bytecode.h -- compiled script format
+ * $Id$
+ */
+/* * * *
+ * Licensed under the GNU Lesser General Public License (LGPL)
+ * version 2.1, and other versions at the author's discretion.
+ * * * */
+
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tree.h"
+#include "context2.h"
+
+/* A compiled script is a single block of memory which holds no
+ * pointers, so that it can be written to disk and mapped back in
+ * without being parsed or fixed up. It looks like this:
+ *
+ *   struct bc_header
+ *   bc_word_t code[code_len]
+ *   bc_word_t regex[regex_len][2]   (string, cflags)
+ *   char strings[str_len]
+ *
+ * Every instruction starts with its opcode and the index of the
+ * instruction which follows it; for BC_IF that's where to go when
+ * the test fails, and for BC_JMP it's simply the target. Jumps only
+ * go forward, so every script finishes. Tests follow directly after
+ * BC_IF, BC_NOT, BC_ANYOF and BC_ALLOF.
+ *
+ * Strings are referenced by their offset into the string table plus
+ * one, so that zero can stand for NULL. A list of strings is a count
+ * followed by that many references. Regex patterns are listed by
+ * their index in the regex table instead.
+ *
+ * Tests which only look at the message have a memo slot, which is
+ * shared by every test in the script written the same way. Each
+ * one is only worked out once per message.
+ *
+ * The format is in host byte order; images from another
+ * byte order or another version are refused when loaded.
+ */
+
+#define BC_MAGIC       "SIEVEBC"
+#define BC_VERSION     2
+#define BC_BYTEORDER   0x01020304
+
+typedef uint32_t bc_word_t;
+
+struct bc_header {
+    char magic[8];
+    bc_word_t version;
+    bc_word_t byteorder;
+    bc_word_t require;       /* BC_REQUIRE_* bits */
+    bc_word_t code_len;      /* in words */
+    bc_word_t regex_len;     /* in entries */
+    bc_word_t str_len;       /* in bytes */
+    bc_word_t memo_len;      /* memo slots for tests; see above */
+};
+
+enum bc_require {
+    BC_REQUIRE_REJECT     = 1 << 0,
+    BC_REQUIRE_NOTIFY     = 1 << 1,
+    BC_REQUIRE_FILEINTO   = 1 << 2,
+    BC_REQUIRE_VACATION   = 1 << 3,
+    BC_REQUIRE_ENVELOPE   = 1 << 4,
+    BC_REQUIRE_IMAP4FLAGS = 1 << 5,
+    BC_REQUIRE_REGEX      = 1 << 6,
+    BC_REQUIRE_SUBADDRESS = 1 << 7,
+    BC_REQUIRE_RELATIONAL = 1 << 8
+};
+
+enum bc_op {
+    /* commands */
+    BC_JMP = 1,     /* target */
+    BC_IF,          /* else, test */
+    BC_STOP,
+    BC_KEEP,        /* flags */
+    BC_DISCARD,
+    BC_REJECT,      /* message */
+    BC_FILEINTO,    /* mailbox, flags */
+    BC_REDIRECT,    /* address */
+    BC_VACATION,    /* subject, from, handle, message, days, mime, addresses */
+    BC_NOTIFY,      /* id, method, priority, message, options */
+    BC_SETFLAG,     /* flags */
+    BC_ADDFLAG,     /* flags */
+    BC_REMOVEFLAG,  /* flags */
+
+    /* tests */
+    BC_TRUE = 32,
+    BC_FALSE,
+    BC_NOT,         /* test */
+    BC_ANYOF,       /* count, tests */
+    BC_ALLOF,       /* count, tests */
+    BC_EXISTS,      /* memo, headers */
+    BC_SIZE,        /* memo, over, size */
+    BC_HEADER,      /* memo, match, comparator, headers, patterns */
+    BC_ADDRESS,     /* memo, match, comparator, address part, headers, patterns */
+    BC_ENVELOPE,    /* memo, match, comparator, address part, headers, patterns */
+    BC_HASFLAG      /* flags */
+};
+
+/* Match types, with the relational in the bits above 10 as in the tree. */
+enum bc_match {
+    BC_MATCH_IS = 1,
+    BC_MATCH_CONTAINS,
+    BC_MATCH_MATCHES,
+    BC_MATCH_REGEX,
+    BC_MATCH_VALUE,
+    BC_MATCH_COUNT
+};
+
+#define BC_CODE(h)     ((const bc_word_t *)((h) + 1))
+#define BC_REGEX(h)    (BC_CODE(h) + (h)->code_len)
+#define BC_STRINGS(h)  ((const char *)(BC_REGEX(h) + 2 * (h)->regex_len))
+#define BC_LENGTH(h)   (sizeof(struct bc_header) \
+                         + sizeof(bc_word_t) * ((h)->code_len + 2 * (h)->regex_len) \
+                         + (h)->str_len)
+
+/* Turn a parsed script into a newly allocated image. */
+int libsieve_bc_emit(commandlist_t *cmds, struct support2 *require,
+                     struct bc_header **image);
+
+/* Check an image and get a script ready to execute it. */
+int libsieve_bc_bind(struct sieve2_script *script);
+void libsieve_bc_unbind(struct sieve2_script *script);
+
+/* Translate a match word from the image back into a comptag. */
+int libsieve_bc_comptag(bc_word_t match);
+
+/* For each memo slot of a bound image, where a test using it is. */
+void libsieve_bc_memo_tests(const struct bc_header *h, bc_word_t *tests);
+
+/* Spell out the test at pc of a bound image into buf, with its strings
+ * and regexes written in full, so the same test in any image comes out
+ * the same. Returns the length of the whole key, which may be more
+ * than len; then only len bytes were written. */
+size_t libsieve_bc_test_key(const struct bc_header *h, bc_word_t pc,
+                            char *buf, size_t len);
+
+#endif /* BYTECODE_H */
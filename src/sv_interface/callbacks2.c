@@ -13,6 +13,7 @@
 #include "config.h"
 #endif
 
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
@@ -29,28 +30,271 @@
 /* sv_util */
 #include "src/sv_util/util.h"
 
+/* With the action list on, actions are put on it instead of being
+ * called back; everything they refer to is copied into the arena,
+ * as none of it lasts beyond the action. See sieve2_setactionlist. */
+static sieve2_action_t *static_action(struct sieve2_context *c, sieve2_values_t code)
+{
+    struct actionlist2 *l = &c->actionlist;
+    sieve2_action_t *a;
+    int size;
+
+    if (l->npending == l->pending_size) {
+        size = (l->pending_size ? l->pending_size * 2 : 8);
+        a = (sieve2_action_t *)libsieve_realloc(l->pending, size * sizeof(sieve2_action_t));
+        if (a == NULL) {
+            l->failed = TRUE;
+            return NULL;
+        }
+        l->pending = a;
+        l->pending_size = size;
+    }
+
+    a = &l->pending[l->npending++];
+    memset(a, 0, sizeof(sieve2_action_t));
+    a->code = code;
+
+    return a;
+}
+
+static const char *static_copy(struct sieve2_context *c, const char *str)
+{
+    char *p;
+
+    if (str == NULL)
+        return NULL;
+
+    if ((p = libsieve_arena_strdup(&c->actionlist.arena, str)) == NULL)
+        c->actionlist.failed = TRUE;
+
+    return p;
+}
+
+/* From either a list the script gave, or the current flags. */
+static char **static_copy_list(struct sieve2_context *c, char **list, stringlist_t *sl)
+{
+    stringlist_t *s;
+    char **copy;
+    size_t n = 0;
+
+    if (list) {
+        while (list[n])
+            n++;
+    } else {
+        for (s = sl; s != NULL; s = s->next)
+            n++;
+    }
+
+    copy = (char **)libsieve_arena_alloc(&c->actionlist.arena, (n + 1) * sizeof(char *));
+    if (copy == NULL) {
+        c->actionlist.failed = TRUE;
+        return NULL;
+    }
+
+    n = 0;
+    if (list) {
+        for (; list[n]; n++)
+            copy[n] = (char *)static_copy(c, list[n]);
+    } else {
+        for (s = sl; s != NULL; s = s->next)
+            copy[n++] = (char *)static_copy(c, s->s);
+    }
+    copy[n] = NULL;
+
+    return copy;
+}
+
+/* What's left to do when the script failed, or there was
+ * no memory to say: keep, as though there were no script. */
+static const sieve2_action_t static_keep = { SIEVE2_ACTION_KEEP, TRUE, { { NULL } } };
+
+/* Clear out the lists of the last call to execute,
+ * and make room for those of this one. */
+int libsieve_actionlist_begin(struct sieve2_context *c, int count)
+{
+    struct actionlist2 *l = &c->actionlist;
+    int i;
+
+    libsieve_arena_clear(&l->arena);
+    l->lists = NULL;
+    l->nlists = 0;
+    l->npending = 0;
+    l->failed = FALSE;
+
+    if (!l->on || count <= 0)
+        return SIEVE2_OK;
+
+    l->lists = (struct actions2list *)libsieve_arena_alloc(&l->arena,
+                    count * sizeof(struct actions2list));
+    if (l->lists == NULL)
+        return SIEVE2_ERROR_NOMEM;
+
+    /* Those which aren't run at all are kept. */
+    for (i = 0; i < count; i++) {
+        l->lists[i].actions = &static_keep;
+        l->lists[i].count = 1;
+    }
+    l->nlists = count;
+
+    return SIEVE2_OK;
+}
+
+/* Flags are merged without regard to case, as IMAP does. */
+static char **static_merge_flags(struct sieve2_context *c, char **a, char **b)
+{
+    char **merged;
+    size_t na = 0, nb = 0, i, j, n;
+
+    if (b == NULL || b[0] == NULL)
+        return a;
+    if (a == NULL || a[0] == NULL)
+        return b;
+
+    while (a[na])
+        na++;
+    while (b[nb])
+        nb++;
+
+    merged = (char **)libsieve_arena_alloc(&c->actionlist.arena, (na + nb + 1) * sizeof(char *));
+    if (merged == NULL) {
+        c->actionlist.failed = TRUE;
+        return a;
+    }
+
+    memcpy(merged, a, na * sizeof(char *));
+    for (n = na, j = 0; j < nb; j++) {
+        for (i = 0; i < n; i++)
+            if (strcasecmp(merged[i], b[j]) == 0)
+                break;
+        if (i == n)
+            merged[n++] = b[j];
+    }
+    merged[n] = NULL;
+
+    return merged;
+}
+
+/* The same as an action already on the list, which it can go with? */
+static sieve2_action_t *static_same_action(sieve2_action_t *list, int n, sieve2_action_t *a)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (list[i].code != a->code)
+            continue;
+        switch (a->code) {
+        case SIEVE2_ACTION_KEEP:
+            return &list[i];
+        case SIEVE2_ACTION_FILEINTO:
+            if (strcmp(list[i].u.fileinto.mailbox, a->u.fileinto.mailbox) == 0)
+                return &list[i];
+            break;
+        case SIEVE2_ACTION_REDIRECT:
+            if (strcmp(list[i].u.redirect.address, a->u.redirect.address) == 0)
+                return &list[i];
+            break;
+        default:
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/* Turn the actions the script took into what's left to do. Duplicates
+ * are dropped, but their flags are kept, and the implicit keep goes on
+ * the end if nothing cancelled it. The result of the script is given,
+ * as its actions don't count if it failed. */
+int libsieve_actionlist_end(struct sieve2_context *c, int which, int res)
+{
+    struct actionlist2 *l = &c->actionlist;
+    sieve2_action_t *list, *a, *same;
+    int i, n = 0;
+
+    if (!l->on || which < 0 || which >= l->nlists)
+        return res;
+
+    if (res != SIEVE2_OK || l->failed)
+        goto keep;
+
+    list = (sieve2_action_t *)libsieve_arena_alloc(&l->arena,
+                (l->npending + 1) * sizeof(sieve2_action_t));
+    if (list == NULL)
+        goto nomem;
+
+    for (i = 0; i < l->npending; i++) {
+        a = &l->pending[i];
+        if ((same = static_same_action(list, n, a)) == NULL) {
+            list[n++] = *a;
+        } else if (a->code == SIEVE2_ACTION_FILEINTO) {
+            same->u.fileinto.flags = static_merge_flags(c,
+                    same->u.fileinto.flags, a->u.fileinto.flags);
+        } else if (a->code == SIEVE2_ACTION_KEEP) {
+            same->u.keep.flags = static_merge_flags(c,
+                    same->u.keep.flags, a->u.keep.flags);
+        }
+    }
+
+    /* RFC 5228: keep, fileinto, redirect, reject and discard
+     * each cancel the implicit keep; the rest do not. */
+    if (!(c->exec.actions.keep || c->exec.actions.fileinto
+       || c->exec.actions.redirect || c->exec.actions.reject
+       || c->exec.actions.discard)) {
+        a = &list[n++];
+        memset(a, 0, sizeof(sieve2_action_t));
+        a->code = SIEVE2_ACTION_KEEP;
+        a->implicit = TRUE;
+        a->u.keep.flags = static_copy_list(c, NULL, c->exec.slflags);
+    }
+
+    if (l->failed)
+        goto nomem;
+
+    l->lists[which].actions = list;
+    l->lists[which].count = n;
+    l->npending = 0;
+    return res;
+
+nomem:
+    res = SIEVE2_ERROR_NOMEM;
+keep:
+    l->lists[which].actions = &static_keep;
+    l->lists[which].count = 1;
+    l->npending = 0;
+    l->failed = FALSE;
+    return res;
+}
+
 /* Reject is incompatible with:
  * fileinto, redirect, keep, reject, vacation,
  * setflag, addflag, removeflag
  */
 int libsieve_do_reject(struct sieve2_context *c, char *msg)
 {
-    if (c->actions.fileinto
-     || c->actions.redirect
-     || c->actions.keep
-     || c->actions.reject
-     || c->actions.vacation
-     || c->actions.setflag
-     || c->actions.addflag
-     || c->actions.removeflag
+    sieve2_action_t *a;
+
+    if (c->exec.actions.fileinto
+     || c->exec.actions.redirect
+     || c->exec.actions.keep
+     || c->exec.actions.reject
+     || c->exec.actions.vacation
+     || c->exec.actions.setflag
+     || c->exec.actions.addflag
+     || c->exec.actions.removeflag
      )
         return SIEVE2_ERROR_EXEC;
 
-    c->actions.reject = TRUE;
+    c->exec.actions.reject = TRUE;
+
+    if (c->actionlist.on) {
+        if ((a = static_action(c, SIEVE2_ACTION_REJECT)) != NULL)
+            a->u.reject.message = static_copy(c, msg);
+        return SIEVE2_OK;
+    }
 
     libsieve_callback_begin(c, SIEVE2_ACTION_REJECT);
 
-    libsieve_setvalue_string(c, "message", msg);
+    c->cur_call.values.reject.message = msg;
 
     libsieve_callback_do(c, SIEVE2_ACTION_REJECT);
     libsieve_callback_end(c, SIEVE2_ACTION_REJECT);
@@ -61,31 +305,41 @@ int libsieve_do_reject(struct sieve2_context *c, char *msg)
 /* Fileinto is incompatible with: 
  * reject
  */
-int libsieve_do_fileinto(struct sieve2_context *c, char *mbox, stringlist_t *slflags)
+int libsieve_do_fileinto(struct sieve2_context *c, char *mbox, char **slflags)
 {
+    sieve2_action_t *a;
     char **flags;
 
-    if (c->actions.reject)
+    if (c->exec.actions.reject)
         return SIEVE2_ERROR_EXEC;
 
-    c->actions.fileinto = TRUE;
+    c->exec.actions.fileinto = TRUE;
+
+    if (c->actionlist.on) {
+        if ((a = static_action(c, SIEVE2_ACTION_FILEINTO)) != NULL) {
+            a->u.fileinto.mailbox = static_copy(c, mbox);
+            a->u.fileinto.flags = static_copy_list(c, slflags, c->exec.slflags);
+        }
+        return SIEVE2_OK;
+    }
 
     libsieve_callback_begin(c, SIEVE2_ACTION_FILEINTO);
 
-    libsieve_setvalue_string(c, "mailbox", mbox);
+    c->cur_call.values.fileinto.mailbox = mbox;
 
     if (slflags) {
-	flags = libsieve_stringlist_to_chararray(slflags);
+	flags = slflags;
     } else {
-	flags = libsieve_stringlist_to_chararray(c->slflags);
+	flags = libsieve_stringlist_to_chararray(c->exec.slflags);
     }
-    libsieve_setvalue_stringlist(c, "flags", flags);
+    c->cur_call.values.fileinto.flags = flags;
 
     libsieve_callback_do(c, SIEVE2_ACTION_FILEINTO);
     libsieve_callback_end(c, SIEVE2_ACTION_FILEINTO);
 
     // FIXME: Add flags, but not its contents, to the context freelist.
-    libsieve_free(flags);
+    if (flags != slflags)
+	libsieve_free(flags);
 
     return SIEVE2_OK;
 }
@@ -95,14 +349,22 @@ int libsieve_do_fileinto(struct sieve2_context *c, char *mbox, stringlist_t *slf
  */
 int libsieve_do_redirect(struct sieve2_context *c, char *addr)
 {
-    if (c->actions.reject)
+    sieve2_action_t *a;
+
+    if (c->exec.actions.reject)
         return SIEVE2_ERROR_EXEC;
 
-    c->actions.redirect = TRUE;
+    c->exec.actions.redirect = TRUE;
+
+    if (c->actionlist.on) {
+        if ((a = static_action(c, SIEVE2_ACTION_REDIRECT)) != NULL)
+            a->u.redirect.address = static_copy(c, addr);
+        return SIEVE2_OK;
+    }
 
     libsieve_callback_begin(c, SIEVE2_ACTION_REDIRECT);
 
-    libsieve_setvalue_string(c, "address", addr);
+    c->cur_call.values.redirect.address = addr;
 
     libsieve_callback_do(c, SIEVE2_ACTION_REDIRECT);
     libsieve_callback_end(c, SIEVE2_ACTION_REDIRECT);
@@ -113,29 +375,37 @@ int libsieve_do_redirect(struct sieve2_context *c, char *addr)
 /* Keep is incompatible with:
  * reject
  */
-int libsieve_do_keep(struct sieve2_context *c, stringlist_t *slflags)
+int libsieve_do_keep(struct sieve2_context *c, char **slflags)
 {
+    sieve2_action_t *a;
     char **flags;
 
-    if (c->actions.reject)
+    if (c->exec.actions.reject)
         return SIEVE2_ERROR_EXEC;
 
-    c->actions.keep = TRUE;
+    c->exec.actions.keep = TRUE;
+
+    if (c->actionlist.on) {
+        if ((a = static_action(c, SIEVE2_ACTION_KEEP)) != NULL)
+            a->u.keep.flags = static_copy_list(c, slflags, c->exec.slflags);
+        return SIEVE2_OK;
+    }
 
     libsieve_callback_begin(c, SIEVE2_ACTION_KEEP);
 
     if (slflags) {
-	flags = libsieve_stringlist_to_chararray(slflags);
+	flags = slflags;
     } else {
-	flags = libsieve_stringlist_to_chararray(c->slflags);
+	flags = libsieve_stringlist_to_chararray(c->exec.slflags);
     }
-    libsieve_setvalue_stringlist(c, "flags", flags);
+    c->cur_call.values.keep.flags = flags;
 
     libsieve_callback_do(c, SIEVE2_ACTION_KEEP);
     libsieve_callback_end(c, SIEVE2_ACTION_KEEP);
 
     // FIXME: Add flags, but not its contents, to the context freelist.
-    libsieve_free(flags);
+    if (flags != slflags)
+	libsieve_free(flags);
 
     return SIEVE2_OK;
 }
@@ -145,7 +415,11 @@ int libsieve_do_keep(struct sieve2_context *c, stringlist_t *slflags)
  */
 int libsieve_do_discard(struct sieve2_context *c)
 {
-    c->actions.discard = TRUE;
+    c->exec.actions.discard = TRUE;
+
+    /* All discard does is cancel the implicit keep. */
+    if (c->actionlist.on)
+        return SIEVE2_OK;
 
     libsieve_callback_begin(c, SIEVE2_ACTION_DISCARD);
 
@@ -164,20 +438,35 @@ int libsieve_do_vacation(struct sieve2_context *c,
 		char *handle,
 		const int days, const int mime)
 {
-    if (c->actions.reject)
+    sieve2_action_t *a;
+
+    if (c->exec.actions.reject)
         return SIEVE2_ERROR_EXEC;
 
-    c->actions.vacation = TRUE;
+    c->exec.actions.vacation = TRUE;
+
+    if (c->actionlist.on) {
+        if ((a = static_action(c, SIEVE2_ACTION_VACATION)) != NULL) {
+            a->u.vacation.address = static_copy(c, addr);
+            a->u.vacation.fromaddr = static_copy(c, fromaddr);
+            a->u.vacation.subject = static_copy(c, subj);
+            a->u.vacation.message = static_copy(c, msg);
+            a->u.vacation.hash = static_copy(c, handle);
+            a->u.vacation.days = days;
+            a->u.vacation.mime = mime;
+        }
+        return SIEVE2_OK;
+    }
 
     libsieve_callback_begin(c, SIEVE2_ACTION_VACATION);
 
-    libsieve_setvalue_string(c, "address", addr);
-    libsieve_setvalue_string(c, "fromaddr", fromaddr);
-    libsieve_setvalue_string(c, "subject", subj);
-    libsieve_setvalue_string(c, "message", msg);
-    libsieve_setvalue_string(c, "hash", handle);
-    libsieve_setvalue_int(c, "days", days);
-    libsieve_setvalue_int(c, "mime", mime);
+    c->cur_call.values.vacation.address = addr;
+    c->cur_call.values.vacation.fromaddr = fromaddr;
+    c->cur_call.values.vacation.subject = subj;
+    c->cur_call.values.vacation.message = msg;
+    c->cur_call.values.vacation.hash = handle;
+    c->cur_call.values.vacation.days = days;
+    c->cur_call.values.vacation.mime = mime;
 
     libsieve_callback_do(c, SIEVE2_ACTION_VACATION);
     libsieve_callback_end(c, SIEVE2_ACTION_VACATION);
@@ -189,28 +478,35 @@ int libsieve_do_vacation(struct sieve2_context *c,
  * nothing
  */
 int libsieve_do_notify(struct sieve2_context *c, char *id,
-	      char *method, stringlist_t *options,
+	      char *method, char **options,
 	      char *priority, char *message)
 {
-    char **optionstring;
-
-    c->actions.notify = TRUE;
+    sieve2_action_t *a;
+
+    c->exec.actions.notify = TRUE;
+
+    if (c->actionlist.on) {
+        if ((a = static_action(c, SIEVE2_ACTION_NOTIFY)) != NULL) {
+            a->u.notify.options = (options ? static_copy_list(c, options, NULL) : NULL);
+            a->u.notify.id = static_copy(c, id);
+            a->u.notify.method = static_copy(c, method);
+            a->u.notify.priority = static_copy(c, priority);
+            a->u.notify.message = static_copy(c, message);
+        }
+        return SIEVE2_OK;
+    }
 
     libsieve_callback_begin(c, SIEVE2_ACTION_NOTIFY);
 
-    optionstring = libsieve_stringlist_to_chararray(options);
-    libsieve_setvalue_stringlist(c, "options", optionstring);
-    libsieve_setvalue_string(c, "id", id);
-    libsieve_setvalue_string(c, "method", method);
-    libsieve_setvalue_string(c, "priority", priority);
-    libsieve_setvalue_string(c, "message", message);
+    c->cur_call.values.notify.options = options;
+    c->cur_call.values.notify.id = id;
+    c->cur_call.values.notify.method = method;
+    c->cur_call.values.notify.priority = priority;
+    c->cur_call.values.notify.message = message;
 
     libsieve_callback_do(c, SIEVE2_ACTION_NOTIFY);
     libsieve_callback_end(c, SIEVE2_ACTION_NOTIFY);
 
-    // FIXME: add optionstring, but not its contents, to a freelist.
-    libsieve_free(optionstring);
-
     return SIEVE2_OK;
 }
 
@@ -219,7 +515,8 @@ int libsieve_do_error_exec(struct sieve2_context *c, char *msg)
 {
     libsieve_callback_begin(c, SIEVE2_ERRCALL_RUNTIME);
 
-    libsieve_setvalue_string(c, "message", msg);
+    c->cur_call.values.error.lineno = -1;
+    c->cur_call.values.error.message = msg;
 
     libsieve_callback_do(c, SIEVE2_ERRCALL_RUNTIME);
     libsieve_callback_end(c, SIEVE2_ERRCALL_RUNTIME);
@@ -231,8 +528,8 @@ int libsieve_do_error_parse(struct sieve2_context *c, const int lineno, const ch
 {
     libsieve_callback_begin(c, SIEVE2_ERRCALL_PARSE);
 
-    libsieve_setvalue_int(c, "lineno", lineno);
-    libsieve_setvalue_string(c, "message", msg);
+    c->cur_call.values.error.lineno = lineno;
+    c->cur_call.values.error.message = msg;
 
     libsieve_callback_do(c, SIEVE2_ERRCALL_PARSE);
     libsieve_callback_end(c, SIEVE2_ERRCALL_PARSE);
@@ -244,7 +541,8 @@ int libsieve_do_error_address(struct sieve2_context *c, const char * const msg)
 {
     libsieve_callback_begin(c, SIEVE2_ERRCALL_ADDRESS);
 
-    libsieve_setvalue_string(c, "message", msg);
+    c->cur_call.values.error.lineno = -1;
+    c->cur_call.values.error.message = msg;
 
     libsieve_callback_do(c, SIEVE2_ERRCALL_ADDRESS);
     libsieve_callback_end(c, SIEVE2_ERRCALL_ADDRESS);
@@ -256,8 +554,8 @@ int libsieve_do_error_header(struct sieve2_context *c, const int lineno, const c
 {
     libsieve_callback_begin(c, SIEVE2_ERRCALL_HEADER);
 
-    libsieve_setvalue_int(c, "lineno", lineno);
-    libsieve_setvalue_string(c, "message", msg);
+    c->cur_call.values.error.lineno = lineno;
+    c->cur_call.values.error.message = msg;
 
     libsieve_callback_do(c, SIEVE2_ERRCALL_HEADER);
     libsieve_callback_end(c, SIEVE2_ERRCALL_HEADER);
@@ -282,11 +580,11 @@ int libsieve_do_debug_trace(struct sieve2_context *c, const int level,
     if (c && c->callbacks.debug_trace) {
         libsieve_callback_begin(c, SIEVE2_DEBUG_TRACE);
 
-        libsieve_setvalue_int(c, "level", level);
+        c->cur_call.values.trace.level = level;
 
-        libsieve_setvalue_string(c, "module", (char *)module);
-        libsieve_setvalue_string(c, "file", (char *)file);
-        libsieve_setvalue_string(c, "function", (char *)function);
+        c->cur_call.values.trace.module = module;
+        c->cur_call.values.trace.file = file;
+        c->cur_call.values.trace.function = function;
 
 	va_start(argp, formatstring);
 	// This used to be vasnprintf, but it's not availabe in Solaris < 10
@@ -297,7 +595,7 @@ int libsieve_do_debug_trace(struct sieve2_context *c, const int level,
 	if (len < 0 || len > 1023) {
 		snprintf(message, 1023, "A Sieve error occurred, but the error message is not available.");
 	}
-        libsieve_setvalue_string(c, "message", message);
+        c->cur_call.values.trace.message = message;
 	va_end(argp);
 
         libsieve_callback_do(c, SIEVE2_DEBUG_TRACE);
@@ -313,12 +611,12 @@ int libsieve_do_getscript(struct sieve2_context *c,
 {
     libsieve_callback_begin(c, SIEVE2_SCRIPT_GETSCRIPT);
 
-    libsieve_setvalue_string(c, "path", (char *)path);
-    libsieve_setvalue_string(c, "name", (char *)name);
+    c->cur_call.values.getscript.path = path;
+    c->cur_call.values.getscript.name = name;
 
     libsieve_callback_do(c, SIEVE2_SCRIPT_GETSCRIPT);
 
-    *script = libsieve_getvalue_string(c, "script");
+    *script = c->cur_call.values.getscript.script;
 
     if (*script)
         *scriptlen = strlen(*script);
@@ -340,7 +638,7 @@ int libsieve_do_getallheaders(struct sieve2_context *c,
 
     libsieve_callback_do(c, SIEVE2_MESSAGE_GETALLHEADERS);
 
-    *header = (char *)libsieve_getvalue_string(c, "allheaders");
+    *header = (char *)c->cur_call.values.getallheaders.allheaders;
 
     libsieve_callback_end(c, SIEVE2_MESSAGE_GETALLHEADERS);
 
@@ -349,33 +647,206 @@ int libsieve_do_getallheaders(struct sieve2_context *c,
 
 static char * notfound[] = { "", NULL };
 
+/* The same headers are asked for again and again: by each header,
+ * address and exists test, and by vacation looking for list headers.
+ * The user's callback may have to go to disk or a server for each one,
+ * so every header is fetched at most once per execution and kept here.
+ * The user's stringlist may not outlive the callback, so it's copied.
+ * Our own header parser's results last as long as the message does,
+ * and don't come through here at all. */
+static unsigned int static_hashheader(const char *header)
+{
+    unsigned int x = 0;
+
+    for (; *header; header++)
+        x = x * 31 + (unsigned char)tolower((unsigned char)*header);
+
+    return x % HEADERCACHESIZE;
+}
+
+/* Everything in one allocation: the pointers, then the strings. */
+static char **static_copy_body(struct arena *a, char **body)
+{
+    size_t n, len = 0;
+    char **copy, *p;
+
+    for (n = 0; body[n] != NULL; n++)
+        len += strlen(body[n]) + 1;
+
+    copy = (char **)libsieve_arena_alloc(a, (n + 1) * sizeof(char *) + len);
+    if (copy == NULL)
+        return NULL;
+
+    p = (char *)(copy + n + 1);
+    for (n = 0; body[n] != NULL; n++) {
+        copy[n] = strcpy(p, body[n]);
+        p += strlen(p) + 1;
+    }
+    copy[n] = NULL;
+
+    return copy;
+}
+
+/* The cache is all in one arena, so it's let go of at once. */
+void libsieve_do_getheader_reset(struct sieve2_context *c)
+{
+    int i;
+
+    libsieve_arena_clear(&c->header_arena);
+    for (i = 0; i < HEADERCACHESIZE; i++)
+        c->headers[i] = NULL;
+}
+
+static struct headercache2 *static_cached(struct sieve2_context *c,
+		const char *header, unsigned int hash)
+{
+    struct headercache2 *h;
+
+    for (h = c->headers[hash]; h != NULL; h = h->next) {
+        if (strcasecmp(h->name, header) == 0)
+            return h;
+    }
+
+    return NULL;
+}
+
+/* Keep what the user gave for a header; returns as getheader does. */
+static int static_cache(struct sieve2_context *c, const char *header,
+		unsigned int hash, char **got, char ***body)
+{
+    struct headercache2 *h;
+    int res;
+
+    if (!got || !*got) {
+        *body = notfound;
+        res = SIEVE2_DONE;
+    } else {
+        *body = got;
+        res = SIEVE2_OK;
+    }
+
+    /* If there's no memory to keep it, it'll just be fetched again. */
+    h = (struct headercache2 *)libsieve_arena_alloc(&c->header_arena,
+                    sizeof(struct headercache2));
+    if (h == NULL)
+        return res;
+
+    h->res = res;
+    h->body = *body;
+    if (res == SIEVE2_OK)
+        h->body = static_copy_body(&c->header_arena, *body);
+    h->name = libsieve_arena_strdup(&c->header_arena, header);
+    if (h->name == NULL || h->body == NULL)
+        return res;
+    libsieve_strtolower(h->name, strlen(h->name));
+
+    h->next = c->headers[hash];
+    c->headers[hash] = h;
+
+    *body = h->body;
+    return res;
+}
+
 int libsieve_do_getheader(struct sieve2_context *c,
 		const char * const header, char ***body)
 {
+    return libsieve_do_getheader_id(c, -1, header, body);
+}
+
+/* The same, but a compiled script may already know the header by its
+ * id; see message2.h. Our own parser keeps what it found for as long
+ * as the message lasts, so there's no need to go through the cache. */
+int libsieve_do_getheader_id(struct sieve2_context *c, int id,
+		const char * const header, char ***body)
+{
+    struct headercache2 *h;
+    unsigned int hash;
+    char **got;
+
+    if (c->callbacks.getheader == libsieve_message2_getheader) {
+        int res = libsieve_message2_header(c->message, id, header, (const char ***)&got);
+        if (res == SIEVE2_ERROR_FAIL) {
+            *body = notfound;
+            return SIEVE2_DONE;
+        }
+        *body = got;
+        return res;
+    }
+
+    hash = static_hashheader(header);
+    if ((h = static_cached(c, header, hash)) != NULL) {
+        *body = h->body;
+        return h->res;
+    }
+
     libsieve_callback_begin(c, SIEVE2_MESSAGE_GETHEADER);
 
-    libsieve_setvalue_string(c, "header", (char *)header);
+    c->cur_call.values.getheader.header = header;
 
     libsieve_callback_do(c, SIEVE2_MESSAGE_GETHEADER);
 
-    *body = (char **)libsieve_getvalue_stringlist(c, "body");
+    got = c->cur_call.values.getheader.body;
 
     libsieve_callback_end(c, SIEVE2_MESSAGE_GETHEADER);
 
-    if (!*body || !**body) {
-        *body = notfound;
-        return SIEVE2_DONE;
+    return static_cache(c, header, hash, got, body);
+}
+
+/* Ask for all the headers a script may want at once, before it runs.
+ * Those already fetched for this message aren't asked for again, and
+ * any the user doesn't answer are left for getheader. */
+int libsieve_do_getheaders(struct sieve2_context *c,
+		const char * const *headers, size_t n)
+{
+    char **want, ***bodies, **body;
+    size_t i, k;
+
+    if (!c->callbacks.getheaders || n == 0
+     || c->callbacks.getheader == libsieve_message2_getheader)
+        return SIEVE2_OK;
+
+    want = (char **)libsieve_malloc((n + 1) * sizeof(char *) + n * sizeof(char **));
+    if (want == NULL)
+        return SIEVE2_ERROR_NOMEM;
+    bodies = (char ***)(want + n + 1);
+
+    for (i = k = 0; i < n; i++) {
+        if (static_cached(c, headers[i], static_hashheader(headers[i])) == NULL) {
+            want[k] = (char *)headers[i];
+            bodies[k++] = NULL;
+        }
+    }
+    want[k] = NULL;
+
+    if (k > 0) {
+        libsieve_callback_begin(c, SIEVE2_MESSAGE_GETHEADERS);
+
+        c->cur_call.values.getheaders.headers = want;
+        c->cur_call.values.getheaders.bodies = bodies;
+
+        libsieve_callback_do(c, SIEVE2_MESSAGE_GETHEADERS);
+        libsieve_callback_end(c, SIEVE2_MESSAGE_GETHEADERS);
+
+        for (i = 0; i < k; i++) {
+            if (bodies[i] != NULL)
+                static_cache(c, want[i], static_hashheader(want[i]), bodies[i], &body);
+        }
     }
 
+    libsieve_free(want);
     return SIEVE2_OK;
 }
 
 int libsieve_do_getsize(struct sieve2_context *c, int *sz)
 {
     libsieve_callback_begin(c, SIEVE2_MESSAGE_GETSIZE);
+
+    /* As if it wasn't given at all. */
+    c->cur_call.values.getsize.size = -1;
+
     libsieve_callback_do(c, SIEVE2_MESSAGE_GETSIZE);
 
-    *sz = libsieve_getvalue_int(c, "size");
+    *sz = c->cur_call.values.getsize.size;
     libsieve_callback_end(c, SIEVE2_MESSAGE_GETSIZE);
 
     return SIEVE2_OK;
@@ -385,18 +856,19 @@ int libsieve_do_getenvelope(struct sieve2_context *c, const char * const f, char
 {
     libsieve_callback_begin(c, SIEVE2_MESSAGE_GETENVELOPE);
 
-    libsieve_setvalue_string(c, "env", (char *)f);
+    c->cur_call.values.getenvelope.env = f;
 
     libsieve_callback_do(c, SIEVE2_MESSAGE_GETENVELOPE);
 
+    *e = NULL;
     switch (*f) {
     case 'f':
     case 'F':
-        *e = (char *)libsieve_getvalue_string(c, "from");
+        *e = (char *)c->cur_call.values.getenvelope.from;
         break;
     case 't':
     case 'T':
-        *e = (char *)libsieve_getvalue_string(c, "to");
+        *e = (char *)c->cur_call.values.getenvelope.to;
         break;
     }
 
@@ -410,14 +882,14 @@ int libsieve_do_getsubaddress(struct sieve2_context *c, char *address,
 {
     libsieve_callback_begin(c, SIEVE2_MESSAGE_GETSUBADDRESS);
 
-    libsieve_setvalue_string(c, "address", address);
+    c->cur_call.values.getsubaddress.address = address;
 
     libsieve_callback_do(c, SIEVE2_MESSAGE_GETSUBADDRESS);
 
-    *user = (char *)libsieve_getvalue_string(c, "user");
-    *detail = (char *)libsieve_getvalue_string(c, "detail");
-    *localpart = (char *)libsieve_getvalue_string(c, "localpart");
-    *domain = (char *)libsieve_getvalue_string(c, "domain");
+    *user = (char *)c->cur_call.values.getsubaddress.user;
+    *detail = (char *)c->cur_call.values.getsubaddress.detail;
+    *localpart = (char *)c->cur_call.values.getsubaddress.localpart;
+    *domain = (char *)c->cur_call.values.getsubaddress.domain;
 
     libsieve_callback_end(c, SIEVE2_MESSAGE_GETSUBADDRESS);
 
@@ -27,6 +27,9 @@ int libsieve_callback_end(
     struct sieve2_context *context,
     sieve2_values_t callback);
 
+/* Calls the version 3 callback attached for the current callback. */
+int libsieve_callback3(struct sieve2_context *context, void *user_data);
+
 #define libsieve_setvalue_int sieve2_setvalue_int
 #define libsieve_setvalue_string sieve2_setvalue_string
 #define libsieve_setvalue_stringlist sieve2_setvalue_stringlist
@@ -37,17 +40,21 @@ int libsieve_callback_end(
 /* Callback actions; return negative on failure. */
 /* These have been rewritten and moved into callbacks2.c... */
 int libsieve_do_reject(struct sieve2_context *c, char *msg);
-int libsieve_do_fileinto(struct sieve2_context *c, char *mbox, stringlist_t *slflags);
+int libsieve_do_fileinto(struct sieve2_context *c, char *mbox, char **slflags);
 int libsieve_do_redirect(struct sieve2_context *c, char *addr);
-int libsieve_do_keep(struct sieve2_context *c, stringlist_t *slflags);
+int libsieve_do_keep(struct sieve2_context *c, char **slflags);
 int libsieve_do_discard(struct sieve2_context *c);
 int libsieve_do_vacation(struct sieve2_context *c, char *addr, char *fromaddr,
 		char *subj, char *msg, char *handle,
 		int days, int mime);
 int libsieve_do_notify(struct sieve2_context *c, char *id,
-		char *method, stringlist_t *options,
+		char *method, char **options,
 		char *priority, char *message);
 
+/* Gathering actions up for sieve2_getactionlist instead. */
+int libsieve_actionlist_begin(struct sieve2_context *c, int count);
+int libsieve_actionlist_end(struct sieve2_context *c, int which, int res);
+
 /* Reporting parse and runtime errors. */
 int libsieve_do_error_parse(struct sieve2_context *c, int lineno, const char *msg);
 int libsieve_do_error_exec(struct sieve2_context *c, char *msg);
@@ -67,6 +74,11 @@ int libsieve_do_getallheaders(struct sieve2_context *context,
 		char ** header);
 int libsieve_do_getheader(struct sieve2_context *context,
 		const char * const s, char *** val);
+int libsieve_do_getheader_id(struct sieve2_context *context, int id,
+		const char * const header, char ***body);
+int libsieve_do_getheaders(struct sieve2_context *context,
+		const char * const *headers, size_t n);
+void libsieve_do_getheader_reset(struct sieve2_context *context);
 int libsieve_do_getenvelope(struct sieve2_context * context,
 		const char * const f, char ** c);
 int libsieve_do_getsize(struct sieve2_context *context,
@@ -13,6 +13,7 @@
 #include "config.h"
 #endif
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -40,8 +41,6 @@ int libsieve_callback_begin(
     struct sieve2_context *context,
     sieve2_values_t callback)
 {
-    int i;
-
     /* We're clear to begin if:
      * begin and end are both 0
      * begin and end are both 1
@@ -55,14 +54,23 @@ int libsieve_callback_begin(
     context->cur_call.end = FALSE;
     context->cur_call.code = callback;
 
-    for (i = 0; i < MAX_VALUES; i++) {
-        context->cur_call.values[i].name = NULL;
-        context->cur_call.values[i].value.s = NULL;
-    }
+    memset(&context->cur_call.values, 0, sizeof(context->cur_call.values));
 
     return SIEVE2_OK;
 }
 
+/* Stands in for the user's version 2 callback
+ * where a version 3 callback is attached. */
+int libsieve_callback3(struct sieve2_context *c, void *user_data)
+{
+    sieve2_callback3_func func = c->callbacks.v3[c->cur_call.code];
+
+    if (func == NULL)
+        return SIEVE2_ERROR_UNSUPPORTED;
+
+    return func(c, user_data, &c->cur_call.values);
+}
+
 /* Make the callback to the user app. */
 int libsieve_callback_do(
     struct sieve2_context *c,
@@ -96,6 +104,7 @@ int libsieve_callback_do(
           CBCALL(SIEVE2_SCRIPT_GETSCRIPT,      getscript);
 
           CBCALL(SIEVE2_MESSAGE_GETHEADER,     getheader);
+          CBCALL(SIEVE2_MESSAGE_GETHEADERS,    getheaders);
           CBCALL(SIEVE2_MESSAGE_GETALLHEADERS, getallheaders);
           CBCALL(SIEVE2_MESSAGE_GETSUBADDRESS, getsubaddress);
           CBCALL(SIEVE2_MESSAGE_GETENVELOPE,   getenvelope);
@@ -114,8 +123,6 @@ int libsieve_callback_end(
     struct sieve2_context *context,
     sieve2_values_t callback)
 {
-    int i;
-
     /* We're clear to clean up if:
      * begin is true.
      * end is false.
@@ -130,23 +137,6 @@ int libsieve_callback_end(
     context->cur_call.end = TRUE;
     context->cur_call.code = SIEVE2_VALUE_FIRST;
 
-    for (i = 0; i < MAX_VALUES; i++) {
-        if (context->cur_call.values[i].name)
-            libsieve_free(context->cur_call.values[i].name);
-/*        switch (context->cur_call.values[i].type) {
-        case VAL_INT:
-            // Nothing doing.
-            break;
-        case VAL_STRING:
-            if (context->cur_call.values[i].value.s)
-                libsieve_free(context->cur_call.values[i].value.s);
-            break;
-        case VAL_STRINGLIST:
-            // Crap.
-            break;
-        }*/
-    }
-
     return SIEVE2_OK;
 }
 
@@ -154,22 +144,92 @@ int libsieve_callback_end(
  * with callbacks. Fancy this, we're going to use the same
  * API on the inside, just in reverse! */
 
+/* Each value by name is a field of the struct for its callback. */
+enum value_type { VAL_INT, VAL_STRING, VAL_STRINGLIST };
+
+static const struct value_field {
+    sieve2_values_t code;
+    const char *name;
+    enum value_type type;
+    size_t offset;
+} value_fields[] = {
+#define FIELD(CODE, T, MEMBER, TYPE) \
+    { CODE, #MEMBER, TYPE, offsetof(T, MEMBER) }
+    FIELD(SIEVE2_ACTION_REDIRECT, sieve2_redirect_t, address, VAL_STRING),
+    FIELD(SIEVE2_ACTION_REJECT, sieve2_reject_t, message, VAL_STRING),
+    FIELD(SIEVE2_ACTION_FILEINTO, sieve2_fileinto_t, mailbox, VAL_STRING),
+    FIELD(SIEVE2_ACTION_FILEINTO, sieve2_fileinto_t, flags, VAL_STRINGLIST),
+    FIELD(SIEVE2_ACTION_KEEP, sieve2_keep_t, flags, VAL_STRINGLIST),
+    FIELD(SIEVE2_ACTION_NOTIFY, sieve2_notify_t, id, VAL_STRING),
+    FIELD(SIEVE2_ACTION_NOTIFY, sieve2_notify_t, method, VAL_STRING),
+    FIELD(SIEVE2_ACTION_NOTIFY, sieve2_notify_t, priority, VAL_STRING),
+    FIELD(SIEVE2_ACTION_NOTIFY, sieve2_notify_t, message, VAL_STRING),
+    FIELD(SIEVE2_ACTION_NOTIFY, sieve2_notify_t, options, VAL_STRINGLIST),
+    FIELD(SIEVE2_ACTION_VACATION, sieve2_vacation_t, address, VAL_STRING),
+    FIELD(SIEVE2_ACTION_VACATION, sieve2_vacation_t, fromaddr, VAL_STRING),
+    FIELD(SIEVE2_ACTION_VACATION, sieve2_vacation_t, subject, VAL_STRING),
+    FIELD(SIEVE2_ACTION_VACATION, sieve2_vacation_t, message, VAL_STRING),
+    FIELD(SIEVE2_ACTION_VACATION, sieve2_vacation_t, hash, VAL_STRING),
+    FIELD(SIEVE2_ACTION_VACATION, sieve2_vacation_t, days, VAL_INT),
+    FIELD(SIEVE2_ACTION_VACATION, sieve2_vacation_t, mime, VAL_INT),
+    FIELD(SIEVE2_ERRCALL_RUNTIME, sieve2_error_t, message, VAL_STRING),
+    FIELD(SIEVE2_ERRCALL_PARSE, sieve2_error_t, lineno, VAL_INT),
+    FIELD(SIEVE2_ERRCALL_PARSE, sieve2_error_t, message, VAL_STRING),
+    FIELD(SIEVE2_ERRCALL_HEADER, sieve2_error_t, lineno, VAL_INT),
+    FIELD(SIEVE2_ERRCALL_HEADER, sieve2_error_t, message, VAL_STRING),
+    FIELD(SIEVE2_ERRCALL_ADDRESS, sieve2_error_t, message, VAL_STRING),
+    FIELD(SIEVE2_DEBUG_TRACE, sieve2_trace_t, level, VAL_INT),
+    FIELD(SIEVE2_DEBUG_TRACE, sieve2_trace_t, module, VAL_STRING),
+    FIELD(SIEVE2_DEBUG_TRACE, sieve2_trace_t, file, VAL_STRING),
+    FIELD(SIEVE2_DEBUG_TRACE, sieve2_trace_t, function, VAL_STRING),
+    FIELD(SIEVE2_DEBUG_TRACE, sieve2_trace_t, message, VAL_STRING),
+    FIELD(SIEVE2_SCRIPT_GETSCRIPT, sieve2_getscript_t, path, VAL_STRING),
+    FIELD(SIEVE2_SCRIPT_GETSCRIPT, sieve2_getscript_t, name, VAL_STRING),
+    FIELD(SIEVE2_SCRIPT_GETSCRIPT, sieve2_getscript_t, script, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETHEADER, sieve2_getheader_t, header, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETHEADER, sieve2_getheader_t, body, VAL_STRINGLIST),
+    FIELD(SIEVE2_MESSAGE_GETHEADERS, sieve2_getheaders_t, headers, VAL_STRINGLIST),
+    FIELD(SIEVE2_MESSAGE_GETALLHEADERS, sieve2_getallheaders_t, allheaders, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETENVELOPE, sieve2_getenvelope_t, env, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETENVELOPE, sieve2_getenvelope_t, from, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETENVELOPE, sieve2_getenvelope_t, to, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETSIZE, sieve2_getsize_t, size, VAL_INT),
+    FIELD(SIEVE2_MESSAGE_GETSUBADDRESS, sieve2_getsubaddress_t, address, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETSUBADDRESS, sieve2_getsubaddress_t, user, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETSUBADDRESS, sieve2_getsubaddress_t, detail, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETSUBADDRESS, sieve2_getsubaddress_t, localpart, VAL_STRING),
+    FIELD(SIEVE2_MESSAGE_GETSUBADDRESS, sieve2_getsubaddress_t, domain, VAL_STRING),
+#undef FIELD
+};
+
+/* Where the named value of the current callback is, or NULL if
+ * the callback has no such value, or it's of another type. */
+static void *static_value(struct sieve2_context *c, const char *name,
+                          enum value_type type)
+{
+    size_t i;
+
+    if (name == NULL)
+        return NULL;
+
+    for (i = 0; i < sizeof(value_fields) / sizeof(value_fields[0]); i++) {
+        if (value_fields[i].code == c->cur_call.code
+         && value_fields[i].type == type
+         && strcasecmp(value_fields[i].name, name) == 0)
+            return (char *)&c->cur_call.values + value_fields[i].offset;
+    }
+
+    return NULL;
+}
+
 /* libSieve will free this memory for you, don't worry about it. */
 VISIBLE const char * sieve2_getvalue_string(
     sieve2_context_t *c,
     const char * const name)
 {
-    int i;
-
-    for (i = 0; i < MAX_VALUES; i++) {
-        if (c->cur_call.values[i].type == VAL_STRING
-        && c->cur_call.values[i].name && name
-        && strcasecmp(c->cur_call.values[i].name, name) == 0) {
-            return c->cur_call.values[i].value.s;
-        }
-    }
+    const char **value = (const char **)static_value(c, name, VAL_STRING);
 
-    return NULL;
+    return value ? *value : NULL;
 }
 
 /* libSieve will free this memory for you, don't worry about it. */
@@ -177,34 +237,18 @@ VISIBLE char * * sieve2_getvalue_stringlist(
     sieve2_context_t *c,
     const char * const name)
 {
-    int i;
-
-    for (i = 0; i < MAX_VALUES; i++) {
-        if (c->cur_call.values[i].type == VAL_STRINGLIST
-        && c->cur_call.values[i].name && name
-        && strcasecmp(c->cur_call.values[i].name, name) == 0) {
-            return c->cur_call.values[i].value.sl;
-        }
-    }
+    char ***value = (char ***)static_value(c, name, VAL_STRINGLIST);
 
-    return NULL;
+    return value ? *value : NULL;
 }
 
 VISIBLE int sieve2_getvalue_int(
     sieve2_context_t *c,
     const char * const name)
 {
-    int i;
-
-    for (i = 0; i < MAX_VALUES; i++) {
-        if (c->cur_call.values[i].type == VAL_INT
-        && c->cur_call.values[i].name && name
-        && strcasecmp(c->cur_call.values[i].name, name) == 0) {
-            return c->cur_call.values[i].value.i;
-        }
-    }
+    int *value = (int *)static_value(c, name, VAL_INT);
 
-    return -1;
+    return value ? *value : -1;
 }
 
 /* If you allocated the memory, you have to free it. */
@@ -212,64 +256,60 @@ VISIBLE int sieve2_setvalue_string(
     sieve2_context_t *c,
     const char * const name, const char * const value)
 {
-    int i;
+    const char **field = (const char **)static_value(c, name, VAL_STRING);
 
-    if (!name || !value)
+    /* This was caused by programming error. */
+    if (!field || !value)
         return SIEVE2_ERROR_FAIL;
 
-    for (i = 0; i < MAX_VALUES; i++) {
-        if (c->cur_call.values[i].name == NULL) {
-            c->cur_call.values[i].name = libsieve_strdup(name);
-            c->cur_call.values[i].type = VAL_STRING;
-            c->cur_call.values[i].value.s = value;
-            return SIEVE2_OK;
-        }
+    *field = value;
+    return SIEVE2_OK;
+}
+
+/* The bodies for getheaders are named by their header. */
+static char ***static_getheaders_body(struct sieve2_context *c, const char *name)
+{
+    sieve2_getheaders_t *g = &c->cur_call.values.getheaders;
+    size_t i;
+
+    if (c->cur_call.code != SIEVE2_MESSAGE_GETHEADERS || name == NULL)
+        return NULL;
+
+    for (i = 0; g->headers[i] != NULL; i++) {
+        if (strcasecmp(g->headers[i], name) == 0)
+            return &g->bodies[i];
     }
 
-    /* This was caused by programming error. */
-    return SIEVE2_ERROR_FAIL;
+    return NULL;
 }
 
 VISIBLE int sieve2_setvalue_stringlist(
     sieve2_context_t *c,
     const char * const name, char ** const value)
 {
-    int i;
+    char ***field = static_getheaders_body(c, name);
 
-    if (!name || !value)
-        return SIEVE2_ERROR_FAIL;
-
-    for (i = 0; i < MAX_VALUES; i++) {
-        if (c->cur_call.values[i].name == NULL) {
-            c->cur_call.values[i].name = libsieve_strdup(name);
-            c->cur_call.values[i].type = VAL_STRINGLIST;
-            c->cur_call.values[i].value.sl = value;
-            return SIEVE2_OK;
-        }
-    }
+    if (!field)
+        field = (char ***)static_value(c, name, VAL_STRINGLIST);
 
     /* This was caused by programming error. */
-    return SIEVE2_ERROR_FAIL;
+    if (!field || !value)
+        return SIEVE2_ERROR_FAIL;
+
+    *field = value;
+    return SIEVE2_OK;
 }
 
 VISIBLE int sieve2_setvalue_int(
     sieve2_context_t *c,
     const char * const name, const int value)
 {
-    int i;
+    int *field = (int *)static_value(c, name, VAL_INT);
 
-    if (!name)
+    /* This was caused by programming error. */
+    if (!field)
         return SIEVE2_ERROR_FAIL;
 
-    for (i = 0; i < MAX_VALUES; i++) {
-        if (c->cur_call.values[i].name == NULL) {
-            c->cur_call.values[i].name = libsieve_strdup(name);
-            c->cur_call.values[i].type = VAL_INT;
-            c->cur_call.values[i].value.i = value;
-            return SIEVE2_OK;
-        }
-    }
-
-    /* This was caused by programming error. */
-    return SIEVE2_ERROR_FAIL;
+    *field = value;
+    return SIEVE2_OK;
 }
@@ -15,6 +15,7 @@
 #include "tree.h"		/* for commandlist_t */
 #include "src/sv_include/sieve2.h"
 #include "message2.h"
+#include "src/sv_util/util.h"	/* for struct arena */
 
 struct callbacks2 {
     sieve2_callback_func redirect;
@@ -38,11 +39,16 @@ struct callbacks2 {
     sieve2_callback_func getscript;
 
     sieve2_callback_func getheader;
+    sieve2_callback_func getheaders;
     sieve2_callback_func getallheaders;
     sieve2_callback_func getenvelope;
     sieve2_callback_func getsize;
     sieve2_callback_func getbody;
     sieve2_callback_func getsubaddress;
+
+    /* Where a version 3 callback is attached, the one above
+     * is libsieve_callback3, which calls the one here. */
+    sieve2_callback3_func v3[SIEVE2_VALUE_LAST];
 };
 
 enum boolean { FALSE = 0, TRUE = 1 };
@@ -83,42 +89,121 @@ struct script2 {
     int error_lineno;
     const char *script;
     int length;
-    commandlist_t *cmds;
 };
 
-/* I don't anticipate needing more
- * than 10 of these; but watch out
- * for overflow if the user tries
- * to put in too many values. */
-#define MAX_VALUES 10
+/* This is the compiled script handed out by sieve2_compile().
+ * It holds no pointers back into the context that built it,
+ * and nothing in it is written to while it is executed, so it
+ * may be shared by any number of threads at once. */
+struct sieve2_script {
+    /* What it was allocated with, for freeing it with. */
+    sieve2_allocator_t allocator;
+    int refcount;
+    struct support2 require;
+
+    /* The bytecode image; see bytecode.h */
+    const struct bc_header *image;
+    size_t length;
+    enum boolean mapped;
+
+    /* Compiled from the image's regex table */
+    regex_t *regex;
+
+    /* The patterns of each test made ready for its comparator, by
+     * memo slot; NULL if there are none, or where a test has none. */
+    comparator_patterns_t **patterns;
+
+    /* Likewise, the patterns of :regex tests compiled into one. */
+    regex_t **regexset;
+
+    /* How deeply anyof, allof and not nest, from the image */
+    int depth;
+
+    /* Every header the script could ask for, for the getheaders
+     * callback. The names are in the image, or static strings. */
+    const char **headers;
+    size_t nheaders;
+
+    /* For each reference to a header name in the image, its
+     * interned id plus one, or zero; see message2.h. */
+    unsigned char *header_ids;
+};
+
+/* Everything which belongs to one run of a script over one message.
+ * This is cleared before each execution of a compiled script. */
+struct exec2 {
+    stringlist_t *slflags;
+    struct actions2 actions;
+    int errors;
+};
+
+/* The action list, for sieve2_getactionlist. Each script's actions
+ * are gathered in pending while it runs, and are sorted out into its
+ * list when it's done. The lists, and every string and flag in them,
+ * are in the arena, which is cleared for each call to execute. */
+struct actionlist2 {
+    enum boolean on;
+    enum boolean failed;    /* the arena ran out while running */
+    struct arena arena;
+    sieve2_action_t *pending;
+    int npending;
+    int pending_size;
+    struct actions2list {
+        const sieve2_action_t *actions;
+        int count;
+    } *lists;
+    int nlists;
+};
+
+/* A header already fetched from the message in this execution;
+ * see libsieve_do_getheader. Names are kept in lowercase. */
+#define HEADERCACHESIZE 31
+struct headercache2 {
+    char *name;
+    char **body;            /* our copy, or notfound */
+    int res;
+    struct headercache2 *next;
+};
+
+/* The values of the callback being made. Version 3 callbacks get
+ * the struct for theirs, and sieve2_getvalue_* and sieve2_setvalue_*
+ * find their fields by name; see context2.c. */
 struct cur_call {
     enum boolean begin, end;
     sieve2_values_t code;
-    struct {
-        char *name;
-        enum {
-            VAL_INT, VAL_STRING, VAL_STRINGLIST
-        } type;
-        union {
-            int i;
-            char const *s;
-            char **sl;
-        } value;
-    } values [MAX_VALUES];
+    union {
+        sieve2_redirect_t redirect;
+        sieve2_reject_t reject;
+        sieve2_fileinto_t fileinto;
+        sieve2_keep_t keep;
+        sieve2_notify_t notify;
+        sieve2_vacation_t vacation;
+        sieve2_error_t error;
+        sieve2_trace_t trace;
+        sieve2_getscript_t getscript;
+        sieve2_getheader_t getheader;
+        sieve2_getheaders_t getheaders;
+        sieve2_getallheaders_t getallheaders;
+        sieve2_getenvelope_t getenvelope;
+        sieve2_getsize_t getsize;
+        sieve2_getsubaddress_t getsubaddress;
+    } values;
 };
 
 struct sieve2_context {
+    /* Where all of this context's memory comes from; see util.h. */
+    sieve2_allocator_t allocator;
     sieve2_message_t *message;
-    stringlist_t *slflags;
     struct mlbuf *strbuf;
+    /* What's needed only while a script is parsed or run: the
+     * addresses and their strings, mostly. It's cleared, all at
+     * once, when that's over. */
+    struct arena exec_arena;
     void *addr_scan;
     struct address *addr_addr;
     void *sieve_scan;
     commandlist_t *sieve_ret;
-    void *header_scan;
-    struct header_list *header_hl;
     int parse_errors;
-    int exec_errors;
 
     struct cur_call cur_call;
 
@@ -129,8 +214,23 @@ struct sieve2_context {
     struct callbacks2 callbacks;
     struct support2 support;
     struct support2 require;
-    struct actions2 actions;
     struct script2 script;
+    struct exec2 exec;
+    struct actionlist2 actionlist;
+
+    /* How deeply scripts may nest, and the stack
+     * the evaluator uses for nested tests. */
+    int max_depth;
+    struct evalframe2 *stack;
+
+    /* Results of tests of the message, for the evaluator. */
+    signed char *memo;
+    size_t memo_size;
+
+    /* Headers fetched for the message being executed on,
+     * and where they're kept. */
+    struct headercache2 *headers[HEADERCACHESIZE];
+    struct arena header_arena;
 
     void *user_data;
 };
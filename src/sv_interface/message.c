@@ -59,15 +59,18 @@ int libsieve_parse_address(struct sieve2_context *context, const char *header, s
     if( newdata == NULL )
         return SIEVE2_ERROR_EXEC;
 
-    am = (struct addr_marker *)libsieve_malloc(sizeof(struct addr_marker));
+    am = (struct addr_marker *)libsieve_arena_alloc(&context->exec_arena, sizeof(struct addr_marker));
+    if (am == NULL)
+        return SIEVE2_ERROR_NOMEM;
     am->where = newdata;
-    am->freeme = NULL;
+    am->arena = &context->exec_arena;
     *marker = am;
     return SIEVE2_OK;
 }
 
 /* Returns the specified part of the current address in the marker array,
- * frees the address and advances the caller's array pointer. */
+ * and advances the caller's array pointer. What's returned is in the
+ * arena, along with the address. */
 char *libsieve_get_address(struct sieve2_context *context,
 		address_part_t addrpart,
 		struct addr_marker **marker,
@@ -83,10 +86,6 @@ char *libsieve_get_address(struct sieve2_context *context,
     }
 
     a = am->where;
-    if (am->freeme) {
-	libsieve_free(am->freeme);
-	am->freeme = NULL;
-    }
 
     if (a == NULL) {
         return NULL;
@@ -103,7 +102,7 @@ char *libsieve_get_address(struct sieve2_context *context,
         } else {
     	    char *m = a->mailbox ? a->mailbox : U_USER;
     	    char *d = a->domain ? a->domain : U_DOMAIN;
-    	    address = am->freeme = libsieve_strconcat(m, "@", d, NULL);
+    	    address = libsieve_arena_strconcat(am->arena, m, "@", d, NULL);
 	}
     } else {
     	ret = NULL;
@@ -154,26 +153,11 @@ got_address:
     return ret;
 }
 
+/* The addresses are let go of with the arena, once the execution
+ * is over; this only makes sure they aren't looked at again. */
 int libsieve_free_address(struct address **data, struct addr_marker **marker)
 {
-    struct addr_marker *am = *marker;
-    struct address *freedata;
-
-    while( *data ) {
-        freedata = (*data)->next;
-        libsieve_free((*data)->mailbox);
-        libsieve_free((*data)->domain);
-        libsieve_free((*data)->route);
-        libsieve_free((*data)->name);
-        libsieve_free(*data);
-        *data = freedata;
-    }
     *data = NULL;
-
-    if (am) {
-        libsieve_free(am->freeme);
-        libsieve_free(am);
-    }
     *marker = NULL;
 
     return SIEVE2_OK;
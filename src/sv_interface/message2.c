@@ -13,13 +13,11 @@
 #include "config.h"
 #endif
 
-/* isnctrl() */
-#include <ctype.h>
 /* strlen() */
 #include <string.h>
 
 /* sv_parser */
-#include "src/sv_parser/headerinc.h"
+#include "src/sv_parser/parser.h"
 
 /* sv_interface */
 #include "message2.h"
@@ -31,33 +29,120 @@
 
 #define THIS_MODULE "sv_interface"
 
-static int hashheader(char *header, int hashsize)
+/* In ASCII order, without regard to case; see libsieve_header_id. */
+const char * const libsieve_header_names[HEADER_IDS] = {
+    "auto-submitted", "bcc", "cc", "content-transfer-encoding",
+    "content-type", "date", "delivered-to", "envelope-to", "errors-to",
+    "from", "importance", "in-reply-to", "list-archive", "list-help",
+    "list-id", "list-owner", "list-post", "list-subscribe",
+    "list-unsubscribe", "message-id", "mime-version", "precedence",
+    "received", "references", "reply-to", "resent-bcc", "resent-cc",
+    "resent-date", "resent-from", "resent-message-id", "resent-sender",
+    "resent-to", "return-path", "sender", "subject", "to", "user-agent",
+    "x-mailer", "x-original-to", "x-priority", "x-spam-flag",
+    "x-spam-level", "x-spam-score", "x-spam-status", "x-virus-scanned"
+};
+
+#define HEADERHASHMIN 16
+
+#define FOLD(ch) ((ch) >= 'A' && (ch) <= 'Z' ? (ch) + ('a' - 'A') : (ch))
+
+/* Compares a name as it is in a message with an interned one. */
+static int cmpheader(const char *name, size_t len, const char *interned)
 {
-    int x = 0;
+    size_t i;
 
-    /* Any char except ' ', :, or a cntrl char */
-    for (; !iscntrl(*header) && (*header != ' ') && (*header != ':'); header++) {
-        x *= 256;
-        x += *header;
-        x %= hashsize;
+    for (i = 0; i < len; i++) {
+        unsigned char ch = FOLD((unsigned char)name[i]);
+        if (ch != (unsigned char)interned[i])
+            return ch - (unsigned char)interned[i];
+    }
+
+    return -(unsigned char)interned[len];
+}
+
+int libsieve_header_id(const char *name, size_t len)
+{
+    int lo = 0, hi = HEADER_IDS - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = cmpheader(name, len, libsieve_header_names[mid]);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+
+    return -1;
+}
+
+/* Header names are hashed without regard to case, since that's how
+ * they're compared, too; FNV-1a, folding each byte on the way. */
+static unsigned int hashheader(const char *header, size_t len)
+{
+    unsigned int x = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        x ^= FOLD((unsigned char)header[i]);
+        x *= 16777619U;
     }
 
     return x;
 }
 
-static int freecache(sieve2_message_t *m)
+/* Finds the hash slot for the given name: the one holding the first
+ * header of that name, or the empty one where it would go. There's
+ * always an empty one, since the table is never more than half full. */
+static int findheader(sieve2_message_t *m, const char *name, size_t len,
+        unsigned int hash)
 {
-    int i; /*, j; */
+    int c, mask = m->hashsize - 1;
+
+    for (c = hash & mask; m->hash[c] != -1; c = (c + 1) & mask) {
+        header_t *h = &m->list[m->hash[c]];
+        if (h->hash == hash && h->namelen == len
+         && strncasecmp(h->name, name, len) == 0)
+            break;
+    }
+
+    return c;
+}
+
+/* Makes the table big enough for the headers of this message,
+ * and empty. */
+static int clearhash(sieve2_message_t *m)
+{
+    int i, size = m->hashsize ? m->hashsize : HEADERHASHMIN;
+
+    while (size < 2 * m->count)
+        size *= 2;
+
+    if (size != m->hashsize) {
+        int *tmp = (int *)libsieve_realloc(m->hash, sizeof(int) * size);
+        if (tmp == NULL)
+            return SIEVE2_ERROR_NOMEM;
+        m->hash = tmp;
+        m->hashsize = size;
+    }
 
-    /* Free the header hash cache entries */
     for (i = 0; i < m->hashsize; i++) {
-        if (m->hash[i]) {
-	    /* The individual contents were allocated by the lex/yacc parser.
-	     * */
-            libsieve_free(m->hash[i]->contents);
-        }
-        libsieve_free(m->hash[i]);
+        m->hash[i] = -1;
+    }
+    for (i = 0; i < HEADER_IDS; i++) {
+        m->byid[i] = -1;
     }
+
+    return SIEVE2_OK;
+}
+
+static int freecache(sieve2_message_t *m)
+{
+    libsieve_arena_free(&m->arena);
+    libsieve_free(m->list);
     libsieve_free(m->hash);
     libsieve_free(m);
 
@@ -66,24 +151,29 @@ static int freecache(sieve2_message_t *m)
 
 int libsieve_message2_alloc(sieve2_message_t **m)
 {
-    int i;
     sieve2_message_t *n = NULL;
 
     n = (sieve2_message_t *)libsieve_malloc(sizeof(sieve2_message_t));
     if (n == NULL)
         return SIEVE2_ERROR_NOMEM;
 
-    n->hash = (header_t **)libsieve_malloc(sizeof(header_t) * HEADERHASHSIZE);
-    if (n->hash == NULL) {
+    n->size = 0;
+    n->hashfull = 0;
+    n->header = NULL;
+    n->list = NULL;
+    n->count = 0;
+    n->space = 0;
+    n->hash = NULL;
+    n->hashsize = 0;
+    n->arena.block = NULL;
+    n->arena.spare = NULL;
+    n->arena.pos = 0;
+
+    if (clearhash(n) != SIEVE2_OK) {
         /* No leaking just because there's no memory! */
         libsieve_free(n);
         return SIEVE2_ERROR_NOMEM;
     }
-    n->hashfull = 0;
-    n->hashsize = HEADERHASHSIZE;
-    for (i = 0; i < HEADERHASHSIZE; i++) {
-        n->hash[i] = NULL;
-    }
 
     *(sieve2_message_t **)m = n;
     return SIEVE2_OK;
@@ -91,9 +181,9 @@ int libsieve_message2_alloc(sieve2_message_t **m)
 
 int libsieve_message2_free(sieve2_message_t **m)
 {
-    int res;
+    int res = SIEVE2_OK;
 
-    if (m) 
+    if (m && *m) 
         res = freecache(*m);
 
     *m = NULL;
@@ -101,109 +191,119 @@ int libsieve_message2_free(sieve2_message_t **m)
     return res;
 }
 
+/* Forget the headers of the message, but not the space for them. */
+void libsieve_message2_reset(sieve2_message_t *m)
+{
+    libsieve_arena_clear(&m->arena);
+    m->header = NULL;
+    m->count = 0;
+    m->hashfull = 0;
+}
+
 /* This function takes the header in m->message and 
- * then uses the header parser to work at filling
- * the header hash in m->hash
+ * then uses the header scanner to fill m->list, and
+ * indexes the list by name in m->byid and m->hash.
+ * Nothing is copied out of m->header here; see
+ * libsieve_message2_header.
  */
 int libsieve_message2_parseheader(struct sieve2_context *context)
 {
-    size_t c, cl;
-    header_list_t *hl, *hlfree;
+    int i, c, res;
+    int *first, *last;
     sieve2_message_t *m = context->message;
 
-    if ((hl = libsieve_header_parse_buffer(context, &m->header)) == NULL) {
+    /* Forget the last message; its buffer may be long gone. */
+    libsieve_arena_clear(&m->arena);
+    m->hashfull = 0;
+
+    if ((res = libsieve_header_parse_buffer(context, m)) != SIEVE2_OK
+     || (res = clearhash(m)) != SIEVE2_OK) {
         /* That's a shame, we didn't find anything, or worse! */
-        return SIEVE2_ERROR_HEADER;
+        m->count = 0;
+        return res;
     }
 
-    while (hl != NULL) {
-        /* Get a hash number of the header name */
-        cl = c = hashheader(hl->h->name, m->hashsize);
-        while (m->hash[c] != NULL && strcmp(hl->h->name, m->hash[c]->name) != 0) {
-            c++;
-            c %= m->hashsize;
-            /* If we've skipped back to the beginning,
-             * give up and we'll just realloc a larger space */
-            if (c == cl) break;
-        }
+    /* Chain each header onto the last one of its name,
+     * keeping track of the last one in a scratch array. */
+    last = (int *)libsieve_arena_alloc(&m->arena, sizeof(int) * (m->count + 1));
+    if (last == NULL) {
+        m->count = 0;
+        return SIEVE2_ERROR_NOMEM;
+    }
 
-        if (m->hash[c]) {
-            /* Looks like someone's already home */
-            if (m->hash[c]->count < m->hash[c]->space) {
-                /* We have room for one more header */
-                m->hash[c]->contents[m->hash[c]->count++] = hl->h->contents[0];
-                /* Followed by a terminating NULL */
-                m->hash[c]->contents[m->hash[c]->count] = NULL;
-            } else {
-                /* Need to make some more space in here, plus one for the NULL. */
-                char **tmp;
-                tmp = (char **)libsieve_realloc(m->hash[c]->contents, sizeof(char *) * ((m->hash[c]->space+=8) + 1));
-                if (tmp == NULL) {
-                    return SIEVE2_ERROR_NOMEM;
-		} else {
-                    m->hash[c]->contents = tmp;
-		}
-                /* OK, now we can put that body in here */
-                m->hash[c]->contents[m->hash[c]->count++] = hl->h->contents[0];
-                /* Followed by a terminating NULL */
-                m->hash[c]->contents[m->hash[c]->count] = NULL;
-            }
-          /* Since we're not using this header_t struct, free it.
-           * Note that we're not freeing each of contents, we need those. */
-          libsieve_free(hl->h->contents);
-          libsieve_free(hl->h);
+    for (i = 0; i < m->count; i++) {
+        header_t *h = &m->list[i];
+
+        h->id = libsieve_header_id(h->name, h->namelen);
+        if (h->id >= 0) {
+            first = &m->byid[h->id];
         } else {
-            /* Make of copy of the pointer */
-            m->hash[c] = hl->h;
+            h->hash = hashheader(h->name, h->namelen);
+            c = findheader(m, h->name, h->namelen, h->hash);
+            first = &m->hash[c];
         }
 
-	/* Advance the cursor and cleanup as we go */
-	hlfree = hl;
-        hl = hl->next;
-	libsieve_free(hlfree);
+        if (*first == -1) {
+            *first = i;
+        } else {
+            m->list[last[*first]].next = i;
+        }
+        last[*first] = i;
     }
 
     m->hashfull = 1;
     return SIEVE2_OK;
 }
 
-/* Places the contents of the header specified by chead into body */
-static int getheader(sieve2_message_t *m, const char *chead, const char ***body)
+int libsieve_message2_header(sieve2_message_t *m, int id,
+        const char *name, const char ***body)
 {
-    int c, cl;
-    char *head = NULL;
+    int i, n, first;
+    header_t *h;
 
     /* Make sure there's nothing in the way */
     *body = NULL;
 
-    /* Make a local copy of the header */
-    head = libsieve_strdup(chead);
-    if (head == NULL)
-        return SIEVE2_ERROR_NOMEM;
-
-    head = libsieve_strtolower(head, strlen(head));
+    if (!m->hashfull)
+        return SIEVE2_ERROR_FAIL;
 
-    /* Get a hash number of the header name */
-    cl = c = hashheader(head, m->hashsize);
-    while (m->hash[c] != NULL) {
-        if (strcmp(head, m->hash[c]->name) == 0) {
-            *body = (const char **) m->hash[c]->contents;
-            break;
-        }
-        c++;
-        c %= m->hashsize;
-        /* If we've skipped back to the beginning,
-         * give up; we'll throw an error below. */
-        if (c == cl) break;
+    if (id < 0) {
+        size_t len = strlen(name);
+        id = libsieve_header_id(name, len);
+        if (id < 0)
+            first = m->hash[findheader(m, name, len, hashheader(name, len))];
     }
+    if (id >= 0)
+        first = m->byid[id];
 
-    libsieve_free(head);
-
-    if (*body) {
-        return SIEVE2_OK;
-    } else {
+    if (first == -1)
         return SIEVE2_ERROR_FAIL;
+
+    /* Unfold each of them the first time they're asked for. */
+    h = &m->list[first];
+    if (h->contents == NULL) {
+        char **contents;
+
+        for (n = 0, i = first; i != -1; i = m->list[i].next)
+            n++;
+
+        contents = (char **)libsieve_arena_alloc(&m->arena, sizeof(char *) * (n + 1));
+        if (contents == NULL)
+            return SIEVE2_ERROR_NOMEM;
+
+        for (n = 0, i = first; i != -1; i = m->list[i].next) {
+            contents[n] = libsieve_header_unfold(&m->arena, &m->list[i]);
+            if (contents[n] == NULL)
+                return SIEVE2_ERROR_NOMEM;
+            n++;
+        }
+        contents[n] = NULL;
+
+        h->contents = contents;
     }
+
+    *body = (const char **) h->contents;
+    return SIEVE2_OK;
 }
 
 /* Emulate the user getheader callback. */
@@ -212,11 +312,11 @@ int libsieve_message2_getheader(struct sieve2_context *c, void *user_data UNUSED
     int res;
     const char *header, **body;
 
-    header = libsieve_getvalue_string(c, "header");
+    header = c->cur_call.values.getheader.header;
 
-    res = getheader(c->message, header, &body);
+    res = libsieve_message2_header(c->message, -1, header, &body);
 
-    libsieve_setvalue_stringlist(c, "body", (char **)body);
+    c->cur_call.values.getheader.body = (char **)body;
 
     return res;
 }
@@ -13,36 +13,69 @@
 #ifndef MESSAGE2_H
 #define MESSAGE2_H
 
-/* HEADER */
+/* struct arena */
+#include "src/sv_util/util.h"
+
+/* Header names common enough that every message is likely to have
+ * them, or every script to ask for them, are interned: each has a
+ * fixed id, and a script which knows the id of a name it wants can
+ * go straight to those headers of the message, without hashing. */
+#define HEADER_IDS 45
+
+extern const char * const libsieve_header_names[HEADER_IDS];
+
+/* The id of a header name, or -1 if it isn't one of the above. */
+int libsieve_header_id(const char *name, size_t len);
+
+/* HEADER: the name and body of one header, as slices of the
+ * buffer given by the getallheaders callback. Nothing is copied
+ * until a script asks for a header by name; only then are its
+ * bodies unfolded, into the message's arena. */
 typedef struct header {
-    char *name;
-    size_t count;
-    size_t space;
+    const char *name;
+    size_t namelen;
+    const char *body;
+    size_t bodylen;
+    /* The id of the name, or -1 if it isn't interned;
+     * otherwise the hash of the name. */
+    int id;
+    unsigned int hash;
+    /* The next header of the same name, or -1. */
+    int next;
+    /* Only on the first of each name: its unfolded
+     * bodies, NULL terminated, once someone asks. */
     char **contents;
 } header_t;
 
-typedef struct header_list {
-    header_t *h;
-    struct header_list *next;
-} header_list_t;
-
 typedef struct message {
     int size;
-    int hashsize;
     int hashfull;
-    int listfull;
     /* Contains the entire unparsed message header. */
     char *header;
-    /* These two will share pointers to their header_t
-     * members, but the list is filled by the parser
-     * and latter sorted and hashed into the hash table. */
-    header_t **hash;
-    header_list_t *list;
+    /* The headers in the order they came, filled by the parser
+     * and reused from one message to the next. */
+    header_t *list;
+    int count;
+    int space;
+    /* The first header of each interned name, or -1. */
+    int byid[HEADER_IDS];
+    /* The first header of each other name, or -1 in an empty slot.
+     * The table is a power of two, at least twice as large as the
+     * number of headers, and only grows. */
+    int *hash;
+    int hashsize;
+    struct arena arena;
 } sieve2_message_t;
 
 int libsieve_message2_parseheader(struct sieve2_context *context);
 int libsieve_message2_alloc(sieve2_message_t **m);
 int libsieve_message2_free(sieve2_message_t **m);
+void libsieve_message2_reset(sieve2_message_t *m);
+
+/* The bodies of the headers with the given id, or if it's -1, with
+ * the given name. SIEVE2_ERROR_FAIL if the message has none. */
+int libsieve_message2_header(sieve2_message_t *m, int id,
+        const char *name, const char ***body);
 
 /* This follows the sieve2_callback_t interface. */
 //int libsieve_message2_getheader(struct sieve2_context *m, void *user_data);
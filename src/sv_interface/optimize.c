@@ -0,0 +1,386 @@
+/* optimize.c -- simplify a parsed script
+ * $Id$
+ */
+/* * * *
+ * Licensed under the GNU Lesser General Public License (LGPL)
+ * version 2.1, and other versions at the author's discretion.
+ * * * */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+/* sv_interface */
+#include "optimize.h"
+#include "callbacks2.h"
+#include "context2.h"
+#include "tree.h"
+#include "src/sv_parser/sieve.h"
+
+/* sv_util */
+#include "src/sv_util/util.h"
+
+#define THIS_MODULE "sv_interface"
+
+/* Scripts from rule editors are full of tests like allof(true, ...),
+ * single element anyofs and rules after a stop. None of that changes
+ * what a script does, so it is taken out before the bytecode is
+ * written. Tests have no side effects, so any of them may go, and
+ * the tests in an anyof or allof may be put in any order.
+ *
+ * Everything here recurses into blocks and tests, but the parser
+ * has limited how deeply those nest. Elsif chains, which can be
+ * as long as they like, are followed in a loop. */
+
+static test_t *static_opt_test(struct sieve2_context *context, test_t *t);
+static test_t *static_fold_test(struct sieve2_context *context, test_t *t);
+static commandlist_t *static_opt_commands(struct sieve2_context *context,
+                                          commandlist_t *c);
+
+static int static_same_headers(stringlist_t *a, stringlist_t *b)
+{
+    for (; a != NULL && b != NULL; a = a->next, b = b->next) {
+        if (strcasecmp(a->s, b->s) != 0)
+            return 0;
+    }
+    return (a == NULL && b == NULL);
+}
+
+/* Header tests on the same headers with the same match type and
+ * comparator can be one test, which is true if any pattern matches. */
+static int static_merge_header(struct sieve2_context *context, test_t *a, test_t *b)
+{
+    if (a == NULL || b == NULL
+     || a->type != HEADER || b->type != HEADER
+     || a->u.h.comptag != b->u.h.comptag
+     || a->u.h.compid != b->u.h.compid
+     || a->u.h.comp != b->u.h.comp
+     || !static_same_headers(a->u.h.sl, b->u.h.sl))
+        return 0;
+
+    TRACE_DEBUG("Merged two header tests on [%s]", a->u.h.sl ? a->u.h.sl->s : "");
+
+    /* Patterns which aren't regexes are really a stringlist. */
+    if (a->u.h.comptag == REGEX) {
+        patternlist_t **pl = &a->u.h.pl;
+        while (*pl != NULL)
+            pl = &(*pl)->next;
+        *pl = b->u.h.pl;
+    } else {
+        stringlist_t **sl = (stringlist_t **)&a->u.h.pl;
+        while (*sl != NULL)
+            sl = &(*sl)->next;
+        *sl = (stringlist_t *)b->u.h.pl;
+    }
+    b->u.h.pl = NULL;
+    libsieve_free_test(b);
+
+    return 1;
+}
+
+/* Relative costs: a size test is one compare of a number which is
+ * fetched once, while header tests fetch every header of the name and
+ * run the comparator on each value against each pattern. Received is
+ * usually there many times over, so it costs more than the others. */
+static int static_match_cost(int comptag)
+{
+    switch (comptag & ((1 << 10) - 1)) {
+    case IS: return 2;
+    case CONTAINS: return 4;
+    case MATCHES: return 6;
+    case REGEX: return 16;
+    }
+    return 4; /* VALUE and COUNT */
+}
+
+static int static_match_test_cost(int comptag, stringlist_t *sl, void *pl, int address)
+{
+    stringlist_t *p;
+    int patterns = 0;
+    int cost = 0;
+
+    /* Only the next field is looked at, which both kinds of list share. */
+    for (p = (stringlist_t *)pl; p != NULL; p = p->next)
+        patterns++;
+
+    for (; sl != NULL; sl = sl->next) {
+        int each = (strcasecmp(sl->s, "received") == 0 ? 8 : 1);
+        cost += 2 + each * (patterns * static_match_cost(comptag) + (address ? 4 : 0));
+    }
+
+    return cost;
+}
+
+static int static_tl_cost(testlist_t *tl)
+{
+    return (tl->t ? tl->t->cost : 0);
+}
+
+static int static_cost(test_t *t)
+{
+    stringlist_t *sl;
+    testlist_t *tl;
+    int cost = 0;
+
+    if (t == NULL)
+        return 0;
+
+    switch (t->type) {
+    case SIZE:
+        return 1;
+    case EXISTS:
+        for (sl = t->u.sl; sl != NULL; sl = sl->next)
+            cost += 2;
+        return cost;
+    case HASFLAG:
+        for (sl = t->u.hf.sl; sl != NULL; sl = sl->next)
+            cost += 1;
+        return cost;
+    case HEADER:
+        return static_match_test_cost(t->u.h.comptag, t->u.h.sl, t->u.h.pl, 0);
+    case ADDRESS:
+    case ENVELOPE:
+        return static_match_test_cost(t->u.ae.comptag, t->u.ae.sl, t->u.ae.pl, 1);
+    case NOT:
+        return static_cost(t->u.t);
+    case ANYOF:
+    case ALLOF:
+        for (tl = t->u.tl; tl != NULL; tl = tl->next)
+            cost += static_tl_cost(tl);
+        return cost;
+    }
+
+    return 0;
+}
+
+/* The tests in an anyof or allof may run in any order, and the first
+ * one which decides it stops the rest, so run the cheap ones first.
+ * This is an insertion sort, so tests of the same cost keep their order. */
+static void static_reorder(struct sieve2_context *context, test_t *t)
+{
+    testlist_t *sorted = NULL, *tl, *next, **p;
+    int moved = 0;
+
+    for (tl = t->u.tl; tl != NULL; tl = next) {
+        next = tl->next;
+        for (p = &sorted; *p != NULL && static_tl_cost(*p) <= static_tl_cost(tl);
+             p = &(*p)->next) ;
+        if (*p != NULL)
+            moved++;
+        tl->next = *p;
+        *p = tl;
+    }
+    t->u.tl = sorted;
+
+    if (moved)
+        TRACE_DEBUG("Moved [%d] cheaper tests earlier in %s",
+                moved, t->type == ANYOF ? "anyof" : "allof");
+}
+
+/* Returns the test which replaces t, with its cost worked out. */
+static test_t *static_opt_test(struct sieve2_context *context, test_t *t)
+{
+    t = static_fold_test(context, t);
+    if (t != NULL)
+        t->cost = static_cost(t);
+    return t;
+}
+
+/* Returns the test which replaces t. */
+static test_t *static_fold_test(struct sieve2_context *context, test_t *t)
+{
+    testlist_t **tl, *next, *prev;
+    test_t *sub;
+    int absorb, neutral, count;
+
+    if (t == NULL)
+        return NULL;
+
+    switch (t->type) {
+    case NOT:
+        sub = t->u.t = static_opt_test(context, t->u.t);
+        if (sub == NULL)
+            break;
+        if (sub->type == NOT) {
+            TRACE_DEBUG("Folded not not");
+            t->u.t = sub->u.t;
+            sub->u.t = NULL;
+            libsieve_free_test(sub);
+            sub = t->u.t;
+            t->u.t = NULL;
+            libsieve_free_test(t);
+            return sub;
+        }
+        if (sub->type == STRUE || sub->type == SFALSE) {
+            TRACE_DEBUG("Folded not %s", sub->type == STRUE ? "true" : "false");
+            sub->type = (sub->type == STRUE ? SFALSE : STRUE);
+            t->u.t = NULL;
+            libsieve_free_test(t);
+            return sub;
+        }
+        break;
+    case ANYOF:
+    case ALLOF:
+        /* One true test makes anyof true, and true tests don't
+         * change allof at all; and the other way around for false. */
+        absorb = (t->type == ANYOF ? STRUE : SFALSE);
+        neutral = (t->type == ANYOF ? SFALSE : STRUE);
+
+        for (prev = NULL, tl = &t->u.tl; *tl != NULL; ) {
+            sub = (*tl)->t = static_opt_test(context, (*tl)->t);
+            if (sub && sub->type == absorb) {
+                TRACE_DEBUG("Folded %s containing %s",
+                        t->type == ANYOF ? "anyof" : "allof",
+                        absorb == STRUE ? "true" : "false");
+                libsieve_free_tl(t->u.tl);
+                t->u.tl = NULL;
+                t->type = absorb;
+                return t;
+            }
+            if (sub && sub->type == neutral) {
+                TRACE_DEBUG("Removed %s from %s",
+                        neutral == STRUE ? "true" : "false",
+                        t->type == ANYOF ? "anyof" : "allof");
+                next = (*tl)->next;
+                (*tl)->next = NULL;
+                libsieve_free_tl(*tl);
+                *tl = next;
+                continue;
+            }
+            /* The previous test is done, so see if this one joins it. */
+            if (t->type == ANYOF && prev && static_merge_header(context, prev->t, sub)) {
+                next = (*tl)->next;
+                libsieve_free(*tl);
+                *tl = next;
+                continue;
+            }
+            prev = *tl;
+            tl = &(*tl)->next;
+        }
+
+        for (count = 0, next = t->u.tl; next != NULL; next = next->next)
+            count++;
+
+        if (count == 0) {
+            TRACE_DEBUG("Folded empty %s", t->type == ANYOF ? "anyof" : "allof");
+            t->type = neutral;
+        } else if (count == 1) {
+            TRACE_DEBUG("Folded %s of one test", t->type == ANYOF ? "anyof" : "allof");
+            sub = t->u.tl->t;
+            t->u.tl->t = NULL;
+            libsieve_free_test(t);
+            return sub;
+        }
+        static_reorder(context, t);
+        break;
+    }
+
+    return t;
+}
+
+/* Does running this command always end in a stop? For an if, every
+ * arm of the chain must end in one, and so must a final else. */
+static int static_stops(commandlist_t *c)
+{
+    commandlist_t *last;
+
+    while (c != NULL && c->type == IF) {
+        for (last = c->u.i.do_then; last && last->next; last = last->next) ;
+        if (!static_stops(last))
+            return 0;
+        for (last = c->u.i.do_else; last && last->next; last = last->next) ;
+        c = last;
+    }
+
+    return (c != NULL && c->type == STOP);
+}
+
+/* Returns what replaces the if at c and its elsif chain. */
+static commandlist_t *static_opt_if(struct sieve2_context *context, commandlist_t *c)
+{
+    commandlist_t *head = c, **link = &head;
+    test_t *t;
+
+    while (c != NULL) {
+        t = c->u.i.t = static_opt_test(context, c->u.i.t);
+
+        if (t && (t->type == STRUE || t->type == SFALSE)) {
+            TRACE_DEBUG("Removed the %s branch of an if which is always %s",
+                    t->type == STRUE ? "else" : "then",
+                    t->type == STRUE ? "true" : "false");
+            if (t->type == STRUE) {
+                *link = static_opt_commands(context, c->u.i.do_then);
+                c->u.i.do_then = NULL;
+                libsieve_free_tree(c);
+                return head;
+            }
+            *link = c->u.i.do_else;
+            c->u.i.do_else = NULL;
+            libsieve_free_tree(c);
+        } else {
+            c->u.i.do_then = static_opt_commands(context, c->u.i.do_then);
+            link = &c->u.i.do_else;
+        }
+
+        /* Either way, *link is the else to look at next. */
+        c = *link;
+        if (c == NULL || c->type != IF || c->next != NULL) {
+            *link = static_opt_commands(context, c);
+            break;
+        }
+    }
+
+    return head;
+}
+
+/* Returns the list which replaces c. */
+static commandlist_t *static_opt_commands(struct sieve2_context *context,
+                                          commandlist_t *c)
+{
+    commandlist_t *head = c, **link = &head, *rest;
+    int removed;
+
+    while (*link != NULL) {
+        c = *link;
+
+        if (c->type == IF) {
+            /* Whatever the if turns into goes where it was. */
+            rest = c->next;
+            c->next = NULL;
+            *link = static_opt_if(context, c);
+            while (*link != NULL && (*link)->next != NULL)
+                link = &(*link)->next;
+            if (*link == NULL) {
+                *link = rest;
+                continue;
+            }
+            (*link)->next = rest;
+            c = *link;
+        }
+
+        if (c->next != NULL && static_stops(c)) {
+            for (removed = 0, rest = c->next; rest != NULL; rest = rest->next)
+                removed++;
+            TRACE_DEBUG("Removed [%d] commands after a stop", removed);
+            libsieve_free_tree(c->next);
+            c->next = NULL;
+        }
+
+        link = &c->next;
+    }
+
+    return head;
+}
+
+commandlist_t *libsieve_optimize(struct sieve2_context *context,
+                                 commandlist_t *cmds)
+{
+    TRACE_DEBUG("Optimizing the script");
+
+    return static_opt_commands(context, cmds);
+}
+
+/* vim: set ex ts=4: */
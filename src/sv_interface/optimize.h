@@ -0,0 +1,20 @@
+/* optimize.h -- simplify a parsed script
+ * $Id$
+ */
+/* * * *
+ * Licensed under the GNU Lesser General Public License (LGPL)
+ * version 2.1, and other versions at the author's discretion.
+ * * * */
+
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "tree.h"
+#include "context2.h"
+
+/* Rewrite the tree in place into a simpler one which does the same
+ * thing; anything taken out is freed. Returns the new tree. */
+commandlist_t *libsieve_optimize(struct sieve2_context *context,
+                                 commandlist_t *cmds);
+
+#endif /* OPTIMIZE_H */
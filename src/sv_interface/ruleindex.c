@@ -0,0 +1,275 @@
+/* ruleindex.c -- share tests of the message between many scripts
+ * $Id$
+ */
+/* * * *
+ * Licensed under the GNU Lesser General Public License (LGPL)
+ * version 2.1, and other versions at the author's discretion.
+ * * * */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+/* sv_interface */
+#include "ruleindex.h"
+#include "bytecode.h"
+#include "context2.h"
+#include "sieve2.h"
+#include "sieve2_error.h"
+
+/* sv_util */
+#include "src/sv_util/util.h"
+
+/* On a host with many users, most scripts test the same few things:
+ * a spam flag header, a List-Id, and so on. The index gives each
+ * distinct test of the message, across all of its scripts, one slot
+ * in a memo they share. When a message is run through any number of
+ * them, each distinct test is worked out once, however many scripts
+ * have it. Tests are told apart by their key from the bytecode, which
+ * spells out the header names and patterns. Envelope tests depend on
+ * the recipient, so each of those keeps a slot to itself, which is
+ * worked out again for every recipient, even those sharing a script. */
+
+struct index_key {
+    char *key;
+    size_t len;
+    bc_word_t slot;
+};
+
+struct index_builder {
+    struct index_key *keys;     /* open addressing, by hash of the key */
+    size_t used, alloc;
+    char *buf;                  /* for the key being looked up */
+    size_t buf_alloc;
+    size_t memo_len;
+};
+
+static unsigned long static_hash(const char *key, size_t len)
+{
+    unsigned long h = 5381;
+
+    while (len--)
+        h = h * 33 + (unsigned char)*key++;
+
+    return h;
+}
+
+static struct index_key *static_find(struct index_builder *b, const char *key, size_t len)
+{
+    size_t i = static_hash(key, len) & (b->alloc - 1);
+
+    while (b->keys[i].key != NULL
+      && (b->keys[i].len != len || memcmp(b->keys[i].key, key, len) != 0))
+        i = (i + 1) & (b->alloc - 1);
+
+    return &b->keys[i];
+}
+
+/* Keep the table no more than half full. */
+static int static_grow(struct index_builder *b)
+{
+    struct index_key *old = b->keys, *k;
+    size_t i, n = b->alloc;
+
+    if (2 * (b->used + 1) <= b->alloc)
+        return SIEVE2_OK;
+
+    b->alloc = n ? 2 * n : 256;
+    b->keys = (struct index_key *)libsieve_malloc(b->alloc * sizeof(struct index_key));
+    if (b->keys == NULL) {
+        b->keys = old;
+        b->alloc = n;
+        return SIEVE2_ERROR_NOMEM;
+    }
+    memset(b->keys, 0, b->alloc * sizeof(struct index_key));
+
+    for (i = 0; i < n; i++) {
+        if (old[i].key != NULL) {
+            k = static_find(b, old[i].key, old[i].len);
+            *k = old[i];
+        }
+    }
+    libsieve_free(old);
+
+    return SIEVE2_OK;
+}
+
+/* Finds the shared slot for the test at pc, adding it if it's new. */
+static int static_slot(struct index_builder *b, const struct bc_header *h,
+                       bc_word_t pc, bc_word_t *slot)
+{
+    struct index_key *k;
+    size_t len;
+    char *tmp;
+
+    len = libsieve_bc_test_key(h, pc, b->buf, b->buf_alloc);
+    if (len > b->buf_alloc) {
+        tmp = (char *)libsieve_realloc(b->buf, len);
+        if (tmp == NULL)
+            return SIEVE2_ERROR_NOMEM;
+        b->buf = tmp;
+        b->buf_alloc = len;
+        libsieve_bc_test_key(h, pc, b->buf, b->buf_alloc);
+    }
+
+    if (static_grow(b) != SIEVE2_OK)
+        return SIEVE2_ERROR_NOMEM;
+
+    k = static_find(b, b->buf, len);
+    if (k->key == NULL) {
+        k->key = (char *)libsieve_malloc(len);
+        if (k->key == NULL)
+            return SIEVE2_ERROR_NOMEM;
+        memcpy(k->key, b->buf, len);
+        k->len = len;
+        k->slot = b->memo_len++;
+        b->used++;
+    }
+
+    *slot = k->slot;
+    return SIEVE2_OK;
+}
+
+/* Envelope slots come after the script's others, one after another, so
+ * that envelope[0] and envelope[1] say which they are: the first, and
+ * how many. They are cleared before each recipient's run of the script. */
+static int static_index_script(struct index_builder *b, struct sieve2_script *s,
+                               bc_word_t *slots, bc_word_t *envelope)
+{
+    const struct bc_header *h = s->image;
+    const bc_word_t *code = BC_CODE(h);
+    bc_word_t *tests, i;
+    int res = SIEVE2_OK;
+
+    envelope[0] = b->memo_len;
+    envelope[1] = 0;
+    if (h->memo_len == 0)
+        return SIEVE2_OK;
+
+    tests = (bc_word_t *)libsieve_malloc(h->memo_len * sizeof(bc_word_t));
+    if (tests == NULL)
+        return SIEVE2_ERROR_NOMEM;
+
+    libsieve_bc_memo_tests(h, tests);
+
+    for (i = 0; i < h->memo_len && res == SIEVE2_OK; i++) {
+        if (tests[i] != 0 && code[tests[i]] != BC_ENVELOPE)
+            res = static_slot(b, h, tests[i], &slots[i]);
+    }
+
+    envelope[0] = b->memo_len;
+    for (i = 0; i < h->memo_len && res == SIEVE2_OK; i++) {
+        if (tests[i] == 0 || code[tests[i]] == BC_ENVELOPE) {
+            slots[i] = b->memo_len++;
+            envelope[1]++;
+        }
+    }
+
+    libsieve_free(tests);
+
+    return res;
+}
+
+/* Build an index over count compiled scripts, each of which it takes
+ * a reference to. The same script may be in it more than once.
+ *
+ * Error codes:
+ * SIEVE2_ERROR_BADARGS if any of the arguments are NULL
+ * SIEVE2_ERROR_NOMEM if memory ran out
+ */
+VISIBLE int sieve2_index_build(sieve2_script_t **scripts, int count,
+                               sieve2_index_t **index)
+{
+    struct index_builder b;
+    struct sieve2_index *x;
+    size_t i;
+    int res = SIEVE2_OK;
+
+    if (scripts == NULL || index == NULL || count < 0)
+        return SIEVE2_ERROR_BADARGS;
+
+    *index = NULL;
+
+    for (i = 0; i < (size_t)count; i++) {
+        if (scripts[i] == NULL)
+            return SIEVE2_ERROR_BADARGS;
+    }
+
+    x = (struct sieve2_index *)libsieve_malloc(sizeof(struct sieve2_index));
+    if (x == NULL)
+        return SIEVE2_ERROR_NOMEM;
+    memset(x, 0, sizeof(struct sieve2_index));
+    x->allocator = *libsieve_allocator();
+
+    x->scripts = (struct sieve2_script **)libsieve_malloc((count + 1) * sizeof(struct sieve2_script *));
+    x->slots = (bc_word_t **)libsieve_malloc((count + 1) * sizeof(bc_word_t *));
+    x->envelope = (bc_word_t *)libsieve_malloc((count + 1) * 2 * sizeof(bc_word_t));
+    if (x->scripts == NULL || x->slots == NULL || x->envelope == NULL) {
+        libsieve_free(x->scripts);
+        libsieve_free(x->slots);
+        libsieve_free(x->envelope);
+        libsieve_free(x);
+        return SIEVE2_ERROR_NOMEM;
+    }
+
+    memset(&b, 0, sizeof(struct index_builder));
+
+    for (i = 0; i < (size_t)count && res == SIEVE2_OK; i++) {
+        x->slots[i] = (bc_word_t *)libsieve_malloc(
+                (scripts[i]->image->memo_len + 1) * sizeof(bc_word_t));
+        if (x->slots[i] == NULL) {
+            res = SIEVE2_ERROR_NOMEM;
+            break;
+        }
+        sieve2_script_ref(scripts[i]);
+        x->scripts[i] = scripts[i];
+        x->count++;
+        res = static_index_script(&b, scripts[i], x->slots[i], &x->envelope[2 * i]);
+    }
+    x->memo_len = b.memo_len;
+
+    for (i = 0; i < b.alloc; i++)
+        libsieve_free(b.keys[i].key);
+    libsieve_free(b.keys);
+    libsieve_free(b.buf);
+
+    if (res != SIEVE2_OK) {
+        sieve2_index_free(&x);
+        return res;
+    }
+
+    *index = x;
+    return SIEVE2_OK;
+}
+
+/* Drops the index's references to its scripts, and sets the pointer to NULL. */
+VISIBLE int sieve2_index_free(sieve2_index_t **index)
+{
+    struct sieve2_index *x;
+    int i;
+
+    if (index == NULL)
+        return SIEVE2_ERROR_BADARGS;
+    x = *index;
+
+    if (x) {
+        const sieve2_allocator_t *prev = libsieve_allocator_push(&x->allocator);
+        for (i = 0; i < x->count; i++) {
+            sieve2_script_free(&x->scripts[i]);
+            libsieve_free(x->slots[i]);
+        }
+        libsieve_free(x->scripts);
+        libsieve_free(x->slots);
+        libsieve_free(x->envelope);
+        libsieve_free(x);
+        libsieve_allocator_pop(prev);
+    }
+    *index = NULL;
+
+    return SIEVE2_OK;
+}
+
+/* vim: set ex ts=4: */
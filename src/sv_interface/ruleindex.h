@@ -0,0 +1,26 @@
+/* ruleindex.h -- share tests of the message between many scripts
+ * $Id$
+ */
+/* * * *
+ * Licensed under the GNU Lesser General Public License (LGPL)
+ * version 2.1, and other versions at the author's discretion.
+ * * * */
+
+#ifndef RULEINDEX_H
+#define RULEINDEX_H
+
+#include "bytecode.h"
+#include "context2.h"
+
+/* Built by sieve2_index_build, and only read after that,
+ * so it may be shared by threads like a compiled script. */
+struct sieve2_index {
+    sieve2_allocator_t allocator;     /* what it was allocated with */
+    int count;
+    struct sieve2_script **scripts;   /* a reference to each */
+    bc_word_t **slots;                /* each one's memo slots in the shared memo */
+    bc_word_t *envelope;              /* each one's first envelope slot, and how many */
+    size_t memo_len;                  /* of the shared memo */
+};
+
+#endif /* RULEINDEX_H */
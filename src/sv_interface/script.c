@@ -42,6 +42,7 @@ OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include "callbacks2.h"
 #include "context2.h"
 #include "script.h"
+#include "bytecode.h"
 #include "src/sv_parser/sieve.h"
 #include "tree.h"
 
@@ -53,7 +54,7 @@ OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define THIS_MODULE "sv_interface"
 
-static int sysaddr(char *addr)
+static int sysaddr(const char *addr)
 {
     if (!strncasecmp(addr, "MAILER-DAEMON", 13))
         return 1;
@@ -74,11 +75,10 @@ static int sysaddr(char *addr)
 }
 
 /* look for myaddr and myaddrs in the body of a header - return the match */
-static char *look_for_me(struct sieve2_context *context, char *myaddr, stringlist_t *myaddrs, char **body)
+static char *look_for_me(struct sieve2_context *context, char *myaddr, char **myaddrs, char **body)
 {
     char *found = NULL;
-    int l;
-    stringlist_t *sl;
+    int l, i;
 
     /* Short circuit if myaddr is NULL */
     if (myaddr == NULL)
@@ -98,16 +98,16 @@ static char *look_for_me(struct sieve2_context *context, char *myaddr, stringlis
                 break;
             }
 
-            for (sl = myaddrs; sl != NULL && !found; sl = sl->next) {
+            for (i = 0; myaddrs != NULL && myaddrs[i] != NULL && !found; i++) {
                 struct address *altdata = NULL;
                 struct addr_marker *altmarker = NULL;
                 char *altaddr;
 
                 /* is this address one of my addresses? */
-                libsieve_parse_address(context, sl->s, &altdata, &altmarker);
+                libsieve_parse_address(context, myaddrs[i], &altdata, &altmarker);
                 altaddr = libsieve_get_address(NULL, ADDRESS_ALL, &altmarker, 1);
                 if (!strcasecmp(addr, altaddr))
-                    found = sl->s;
+                    found = myaddrs[i];
 
                 libsieve_free_address(&altdata, &altmarker);
             }
@@ -118,542 +118,783 @@ static char *look_for_me(struct sieve2_context *context, char *myaddr, stringlis
     return found;
 }
 
-/* evaluates the test t. returns 1 if true, 0 if false.
- */
-static int static_evaltest(struct sieve2_context *context, test_t *t)
+/* Compare one pattern against the values of a header.
+ * For :count, tally up the values and then call the comparator
+ * with that numeric value in a decimal string. The pattern may have
+ * been made ready for the comparator, so src is what to trace. */
+static int static_match_header(struct sieve2_context *context, int comptag,
+        comparator_t *comp, const void *pat, const char *src, char **val)
 {
-    testlist_t *tl;
-    stringlist_t *sl;
-    patternlist_t *pl;
     int res = 0;
-    int addrpart = 0;
+    int count = 0;
+    size_t l;
+
+    for (l = 0; val[l] != NULL && !res; l++) {
+        TRACE_DEBUG("test HEADER comparing [%s] with [%s]",
+            src, val[l]);
+        if (libsieve_relational_count(context, comptag)) {
+            count++;
+        } else {
+            res |= comp(context, pat, val[l]);
+        }
+    }
 
-    if (t == NULL) {
-            TRACE_DEBUG("t is null");
-            return 0;
+    if (libsieve_relational_count(context, comptag)) {
+        char countstr[20];
+        snprintf(countstr, 19, "%d", count);
+        TRACE_DEBUG("Count was [%s] compfunc is [%p](%s, %s)",
+            countstr, comp, src, countstr);
+        res |= comp(context, pat, countstr);
     }
 
-    switch (t->type) {
-    case ADDRESS:
-    case ENVELOPE:
-        switch (t->u.ae.addrpart) {
-        case ALL: addrpart = ADDRESS_ALL; break;
-        case LOCALPART: addrpart = ADDRESS_LOCALPART; break;
-        case DOMAIN: addrpart = ADDRESS_DOMAIN; break;
-        case USER: addrpart = ADDRESS_USER; break;
-        case DETAIL: addrpart = ADDRESS_DETAIL; break;
-        }
-        for (sl = t->u.ae.sl; sl != NULL && !res; sl = sl->next) {
-            int l;
-            char **body;
-            char **header;
-            char *envelope;
-            int freebody = 0;
-
-            /* use getheader for address, getenvelope for envelope */
-            if (t->type == ADDRESS) {
-                if (libsieve_do_getheader(context, sl->s, &header) != SIEVE2_OK)
-                    continue; /* try next header */
-                body = header;
+    return res;
+}
+
+/* Compare one pattern against the addresses in the values of a header. */
+static int static_match_address(struct sieve2_context *context, int comptag,
+        comparator_t *comp, const void *pat, const char *src, char **body,
+        int addrpart)
+{
+    int res = 0;
+    int count = 0;
+    int l;
+
+    for (l = 0; body[l] != NULL && !res; l++) {
+        /* loop through each header */
+        struct address *data = NULL;
+        struct addr_marker *marker = NULL;
+        char *val;
+
+        libsieve_parse_address(context, body[l], &data, &marker);
+        val = libsieve_get_address(context, addrpart, &marker, 0);
+        while (val != NULL && !res) {
+            /* loop through each address */
+            if (libsieve_relational_count(context, comptag)) {
+                count++;
             } else {
-                if (libsieve_do_getenvelope(context, sl->s, &envelope) != SIEVE2_OK)
-                    continue; /* try next header */
-                body = libsieve_malloc(2 * sizeof(char *));
-                body[0] = envelope;
-                body[1] = NULL;
-                freebody = 1;
+                res |= comp(context, pat, val);
             }
+            val = libsieve_get_address(context, addrpart, &marker, 0);
+        }
+        libsieve_free_address(&data, &marker);
+    }
+
+    if (libsieve_relational_count(context, comptag)) {
+        char countstr[20];
+        snprintf(countstr, 19, "%d", count);
+        TRACE_DEBUG("Count was [%s] compfunc is [%p](%s, %s)",
+                countstr, comp, src, countstr);
+        res |= comp(context, pat, countstr);
+    }
+
+    return res;
+}
+
+/* Address tests fetch a header, envelope tests fetch from the envelope. */
+static int static_get_address_body(struct sieve2_context *context, int envelope,
+        int id, const char *name, char ***body)
+{
+    char *env = NULL;
+
+    if (!envelope)
+        return libsieve_do_getheader_id(context, id, name, body);
+
+    /* Only "from" and "to" are known to the envelope. */
+    if (libsieve_do_getenvelope(context, name, &env) != SIEVE2_OK || env == NULL)
+        return SIEVE2_DONE;
+    *body = (char **)libsieve_arena_alloc(&context->exec_arena, 2 * sizeof(char *));
+    if (*body == NULL)
+        return SIEVE2_ERROR_NOMEM;
+    (*body)[0] = env;
+    (*body)[1] = NULL;
+    return SIEVE2_OK;
+}
 
-            // For :count, tally up the instances of the header and then call
-            // the comparator with that numeric value in a decimal string.
-            int count = 0;
-
-            for (pl = t->u.ae.pl; pl != NULL && !res; pl = pl->next) {
-                for (l = 0; body[l] != NULL && !res; l++) {
-                    /* loop through each header */
-                    struct address *data = NULL;
-                    struct addr_marker *marker = NULL;
-                    char *val;
-
-                    libsieve_parse_address(context, body[l], &data, &marker);
-                    val = libsieve_get_address(context, addrpart, &marker, 0);
-                    while (val != NULL && !res) {
-                        /* loop through each address */
-		        if (libsieve_relational_count(context, t->u.h.comptag)) {
-                            count++;
-                        } else {
-			  res |= t->u.ae.comp(context, pl->p, val);
-                        }
-                        val = libsieve_get_address(context, addrpart, &marker, 0);
-                           }
-                    libsieve_free_address(&data, &marker);
-                }
-
-                if (libsieve_relational_count(context, t->u.h.comptag)) {
-                    char countstr[20];
-                    snprintf(countstr, 19, "%d", count);
-                    TRACE_DEBUG("Count was [%s] compfunc is [%p](%s, %s)",
-                            countstr, t->u.ae.comp, (char *)pl->p, countstr);
-                    res |= t->u.ae.comp(context, pl->p, countstr);
-                }
+static int static_hasflag(struct sieve2_context *context, const char *flag)
+{
+    stringlist_t *csl;
+
+    for (csl = context->exec.slflags; csl != NULL; csl = csl->next) {
+        if (strcasecmp(csl->s, flag) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void static_setflag(struct sieve2_context *context, const char *flag)
+{
+    libsieve_free_sl_only(context->exec.slflags);
+    context->exec.slflags = libsieve_new_sl((char *)flag, NULL);
+    TRACE_DEBUG("Doing a setflag");
+}
+
+static void static_addflag(struct sieve2_context *context, const char *flag)
+{
+    if (!static_hasflag(context, flag)) {
+        context->exec.slflags = libsieve_new_sl((char *)flag, context->exec.slflags);
+        TRACE_DEBUG("Added flag: [%s]", flag);
+    }
+    TRACE_DEBUG("Doing an addflag: [%s]", flag);
+}
+
+static void static_removeflag(struct sieve2_context *context, const char *flag)
+{
+    stringlist_t *csl, *prev = NULL;
+
+    for (csl = context->exec.slflags; csl != NULL; csl = csl->next) {
+        if (strcasecmp(csl->s, flag) == 0) {
+            if (prev) {
+                prev->next = csl->next;
+                csl->next = NULL;
+                libsieve_free_sl_only(csl);
+            } else {
+                libsieve_free_sl_only(context->exec.slflags);
+                context->exec.slflags = NULL;
             }
+            TRACE_DEBUG("Removed flag: [%s]", flag);
+            break; // Once we find a flag we can stop looking.
+        }
+        prev = csl; // Previous item in the list.
+    }
+    TRACE_DEBUG("Doing a removeflag [%s]", flag);
+}
 
-            if (freebody)
-                libsieve_free(body);
+/* Every header static_vacation looks at, for the getheaders callback. */
+const char * const libsieve_vacation_headers[] = {
+    "auto-submitted", "List-Id", "List-Help", "List-Subscribe",
+    "List-Unsubscribe", "List-Post", "List-Owner", "List-Archive",
+    "precedence", "to", "cc", "bcc", "Resent-To", "Resent-Cc",
+    "Resent-Bcc", "subject", NULL
+};
+
+/* Decide whether to respond, and if so, call the vacation callback.
+ * Returns as libsieve_eval does for each command. */
+static int static_vacation(struct sieve2_context *context,
+        const char *subject, const char *from, const char *handle,
+        const char *message, int days, int mime, char **addresses,
+        const char **errmsg)
+{
+    char **body;
+    char *envelope;
+    const char *b;
+    char *fromaddr;
+    char *found = NULL;
+    char *myaddr = NULL;
+    char *reply_to = NULL;
+    int res = 0;
+    int l = SIEVE2_OK;
+    int i;
+    struct address *data = NULL;
+    struct addr_marker *marker = NULL;
+    char *tmp;
+
+    TRACE_DEBUG("Starting into a VACATION action.");
+
+    /* is there an Auto-Submitted keyword other than "no"? */
+    if (libsieve_do_getheader(context, "auto-submitted", &body) == SIEVE2_OK) {
+        /* we don't deal with comments, etc. here */
+        /* skip leading white-space */
+        for (b = body[0]; b && *b && isspace((int) *b); b++);
+        if (strcasecmp(b, "no")) l = SIEVE2_DONE;
+    }
+
+    if (l == SIEVE2_DONE)
+            TRACE_DEBUG("VACATION aborted by Auto-Submitted header.");
+
+    if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Id", &body) == SIEVE2_OK) {
+        l = SIEVE2_DONE;
+        TRACE_DEBUG("VACATION aborted by List-Id header.");
+    }
+
+    if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Help", &body) == SIEVE2_OK) {
+        l = SIEVE2_DONE;
+        TRACE_DEBUG("VACATION aborted by List-Help header.");
+    }
+
+    if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Subscribe", &body) == SIEVE2_OK) {
+        l = SIEVE2_DONE;
+        TRACE_DEBUG("VACATION aborted by List-Subscribe header.");
+    }
+
+    if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Unsubscribe", &body) == SIEVE2_OK) {
+        l = SIEVE2_DONE;
+        TRACE_DEBUG("VACATION aborted by List-Unsubscribe header.");
+    }
+
+    if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Post", &body) == SIEVE2_OK) {
+        l = SIEVE2_DONE;
+        TRACE_DEBUG("VACATION aborted by List-Post header.");
+    }
+
+    if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Owner", &body) == SIEVE2_OK) {
+        l = SIEVE2_DONE;
+        TRACE_DEBUG("VACATION aborted by List-Owner header.");
+    }
+
+    if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Archive", &body) == SIEVE2_OK) {
+        l = SIEVE2_DONE;
+        TRACE_DEBUG("VACATION aborted by List-Archive header.");
+    }
+
+    /* Is there a Precedence keyword of "junk | bulk | list"? */
+    if (libsieve_do_getheader(context, "precedence", &body) == SIEVE2_OK) {
+        /* Skip leading white-space */
+        for (b = body[0]; b && *b && isspace((int) *b); b++);
+
+        /* We don't deal with comments, etc. here */
+        if (!strcasecmp(b, "junk") ||
+            !strcasecmp(b, "bulk") ||
+            !strcasecmp(b, "list")) {
+            l = SIEVE2_DONE;
+            TRACE_DEBUG("VACATION aborted by Precedence header.");
         }
-        break;
-    case ANYOF:
-        res = 0;
-        for (tl = t->u.tl; tl != NULL && !res; tl = tl->next) {
-            /* Short-circuit as soon as any test passes. */
-            if (static_evaltest(context, tl->t)) {
-                res = 1;
-                break;
+    }
+
+    /* Note: the domain-part of all addresses are canonicalized */
+
+    /* grab my address from the envelope */
+    if (l == SIEVE2_OK) {
+        envelope = NULL;
+        l = libsieve_do_getenvelope(context, "to", &envelope);
+        if (envelope) {
+            libsieve_parse_address(context, envelope, &data, &marker);
+            tmp = libsieve_get_address(context, ADDRESS_ALL, &marker, 1);
+            myaddr = (tmp != NULL) ? libsieve_strdup(tmp) : NULL;
+            libsieve_free_address(&data, &marker);
+        }
+    }
+    envelope = NULL;
+    if (l == SIEVE2_OK) {
+        l = libsieve_do_getenvelope(context, "from", &envelope);
+    }
+    if (l == SIEVE2_OK && envelope) {
+        /* we have to parse this address & decide whether we
+           want to respond to it */
+        libsieve_parse_address(context, envelope, &data, &marker);
+        tmp = libsieve_get_address(context, ADDRESS_ALL, &marker, 1);
+        reply_to = (tmp != NULL) ? libsieve_strdup(tmp) : NULL;
+        libsieve_free_address(&data, &marker);
+
+        /* first, is there a reply-to address? */
+        if (reply_to == NULL) {
+            TRACE_DEBUG("VACATION aborted by lack of reply-to address.");
+            l = SIEVE2_DONE;
+        }
+
+        /* first, is it from me? */
+        if (l == SIEVE2_OK && myaddr && !strcmp(myaddr, reply_to)) {
+            TRACE_DEBUG("VACATION aborted because the message is from my primary address.");
+            l = SIEVE2_DONE;
+        }
+
+        /* ok, is it any of the other addresses i've
+           specified? */
+        if (l == SIEVE2_OK) {
+            for (i = 0; addresses != NULL && addresses[i] != NULL; i++) {
+                if (!strcmp(addresses[i], reply_to))
+                    l = SIEVE2_DONE;
             }
         }
-        break;
-    case ALLOF:
-        res = 1;
-        for (tl = t->u.tl; tl != NULL && res; tl = tl->next) {
-            res &= static_evaltest(context, tl->t);
-            /* Short-circuit as soon as any test fails. */
-            if (! static_evaltest(context, tl->t)) {
-                res = 0;
-                break;
+
+        if (l == SIEVE2_DONE)
+            TRACE_DEBUG("VACATION aborted because the message is from a secondary address.");
+
+        /* check myaddr matches any of the addresses specified in
+         * the script */
+        if (l == SIEVE2_OK) {
+            l = SIEVE2_DONE;
+            for (i = 0; addresses != NULL && addresses[i] != NULL; i++) {
+                if (myaddr && !strcmp(addresses[i], myaddr))
+                    l = SIEVE2_OK;
             }
         }
-        break;
-    case EXISTS:
+
+        if (l == SIEVE2_DONE)
+            TRACE_DEBUG("VACATION aborted: no match found in script.");
+
+        /* ok, is it a system address? */
+        if (l == SIEVE2_OK && sysaddr(reply_to)) {
+            TRACE_DEBUG("VACATION aborted because the message is from a system address.");
+            l = SIEVE2_DONE;
+        }
+    }
+
+    if (l == SIEVE2_OK) {
+        /* OK, we're willing to respond to the sender. But is this
+         * message to me? That is, is my address in the TO, Cc, Bcc,
+         * Resent-To, Resent-Cc, or Resent-Bcc fields? But if the
+         * vacation action contains :from directive, then set the
+         * sender address accordingly */
+
+        if (from != NULL)
+           found = (char *)from;
+
+        if (!found && (libsieve_do_getheader(context, "to", &body) == SIEVE2_OK))
+           found = look_for_me(context, myaddr, addresses, body);
+        if (!found && (libsieve_do_getheader(context, "cc", &body) == SIEVE2_OK))
+           found = look_for_me(context, myaddr, addresses, body);
+        if (!found && (libsieve_do_getheader(context, "bcc", &body) == SIEVE2_OK))
+           found = look_for_me(context, myaddr, addresses, body);
+        if (!found && (libsieve_do_getheader(context, "Resent-To", &body) == SIEVE2_OK))
+           found = look_for_me(context, myaddr, addresses, body);
+        if (!found && (libsieve_do_getheader(context, "Resent-Cc", &body) == SIEVE2_OK))
+           found = look_for_me(context, myaddr, addresses, body);
+        if (!found && (libsieve_do_getheader(context, "Resent-Bcc", &body) == SIEVE2_OK))
+           found = look_for_me(context, myaddr, addresses, body);
+
+        if (!found) {
+            TRACE_DEBUG("Vacation didn't find my address in To, Cc, Bcc, Resent-To, Resent-Cc or Resent-Bcc.");
+            l = SIEVE2_DONE;
+        }
+    }
+
+    if (l == SIEVE2_OK) {
+        /* ok, ok, if we got here maybe we should reply */
+        char buf[128];
+
+        if (subject == NULL) {
+            /* we have to generate a subject */
+            char **s;
+
+            if (libsieve_do_getheader(context, "subject", &s) != SIEVE2_OK ||
+                s[0] == NULL) {
+                strcpy(buf, "Automated reply");
+            } else {
+                /* s[0] contains the original subject */
+                snprintf(buf, sizeof(buf), "Auto: %s", (const char*)s[0]);
+            }
+        } else {
+            /* user specified subject */
+            strncpy(buf, subject, sizeof(buf)-1);
+            buf[sizeof(buf)-1] = '\0';
+        }
+
+        /* who do we want the message coming from? */
+        fromaddr = found;
+
+        res = libsieve_do_vacation(context, reply_to,
+                          fromaddr, buf,
+                          (char *)message, (char *)handle,
+                          days, mime);
+
+         if (res == SIEVE2_ERROR_EXEC)
+             *errmsg = "Vacation can not be used with Reject or Vacation";
+
+    } else {
+        if (l != SIEVE2_DONE) res = -1; /* something went wrong */
+    }
+    libsieve_free(reply_to);
+    libsieve_free(myaddr);
+
+    return res;
+}
+
+/* The evaluator runs over the bytecode image of a compiled script;
+ * see bytecode.h for the layout. Everything in the image was checked
+ * by libsieve_bc_bind, so words and strings are read here directly. */
+struct eval2 {
+    struct sieve2_context *context;
+    const struct sieve2_script *script;
+    const bc_word_t *code;
+    const char *strings;
+    signed char *memo;  /* test results for this message, or -1 */
+    const bc_word_t *slots; /* where each memo slot is in memo, or NULL */
+};
+
+#define static_str(r, ref) ((ref) ? (char *)(r)->strings + (ref) - 1 : NULL)
+#define static_header_id(r, ref) \
+    ((r)->script->header_ids ? (int)(r)->script->header_ids[ref] - 1 : -1)
+
+/* Copy a list into an array for the callbacks; NULL if it's empty. */
+static char **static_stringlist(struct eval2 *r, bc_word_t pc)
+{
+    const bc_word_t *w = r->code + pc;
+    bc_word_t i, n = w[0];
+    char **list;
+
+    if (n == 0)
+        return NULL;
+
+    list = (char **)libsieve_malloc((n + 1) * sizeof(char *));
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < n; i++)
+        list[i] = static_str(r, w[1 + i]);
+    list[n] = NULL;
+
+    return list;
+}
+
+/* Header, address and envelope tests share a layout. */
+static int static_evalmatch(struct eval2 *r, bc_word_t op, bc_word_t memo,
+                            const bc_word_t *w)
+{
+    struct sieve2_context *context = r->context;
+    int comptag = libsieve_bc_comptag(w[0]);
+    comparator_t *comp = libsieve_comparator_byid(context, w[1], comptag);
+    int addrpart = 0;
+    const bc_word_t *headers, *patterns;
+    const comparator_patterns_t *prepared = NULL;
+    const void *set = NULL;
+    bc_word_t i, j, n;
+    int res = 0;
+
+    if (op == BC_HEADER) {
+        headers = w + 2;
+        TRACE_DEBUG("Doing a header comparison");
+        TRACE_DEBUG("Relation is [%d]", comptag);
+    } else {
+        addrpart = w[2];
+        headers = w + 3;
+    }
+    patterns = headers + 1 + headers[0];
+
+    /* The image can't say which comparators this library has. */
+    if (comp == NULL)
+        return -1;
+
+    /* Patterns which were made ready for the comparator go to its
+     * match function instead; there may be fewer of them. A regex set
+     * goes to the same comparator as a regex, in one go. */
+    n = patterns[0];
+    if (r->script->patterns && (prepared = r->script->patterns[memo]) != NULL) {
+        comp = prepared->match;
+        n = prepared->n;
+    } else if (r->script->regexset && (set = r->script->regexset[memo]) != NULL) {
+        n = 1;
+    }
+
+    for (i = 1; i <= headers[0] && !res; i++) {
+        const char *name = static_str(r, headers[i]);
+        char **body;
+
+        if (op == BC_HEADER) {
+            TRACE_DEBUG("Asking for header [%s]", name);
+            if (libsieve_do_getheader_id(context, static_header_id(r, headers[i]),
+                        name, &body) != SIEVE2_OK)
+                continue;
+        } else {
+            if (static_get_address_body(context, op == BC_ENVELOPE,
+                        static_header_id(r, headers[i]), name, &body) != SIEVE2_OK)
+                continue; /* try next header */
+        }
+
+        for (j = 1; j <= n && !res; j++) {
+            const void *pat;
+            const char *src;
+
+            /* Regexes are listed by their index in the regex table. */
+            if (prepared != NULL)
+                pat = prepared->pats[j - 1];
+            else if (set != NULL)
+                pat = set;
+            else if (comptag == REGEX)
+                pat = &r->script->regex[patterns[j]];
+            else
+                pat = static_str(r, patterns[j]);
+
+            /* Patterns combined into one have no single source. */
+            if (comptag == REGEX)
+                src = "(regex)";
+            else if (n == patterns[0])
+                src = static_str(r, patterns[j]);
+            else
+                src = "(all of the patterns)";
+
+            if (op == BC_HEADER)
+                res |= static_match_header(context, comptag, comp, pat, src, body);
+            else
+                res |= static_match_address(context, comptag, comp, pat, src, body, addrpart);
+        }
+    }
+
+    return res;
+}
+
+/* Tests which only look at the message. returns 1 if true, 0 if
+ * false, and -1 if the test can't be done at all. */
+static int static_evalmessage(struct eval2 *r, const bc_word_t *w)
+{
+    struct sieve2_context *context = r->context;
+    bc_word_t i;
+    int res = 0;
+    int sz;
+
+    switch (w[0]) {
+    case BC_EXISTS:
         res = 1;
-        for (sl = t->u.sl; sl != NULL && res; sl = sl->next) {
+        for (i = 1; i <= w[3] && res; i++) {
             char **headbody = NULL;
-            if (libsieve_do_getheader(context, sl->s, &headbody) != SIEVE2_OK) {
+            if (libsieve_do_getheader_id(context, static_header_id(r, w[3 + i]),
+                        static_str(r, w[3 + i]), &headbody) != SIEVE2_OK)
                 res = 0;
-                break;
-            }
         }
         break;
-    case SFALSE:
-        res = 0;
+    case BC_SIZE:
+        if (libsieve_do_getsize(context, &sz) != SIEVE2_OK)
+            break;
+
+        if (w[3]) { /* OVER */
+            res = (sz > (int)w[4]);
+        } else { /* UNDER */
+            res = (sz < (int)w[4]);
+        }
         break;
-    case STRUE:
-        res = 1;
+    case BC_HEADER:
+    case BC_ADDRESS:
+    case BC_ENVELOPE:
+        res = static_evalmatch(r, w[0], w[2], w + 3);
         break;
-    case HEADER:
+    }
+
+    return res;
+}
+
+/* Anyof, allof and not wait here while the tests inside them run. */
+struct evalframe2 {
+    bc_word_t op;
+    bc_word_t end;      /* where the test finishes */
+    bc_word_t left;     /* how many tests inside it haven't run */
+};
+
+int libsieve_eval_stack(struct sieve2_context *context, int depth)
+{
+    struct evalframe2 *stack;
+
+    stack = (struct evalframe2 *)libsieve_realloc(context->stack,
+            depth * sizeof(struct evalframe2));
+    if (stack == NULL)
+        return SIEVE2_ERROR_NOMEM;
+
+    context->stack = stack;
+    context->max_depth = depth;
+
+    return SIEVE2_OK;
+}
+
+/* evaluates the test at pc. returns 1 if true, 0 if false,
+ * and -1 if the test can't be done at all.
+ * This doesn't recurse; nested tests are kept on context->stack,
+ * which libsieve_eval has made sure is deep enough. */
+static int static_evaltest(struct eval2 *r, bc_word_t pc)
+{
+    struct sieve2_context *context = r->context;
+    struct evalframe2 *f, *stack = context->stack;
+    const bc_word_t *w;
+    bc_word_t i, next;
+    int top = 0;
+    int res;
+
+    for (;;) {
+        w = r->code + pc;
         res = 0;
-        TRACE_DEBUG("Doing a header comparison");
-        TRACE_DEBUG("Relation is [%d]", t->u.h.comptag);
-        for (sl = t->u.h.sl; sl != NULL && !res; sl = sl->next) {
-            char **val;
-            size_t l;
-            TRACE_DEBUG("Asking for header [%s]", sl->s);
-            if (libsieve_do_getheader(context, sl->s, &val) != SIEVE2_OK)
+
+        switch (w[0]) {
+        case BC_NOT:
+            f = &stack[top++];
+            f->op = BC_NOT;
+            f->end = w[1];
+            f->left = 1;
+            pc += 2;
+            continue;
+        case BC_ANYOF:
+        case BC_ALLOF:
+            if (w[2] > 0) {
+                f = &stack[top++];
+                f->op = w[0];
+                f->end = w[1];
+                f->left = w[2];
+                pc += 3;
                 continue;
-            for (pl = t->u.h.pl; pl != NULL && !res; pl = pl->next) {
-                int count = 0;
-                for (l = 0; val[l] != NULL && !res; l++) {
-                    TRACE_DEBUG("test HEADER comparing [%s] with [%s]",
-                        (char *)pl->p, val[l]);
-                    if (libsieve_relational_count(context, t->u.h.comptag)) {
-                        count++;
-                    } else {
-		        res |= t->u.h.comp(context, pl->p, val[l]);
-                    }
-                }
-
-                if (libsieve_relational_count(context, t->u.h.comptag)) {
-                    char countstr[20];
-                    snprintf(countstr, 19, "%d", count);
-                    TRACE_DEBUG("Count was [%s] compfunc is [%p](%s, %s)",
-                        countstr, t->u.h.comp, (char *)pl->p, countstr);
-                    res |= t->u.h.comp(context, pl->p, countstr);
-                }
             }
-        }
-        break;
-    case HASFLAG:
-        res = 0;
-        for (sl = t->u.h.sl; sl != NULL && !res; sl = sl->next) {
-            stringlist_t *csl;
-            for (csl = context->slflags; csl != NULL; csl = csl->next) {
-            // FIXME:    res |= t->u.h.comp(pl->p, val[l]);
-                if (strcasecmp(csl->s, sl->s) == 0) {
-                    res = 1;
-                    break;
-                }
+            res = (w[0] == BC_ALLOF);
+            break;
+        case BC_TRUE:
+            res = 1;
+            break;
+        case BC_FALSE:
+            res = 0;
+            break;
+        case BC_EXISTS:
+        case BC_SIZE:
+        case BC_HEADER:
+        case BC_ADDRESS:
+        case BC_ENVELOPE:
+            /* The same test of the message is only worked out once. */
+            i = (r->slots ? r->slots[w[2]] : w[2]);
+            if (r->memo[i] < 0) {
+                res = static_evalmessage(r, w);
+                if (res < 0)
+                    return res;
+                r->memo[i] = res;
             }
-            if (res)
-                break;
-        }
-        break;
-    case NOT:
-        res = !static_evaltest(context, t->u.t);
-        break;
-    case SIZE:
-    {
-        int sz;
-
-        if (libsieve_do_getsize(context, &sz) != SIEVE2_OK)
+            res = r->memo[i];
             break;
+        case BC_HASFLAG:
+            for (i = 1; i <= w[2] && !res; i++)
+                res = static_hasflag(context, static_str(r, w[2 + i]));
+            break;
+        }
 
-        if (t->u.sz.t == OVER) {
-            res = (sz > t->u.sz.n);
-        } else { /* UNDER */
-            res = (sz < t->u.sz.n);
+        /* Hand the result up to whatever was waiting for it. Anyof
+         * short-circuits on the first true test, allof on the first
+         * false one, and otherwise they go on to the next test. */
+        next = w[1];
+        while (top > 0) {
+            f = &stack[top - 1];
+            if (f->op == BC_NOT)
+                res = !res;
+            else if (--f->left > 0 && res == (f->op == BC_ALLOF))
+                break;
+            next = f->end;
+            top--;
         }
-        break;
+
+        if (top == 0)
+            return res;
+        pc = next;
     }
+}
+
+/* The memo is kept with the context, and only grows. */
+int libsieve_eval_memo(struct sieve2_context *context, size_t len)
+{
+    signed char *memo;
+
+    if (len > context->memo_size) {
+        memo = (signed char *)libsieve_realloc(context->memo, len);
+        if (memo == NULL)
+            return SIEVE2_ERROR_NOMEM;
+        context->memo = memo;
+        context->memo_size = len;
     }
+    memset(context->memo, -1, len);
 
-    return res;
+    return SIEVE2_OK;
 }
 
-/* evaluate the script c.  returns negative if error was encountered,
-   0 if it exited off the end, or positive if a stop action was encountered.
-   note that this is very stack hungry; we just evaluate the AST in
-   the naivest way.  if we implement some sort of depth limit, we'll
-   be ok here; otherwise we'd want to transform it a little smarter */
-// TODO: Can we change this to be iterative, or somehow tail-recursive-optimized?
+/* evaluate a compiled script.
+ * If slots is given, the memo has already been set up to be shared
+ * with other scripts, and slots says where this one's tests are in it.
+ * returns -1 on error, 1 on stop, 0 on end of script */
 int libsieve_eval(struct sieve2_context *context,
-                  commandlist_t *c, const char **errmsg)
+                  const struct sieve2_script *script,
+                  const bc_word_t *slots, const char **errmsg)
 {
+    struct eval2 run, *r = &run;
+    const struct bc_header *h = script->image;
+    const bc_word_t *w;
+    bc_word_t pc, next, i;
+    char **list;
     int res = 0;
-    stringlist_t *sl;
 
     TRACE_DEBUG("starting into libsieve_eval");
 
-    if (c == NULL)
-        TRACE_DEBUG("the commandlist is null");
-    else
-        TRACE_DEBUG("the commandlist type is [%d]", c->type);
-
-    while (c != NULL) {
-        TRACE_DEBUG("top of the eval loop");
-        switch (c->type) {
-        case IF:
-            if (static_evaltest(context, c->u.i.t))
-                res = libsieve_eval(context, c->u.i.do_then, errmsg);
+    /* Scripts from sieve2_compile were held to this when parsed,
+     * but one from disk might have come from a more lenient context. */
+    if (script->depth > context->max_depth) {
+        TRACE_ERROR("Script nests [%d] deep, the limit is [%d]",
+                script->depth, context->max_depth);
+        *errmsg = "Script nests too deeply";
+        return -1;
+    }
+
+    if (slots == NULL && libsieve_eval_memo(context, h->memo_len) != SIEVE2_OK) {
+        *errmsg = "Out of memory";
+        return -1;
+    }
+
+    r->context = context;
+    r->script = script;
+    r->code = BC_CODE(h);
+    r->strings = BC_STRINGS(h);
+    r->memo = context->memo;
+    r->slots = slots;
+
+    for (pc = 0; pc < h->code_len && !res; pc = next) {
+        w = r->code + pc;
+        next = w[1];
+
+        switch (w[0]) {
+        case BC_IF:
+            /* The then block follows the test, and next is the else block. */
+            res = static_evaltest(r, pc + 2);
+            if (res > 0)
+                next = r->code[pc + 3];
+            if (res < 0)
+                *errmsg = "Unknown comparator in compiled script";
             else
-                res = libsieve_eval(context, c->u.i.do_else, errmsg);
+                res = 0;
             break;
-        case REJCT:
-            res = libsieve_do_reject(context, c->u.str);
+        case BC_JMP:
+            break;
+        case BC_REJECT:
+            res = libsieve_do_reject(context, static_str(r, w[2]));
             if (res == SIEVE2_ERROR_EXEC)
                 *errmsg = "Reject can not be used with any other action";
             TRACE_DEBUG("Doing a reject");
             break;
-        case FILEINTO:
-            res = libsieve_do_fileinto(context, c->u.f.mailbox, c->u.f.slflags);
+        case BC_FILEINTO:
+            list = static_stringlist(r, pc + 3);
+            res = libsieve_do_fileinto(context, static_str(r, w[2]), list);
+            libsieve_free(list);
             if (res == SIEVE2_ERROR_EXEC)
                 *errmsg = "Fileinto can not be used with Reject";
             TRACE_DEBUG("Doing a fileinto");
             break;
-        case REDIRECT:
-            res = libsieve_do_redirect(context, c->u.str);
+        case BC_REDIRECT:
+            res = libsieve_do_redirect(context, static_str(r, w[2]));
             if (res == SIEVE2_ERROR_EXEC)
                 *errmsg = "Redirect can not be used with Reject";
             TRACE_DEBUG("Doing a redirect");
             break;
-        case KEEP:
-            res = libsieve_do_keep(context, c->u.f.slflags);
+        case BC_KEEP:
+            list = static_stringlist(r, pc + 2);
+            res = libsieve_do_keep(context, list);
+            libsieve_free(list);
             if (res == SIEVE2_ERROR_EXEC)
                 *errmsg = "Keep can not be used with Reject";
             TRACE_DEBUG("Doing a keep");
             break;
-        case VACATION:
-            {
-                char **body;
-                char *fromaddr;
-                char *found = NULL;
-                char *myaddr = NULL;
-                char *reply_to = NULL;
-                int l = SIEVE2_OK;
-                struct address *data = NULL;
-                struct addr_marker *marker = NULL;
-                char *tmp;
-
-                TRACE_DEBUG("Starting into a VACATION action.");
-
-                /* is there an Auto-Submitted keyword other than "no"? */
-                if (libsieve_do_getheader(context, "auto-submitted", &body) == SIEVE2_OK) {
-                    /* we don't deal with comments, etc. here */
-                    /* skip leading white-space */
-                    while (body[0] && *body[0] && isspace((int) *body[0])) body[0]++;
-                    if (strcasecmp(body[0], "no")) l = SIEVE2_DONE;
-                }
-
-                if (l == SIEVE2_DONE)
-                        TRACE_DEBUG("VACATION aborted by Auto-Submitted header.");
-
-                if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Id", &body) == SIEVE2_OK) {
-                    l = SIEVE2_DONE;
-                    TRACE_DEBUG("VACATION aborted by List-Id header.");
-                }
-
-                if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Help", &body) == SIEVE2_OK) {
-                    l = SIEVE2_DONE;
-                    TRACE_DEBUG("VACATION aborted by List-Help header.");
-                }
-
-                if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Subscribe", &body) == SIEVE2_OK) {
-                    l = SIEVE2_DONE;
-                    TRACE_DEBUG("VACATION aborted by List-Subscribe header.");
-                }
-
-                if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Unsubscribe", &body) == SIEVE2_OK) {
-                    l = SIEVE2_DONE;
-                    TRACE_DEBUG("VACATION aborted by List-Unsubscribe header.");
-                }
-
-                if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Post", &body) == SIEVE2_OK) {
-                    l = SIEVE2_DONE;
-                    TRACE_DEBUG("VACATION aborted by List-Post header.");
-                }
-
-                if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Owner", &body) == SIEVE2_OK) {
-                    l = SIEVE2_DONE;
-                    TRACE_DEBUG("VACATION aborted by List-Owner header.");
-                }
-
-                if (l == SIEVE2_OK && libsieve_do_getheader(context, "List-Archive", &body) == SIEVE2_OK) {
-                    l = SIEVE2_DONE;
-                    TRACE_DEBUG("VACATION aborted by List-Archive header.");
-                }
-
-                /* Is there a Precedence keyword of "junk | bulk | list"? */
-                if (libsieve_do_getheader(context, "precedence", &body) == SIEVE2_OK) {
-                    /* Skip leading white-space */
-                    while (body[0] && *body[0] && isspace((int) *body[0])) {
-                        body[0]++;
-                    }
-
-                    /* We don't deal with comments, etc. here */
-                    if (!strcasecmp(body[0], "junk") ||
-                        !strcasecmp(body[0], "bulk") ||
-                        !strcasecmp(body[0], "list")) {
-                        l = SIEVE2_DONE;
-                        TRACE_DEBUG("VACATION aborted by Precedence header.");
-                    }
-                }
-
-                /* Note: the domain-part of all addresses are canonicalized */
-
-                /* grab my address from the envelope */
-                if (l == SIEVE2_OK) {
-                    l = libsieve_do_getenvelope(context, "to", body);
-                    if (body[0]) {
-                        libsieve_parse_address(context, body[0], &data, &marker);
-                        tmp = libsieve_get_address(context, ADDRESS_ALL, &marker, 1);
-                        myaddr = (tmp != NULL) ? libsieve_strdup(tmp) : NULL;
-                        libsieve_free_address(&data, &marker);
-                    }
-                }
-                if (l == SIEVE2_OK) {
-                    l = libsieve_do_getenvelope(context, "from", body);
-                }
-                if (l == SIEVE2_OK && body[0]) {
-                    /* we have to parse this address & decide whether we
-                       want to respond to it */
-                    libsieve_parse_address(context, body[0], &data, &marker);
-                    tmp = libsieve_get_address(context, ADDRESS_ALL, &marker, 1);
-                    reply_to = (tmp != NULL) ? libsieve_strdup(tmp) : NULL;
-                    libsieve_free_address(&data, &marker);
-
-                    /* first, is there a reply-to address? */
-                    if (reply_to == NULL) {
-                        TRACE_DEBUG("VACATION aborted by lack of reply-to address.");
-                        l = SIEVE2_DONE;
-                    }
-
-                    /* first, is it from me? */
-                    if (l == SIEVE2_OK && myaddr && !strcmp(myaddr, reply_to)) {
-                        TRACE_DEBUG("VACATION aborted because the message is from my primary address.");
-                        l = SIEVE2_DONE;
-                    }
-
-                    /* ok, is it any of the other addresses i've
-                       specified? */
-                    if (l == SIEVE2_OK) {
-                        for (sl = c->u.v.addresses; sl != NULL; sl = sl->next) {
-                            if (sl->s && !strcmp(sl->s, reply_to))
-                                l = SIEVE2_DONE;
-                        }
-                    }
-
-                    if (l == SIEVE2_DONE)
-                        TRACE_DEBUG("VACATION aborted because the message is from a secondary address.");
-
-                    /* check myaddr matches any of the addresses specified in
-                     * the script */
-                    if (l == SIEVE2_OK) {
-                        l = SIEVE2_DONE;
-                        for (sl = c->u.v.addresses; sl != NULL; sl = sl->next) {
-                            if (sl->s && myaddr && !strcmp(sl->s, myaddr))
-                                l = SIEVE2_OK;
-                        }
-                    }
-
-                    if (l == SIEVE2_DONE)
-                        TRACE_DEBUG("VACATION aborted: no match found in script.");
-
-                    /* ok, is it a system address? */
-                    if (l == SIEVE2_OK && sysaddr(reply_to)) {
-                        TRACE_DEBUG("VACATION aborted because the message is from a system address.");
-                        l = SIEVE2_DONE;
-                    }
-                }
-
-                if (l == SIEVE2_OK) {
-                    /* OK, we're willing to respond to the sender. But is this
-                     * message to me? That is, is my address in the TO, Cc, Bcc,
-                     * Resent-To, Resent-Cc, or Resent-Bcc fields? But if the
-                     * vacation action contains :from directive, then set the
-                     * sender address accordingly */
-
-                    if (c->u.v.from != NULL)
-                       found = c->u.v.from;
-
-                    if (!found && (libsieve_do_getheader(context, "to", &body) == SIEVE2_OK))
-                       found = look_for_me(context, myaddr, c->u.v.addresses, body);
-                    if (!found && (libsieve_do_getheader(context, "cc", &body) == SIEVE2_OK))
-                       found = look_for_me(context, myaddr, c->u.v.addresses, body);
-                    if (!found && (libsieve_do_getheader(context, "bcc", &body) == SIEVE2_OK))
-                       found = look_for_me(context, myaddr, c->u.v.addresses, body);
-                    if (!found && (libsieve_do_getheader(context, "Resent-To", &body) == SIEVE2_OK))
-                       found = look_for_me(context, myaddr, c->u.v.addresses, body);
-                    if (!found && (libsieve_do_getheader(context, "Resent-Cc", &body) == SIEVE2_OK))
-                       found = look_for_me(context, myaddr, c->u.v.addresses, body);
-                    if (!found && (libsieve_do_getheader(context, "Resent-Bcc", &body) == SIEVE2_OK))
-                       found = look_for_me(context, myaddr, c->u.v.addresses, body);
-
-                    if (!found) {
-                        TRACE_DEBUG("Vacation didn't find my address in To, Cc, Bcc, Resent-To, Resent-Cc or Resent-Bcc.");
-                        l = SIEVE2_DONE;
-                    }
-                }
-
-                if (l == SIEVE2_OK) {
-                    /* ok, ok, if we got here maybe we should reply */
-                    char buf[128];
-
-                    if (c->u.v.subject == NULL) {
-                        /* we have to generate a subject */
-                        char **s;
-
-                        if (libsieve_do_getheader(context, "subject", &s) != SIEVE2_OK ||
-                            s[0] == NULL) {
-                            strcpy(buf, "Automated reply");
-                        } else {
-                            /* s[0] contains the original subject */
-                            snprintf(buf, sizeof(buf), "Auto: %s", (const char*)s[0]);
-                        }
-                    } else {
-                        /* user specified subject */
-                        strncpy(buf, c->u.v.subject, sizeof(buf)-1);
-                        buf[sizeof(buf)-1] = '\0';
-                    }
-
-                    /* calculate hash from subject, from, mime and reason, RFC 5230, Section 4.2 */
-                    if (c->u.v.handle == NULL) {
-                        int j = 0;
-                        if (c->u.v.subject) j += strlen(c->u.v.subject);
-                        if (c->u.v.from) j+= strlen(c->u.v.from);
-                        /* Add 5: 3 for the separators between the items,
-                         * 1 for mime value and one for the terminating '\0' */
-                        j += strlen(c->u.v.message) + 5;
-                        c->u.v.handle = libsieve_malloc(j);
-                        sprintf(c->u.v.handle, "%s:%s:%s:%i",
-                            c->u.v.subject ? c->u.v.subject : "",
-                            c->u.v.from ? c->u.v.from : "",
-                            c->u.v.message,
-                            c->u.v.mime);
-                    }
-
-                    /* who do we want the message coming from? */
-                    fromaddr = found;
-
-                    res = libsieve_do_vacation(context, reply_to,
-                                      fromaddr, buf,
-                                      c->u.v.message, c->u.v.handle,
-                                      c->u.v.days, c->u.v.mime);
-
-                     if (res == SIEVE2_ERROR_EXEC)
-                         *errmsg = "Vacation can not be used with Reject or Vacation";
-
-                } else {
-                    if (l != SIEVE2_DONE) res = -1; /* something went wrong */
-                }
-		libsieve_free(reply_to);
-                libsieve_free(myaddr);
-                break;
-            }
-        case STOP:
+        case BC_VACATION:
+            list = static_stringlist(r, pc + 8);
+            res = static_vacation(context, static_str(r, w[2]),
+                    static_str(r, w[3]), static_str(r, w[4]),
+                    static_str(r, w[5]), w[6], w[7], list, errmsg);
+            libsieve_free(list);
+            break;
+        case BC_STOP:
             res = 1;
             break;
-        case DISCARD:
+        case BC_DISCARD:
             res = libsieve_do_discard(context);
             TRACE_DEBUG("Doing a discard");
             break;
-        case SETFLAG:
-            sl = c->u.sl;
-            libsieve_free_sl_only(context->slflags);
-            context->slflags = libsieve_new_sl(sl->s, context->slflags);
-            TRACE_DEBUG("Doing a setflag");
+        case BC_SETFLAG:
+            if (w[2] > 0)
+                static_setflag(context, static_str(r, w[3]));
             break;
-        case ADDFLAG:
-            for (sl = c->u.sl; sl != NULL; sl = sl->next) {
-                stringlist_t *csl;
-                int found = 0;
-                for (csl = context->slflags; csl != NULL; csl = csl->next) {
-                    if (strcasecmp(csl->s, sl->s) == 0) {
-                        found = 1;
-                        break;
-                    }
-                }
-                if (!found) {
-                    context->slflags = libsieve_new_sl(sl->s, context->slflags);
-                    TRACE_DEBUG("Added flag: [%s]", sl->s);
-                }
-                TRACE_DEBUG("Doing an addflag: [%s]", sl->s);
-            }
+        case BC_ADDFLAG:
+            for (i = 1; i <= w[2]; i++)
+                static_addflag(context, static_str(r, w[2 + i]));
             break;
-        case REMOVEFLAG:
-            for (sl = c->u.sl; sl != NULL; sl = sl->next) {
-                stringlist_t *csl, *prev = NULL;
-                for (csl = context->slflags; csl != NULL; csl = csl->next) {
-                    if (strcasecmp(csl->s, sl->s) == 0) {
-                        if (prev) {
-                            prev->next = csl->next;
-                            csl->next = NULL;
-                            libsieve_free_sl_only(csl);
-                        } else {
-                            libsieve_free_sl_only(context->slflags);
-                            context->slflags = NULL;
-                        }
-                        TRACE_DEBUG("Removed flag: [%s]", sl->s);
-                        break; // Once we find a flag we can stop looking.
-                    }
-                    prev = csl; // Previous item in the list.
-                }
-                TRACE_DEBUG("Doing a removeflag [%s]", sl->s);
-            }
+        case BC_REMOVEFLAG:
+            for (i = 1; i <= w[2]; i++)
+                static_removeflag(context, static_str(r, w[2 + i]));
             break;
-        case NOTIFY:
-            res = libsieve_do_notify(context, c->u.n.id, c->u.n.method,
-                            c->u.n.options, c->u.n.priority, c->u.n.message);
+        case BC_NOTIFY:
+            list = static_stringlist(r, pc + 6);
+            res = libsieve_do_notify(context, static_str(r, w[2]),
+                    static_str(r, w[3]), list,
+                    static_str(r, w[4]), static_str(r, w[5]));
+            libsieve_free(list);
             TRACE_DEBUG("Doing a notify");
             break;
         }
-
-        if (res) /* we've either encountered an error or a stop */
-            break;
-
-        /* execute next command */
-        c = c->next;
+        /* we've either encountered an error or a stop */
     }
 
     return res;
 }
 
 /* vim: set ex ts=4: */
-
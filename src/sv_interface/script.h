@@ -31,8 +31,15 @@ OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include "tree.h"
 #include "sieve2.h"
 #include "context2.h"
+#include "bytecode.h"
 
 int libsieve_eval(struct sieve2_context *context,
-		commandlist_t *c, const char **errmsg);
+		const struct sieve2_script *script,
+		const bc_word_t *slots, const char **errmsg);
+int libsieve_eval_memo(struct sieve2_context *context, size_t len);
+int libsieve_eval_stack(struct sieve2_context *context, int depth);
+
+/* The headers vacation may ask for, NULL terminated. */
+extern const char * const libsieve_vacation_headers[];
 
 #endif /* SIEVE_SCRIPT_H */
@@ -17,6 +17,16 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 /* CMU portions. */
 #include "tree.h"
@@ -25,6 +35,9 @@
 
 /* libSieve additions. */
 #include "callbacks2.h"
+#include "bytecode.h"
+#include "optimize.h"
+#include "ruleindex.h"
 #include "message2.h"
 #include "context2.h"
 #include "sieve2.h"
@@ -43,7 +56,26 @@ VISIBLE char * sieve2_errstr(int code)
     return (char *)sieve2_error_text[code];
 }
 
-VISIBLE int sieve2_alloc(sieve2_context_t **context)
+/* Each call on a context gets its memory from the context's allocator,
+ * and each call on a script from the script's. The one in effect is
+ * per thread, and the one before is put back when the call returns,
+ * in case it was made from a callback in the middle of another. */
+#define static_context_allocator(c) ((c) ? &(c)->allocator : NULL)
+
+#define WITH_ALLOCATOR(a, res, call) do { \
+    const sieve2_allocator_t *_prev = libsieve_allocator_push(a); \
+    res = call; \
+    libsieve_allocator_pop(_prev); \
+} while (0)
+
+VISIBLE int sieve2_setallocator(const sieve2_allocator_t *allocator)
+{
+    return libsieve_allocator_set(allocator);
+}
+
+/* The context keeps its own copy of the allocator it was given,
+ * or of the one in effect, and frees itself with that. */
+static int static_alloc(sieve2_context_t **context)
 {
     struct sieve2_context *c;
 
@@ -54,10 +86,16 @@ VISIBLE int sieve2_alloc(sieve2_context_t **context)
         return SIEVE2_ERROR_NOMEM;
     }
     memset(c, 0, sizeof(struct sieve2_context));
+    c->allocator = *libsieve_allocator();
+
+    if (libsieve_eval_stack(c, SIEVE2_DEFAULT_MAXDEPTH) != SIEVE2_OK) {
+        libsieve_free(c);
+        *context = NULL;
+        return SIEVE2_ERROR_NOMEM;
+    }
 
     libsieve_addrlex_init(&c->addr_scan);
     libsieve_sievelex_init(&c->sieve_scan);
-    libsieve_headerlex_init(&c->header_scan);
 
     libsieve_message2_alloc(&c->message);
 
@@ -68,7 +106,31 @@ VISIBLE int sieve2_alloc(sieve2_context_t **context)
     return SIEVE2_OK;
 }
 
-VISIBLE int sieve2_free(sieve2_context_t **context)
+VISIBLE int sieve2_alloc(sieve2_context_t **context)
+{
+    int res;
+
+    if (context == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    WITH_ALLOCATOR(NULL, res, static_alloc(context));
+    return res;
+}
+
+VISIBLE int sieve2_alloc_with(sieve2_context_t **context,
+                              const sieve2_allocator_t *allocator)
+{
+    int res;
+
+    if (context == NULL || allocator == NULL || allocator->malloc_fn == NULL
+     || allocator->realloc_fn == NULL || allocator->free_fn == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    WITH_ALLOCATOR(allocator, res, static_alloc(context));
+    return res;
+}
+
+static int static_free(sieve2_context_t **context)
 {
     struct sieve2_context *c;
 
@@ -76,72 +138,125 @@ VISIBLE int sieve2_free(sieve2_context_t **context)
         return SIEVE2_ERROR_BADARGS;
     c = *context;
 
-    /* These used to be in sieve.y, but needed to be higher */
-    if (c->script.cmds) {
-        libsieve_free_tree(c->script.cmds);
-    }
-
     libsieve_message2_free(&c->message);
 
     libsieve_addrlex_destroy(c->addr_scan);
     libsieve_sievelex_destroy(c->sieve_scan);
-    libsieve_headerlex_destroy(c->header_scan);
 
     libsieve_strbuffree(&c->strbuf, FREEME);
 
-    if (c->slflags) {
-	libsieve_free_sl_only(c->slflags);
+    if (c->exec.slflags) {
+	libsieve_free_sl_only(c->exec.slflags);
     }
 
+    libsieve_arena_free(&c->actionlist.arena);
+    libsieve_free(c->actionlist.pending);
+
+    libsieve_free(c->stack);
+    libsieve_free(c->memo);
+    libsieve_do_getheader_reset(c);
+    libsieve_arena_free(&c->header_arena);
+    libsieve_arena_free(&c->exec_arena);
     libsieve_free(c);
     *context = NULL;
 
     return SIEVE2_OK;
 }
 
+VISIBLE int sieve2_free(sieve2_context_t **context)
+{
+    int res;
+
+    if (context == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    WITH_ALLOCATOR(static_context_allocator(*context), res, static_free(context));
+    return res;
+}
+
+/* Everything here is per message: the parsed headers, the header
+ * cache, what was left in the arena for executing, and the action list.
+ * Each of them is cleared without giving back its memory, so a
+ * context used for one message after another stays the same size. */
+static int static_reset(sieve2_context_t *context)
+{
+    struct sieve2_context *c = context;
+
+    if (context == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    libsieve_message2_reset(c->message);
+    libsieve_do_getheader_reset(c);
+
+    /* The next message's headers have to be fetched and parsed again. */
+    if (c->callbacks.getheader == libsieve_message2_getheader)
+        c->callbacks.getheader = NULL;
+    libsieve_strbufclear(c->strbuf);
+    libsieve_arena_clear(&c->exec_arena);
+
+    if (c->exec.slflags)
+        libsieve_free_sl_only(c->exec.slflags);
+    memset(&c->exec, 0, sizeof(struct exec2));
+
+    /* Clears the list, and there's no memory to run out of. */
+    libsieve_actionlist_begin(c, 0);
+
+    c->script.error_count = 0;
+    c->script.error_lineno = 1;
+    c->parse_errors = 0;
+    c->user_data = NULL;
+
+    return SIEVE2_OK;
+}
+
+VISIBLE int sieve2_reset(sieve2_context_t *context)
+{
+    int res;
+
+    WITH_ALLOCATOR(static_context_allocator(context), res, static_reset(context));
+    return res;
+}
+
+/* The stack is allocated here, rather than for each message. */
+VISIBLE int sieve2_setmaxdepth(sieve2_context_t *context, int depth)
+{
+    int res;
+
+    if (context == NULL || depth < 1)
+        return SIEVE2_ERROR_BADARGS;
+
+    WITH_ALLOCATOR(&context->allocator, res, libsieve_eval_stack(context, depth));
+    return res;
+}
+
 /* Fill in the support structure based on
  * the registered callbacks. */
 static void static_check_support(struct sieve2_context *c)
 {
-	if (c->callbacks.fileinto)
-	    c->support.fileinto = 1;
-	
-        if (c->callbacks.reject)
-	    c->support.reject = 1;
+	/* Every action is supported when they go on the list. */
+	enum boolean all = c->actionlist.on;
+
+	c->support.fileinto = (c->callbacks.fileinto || all);
+	c->support.reject = (c->callbacks.reject || all);
+	c->support.vacation = (c->callbacks.vacation || all);
+	c->support.notify = (c->callbacks.notify || all);
 
 	if (c->callbacks.getenvelope)
 	    c->support.envelope = 1;
 
 	if (c->callbacks.getsubaddress)
 	    c->support.subaddress = 1;
-
-	if (c->callbacks.vacation)
-	    c->support.vacation = 1;
-
-	if (c->callbacks.notify)
-	    c->support.notify = 1;
 }
 
-/* Register the user's callback functions into the Sieve context.
- * Also set up the support structure based on which actions have
- * callbacks registered for them. */
-VISIBLE int sieve2_callbacks(sieve2_context_t *context,
-			     sieve2_callback_t *callbacks)
+/* Where the callback for a value is kept, or NULL if there's none. */
+static sieve2_callback_func *static_callback(struct sieve2_context *c,
+                                             sieve2_values_t value)
 {
-    struct sieve2_context *c = (struct sieve2_context *)context;
-    sieve2_callback_t *cb;
-
-    if (c == NULL || callbacks == NULL)
-        return SIEVE2_ERROR_BADARGS;
-
-    for (cb = callbacks; cb->value; cb++)
-      {
-        switch(cb->value)
+        switch(value)
           {
 #define   CBCASE(VAL, CB) \
           case VAL: \
-              c->callbacks.CB = cb->func; \
-              break
+              return &c->callbacks.CB
           CBCASE(SIEVE2_ACTION_REDIRECT,       redirect);
           CBCASE(SIEVE2_ACTION_REJECT,         reject);
           CBCASE(SIEVE2_ACTION_DISCARD,        discard);
@@ -160,15 +275,69 @@ VISIBLE int sieve2_callbacks(sieve2_context_t *context,
           CBCASE(SIEVE2_SCRIPT_GETSCRIPT,      getscript);
 
           CBCASE(SIEVE2_MESSAGE_GETHEADER,     getheader);
+          CBCASE(SIEVE2_MESSAGE_GETHEADERS,    getheaders);
           CBCASE(SIEVE2_MESSAGE_GETALLHEADERS, getallheaders);
           CBCASE(SIEVE2_MESSAGE_GETSUBADDRESS, getsubaddress);
           CBCASE(SIEVE2_MESSAGE_GETENVELOPE,   getenvelope);
           CBCASE(SIEVE2_MESSAGE_GETSIZE,       getsize);
           CBCASE(SIEVE2_MESSAGE_GETBODY,       getbody);
+#undef    CBCASE
 	  default:
-              // FIXME: Also put useful error text into the context.
-              return SIEVE2_ERROR_UNSUPPORTED;
+              return NULL;
 	  }
+}
+
+/* See sieve2.h; the lists themselves are put together in callbacks2.c. */
+VISIBLE int sieve2_setactionlist(sieve2_context_t *context, int on)
+{
+    struct sieve2_context *c = context;
+
+    if (context == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    c->actionlist.on = (on ? TRUE : FALSE);
+    static_check_support(c);
+
+    return SIEVE2_OK;
+}
+
+VISIBLE int sieve2_getactionlist(sieve2_context_t *context, int which,
+                                 const sieve2_action_t **actions, int *count)
+{
+    struct sieve2_context *c = context;
+
+    if (context == NULL || actions == NULL || count == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    if (which < 0 || which >= c->actionlist.nlists)
+        return SIEVE2_ERROR_BADARGS;
+
+    *actions = c->actionlist.lists[which].actions;
+    *count = c->actionlist.lists[which].count;
+
+    return SIEVE2_OK;
+}
+
+/* Register the user's callback functions into the Sieve context.
+ * Also set up the support structure based on which actions have
+ * callbacks registered for them. */
+VISIBLE int sieve2_callbacks(sieve2_context_t *context,
+			     sieve2_callback_t *callbacks)
+{
+    struct sieve2_context *c = (struct sieve2_context *)context;
+    sieve2_callback_t *cb;
+    sieve2_callback_func *func;
+
+    if (c == NULL || callbacks == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    for (cb = callbacks; cb->value; cb++)
+      {
+        // FIXME: Also put useful error text into the context.
+        if ((func = static_callback(c, cb->value)) == NULL)
+            return SIEVE2_ERROR_UNSUPPORTED;
+        *func = cb->func;
+        c->callbacks.v3[cb->value] = NULL;
       }
 
     static_check_support(c);
@@ -176,7 +345,32 @@ VISIBLE int sieve2_callbacks(sieve2_context_t *context,
     return SIEVE2_OK;
 }
 
-VISIBLE int sieve2_validate(sieve2_context_t *context, void *user_data)
+/* The same for version 3 callbacks, which are reached through
+ * libsieve_callback3 in place of a version 2 callback. */
+VISIBLE int sieve2_callbacks3(sieve2_context_t *context,
+			      sieve2_callback3_t *callbacks)
+{
+    struct sieve2_context *c = (struct sieve2_context *)context;
+    sieve2_callback3_t *cb;
+    sieve2_callback_func *func;
+
+    if (c == NULL || callbacks == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    for (cb = callbacks; cb->value; cb++)
+      {
+        if ((func = static_callback(c, cb->value)) == NULL)
+            return SIEVE2_ERROR_UNSUPPORTED;
+        *func = cb->func ? libsieve_callback3 : NULL;
+        c->callbacks.v3[cb->value] = cb->func;
+      }
+
+    static_check_support(c);
+
+    return SIEVE2_OK;
+}
+
+static int static_validate(sieve2_context_t *context, void *user_data)
 {
     struct sieve2_context *c = context;
 
@@ -193,13 +387,14 @@ VISIBLE int sieve2_validate(sieve2_context_t *context, void *user_data)
         return SIEVE2_ERROR_GETSCRIPT;
 
     try {
-        c->script.cmds = libsieve_sieve_parse_buffer(c);
-        libsieve_free_tree(c->script.cmds);
-        c->script.cmds = NULL;
+        libsieve_free_tree(libsieve_sieve_parse_buffer(c));
     } catch(SIEVE2_ERROR_INTERNAL) {
         return SIEVE2_ERROR_INTERNAL;
     } endtry;
 
+    /* Addresses checked while parsing. */
+    libsieve_arena_clear(&c->exec_arena);
+
     if (c->script.error_count > 0) {
         return SIEVE2_ERROR_PARSE;
     }
@@ -207,6 +402,132 @@ VISIBLE int sieve2_validate(sieve2_context_t *context, void *user_data)
     return SIEVE2_OK;
 }
 
+VISIBLE int sieve2_validate(sieve2_context_t *context, void *user_data)
+{
+    int res;
+
+    WITH_ALLOCATOR(static_context_allocator(context), res,
+                   static_validate(context, user_data));
+    return res;
+}
+
+/* Compiled scripts are shared between threads,
+ * so their reference counts must be changed atomically. */
+#if defined(__GNUC__)
+#define static_ref_inc(x) __sync_add_and_fetch(&(x), 1)
+#define static_ref_dec(x) __sync_sub_and_fetch(&(x), 1)
+#else
+#define static_ref_inc(x) (++(x))
+#define static_ref_dec(x) (--(x))
+#endif
+
+/* If the client app doesn't have its own header parser,
+ * we will use an internal one. */
+static int static_getheaders(struct sieve2_context *c)
+{
+    int res = SIEVE2_OK;
+
+    if (c->callbacks.getheader)
+        return SIEVE2_OK;
+
+    /* The user answers for all the headers at once. */
+    if (c->callbacks.getheaders && !c->callbacks.getallheaders)
+        return SIEVE2_OK;
+
+    if (!c->callbacks.getallheaders) {
+        /* Incomplete function registration.
+         * FIXME: Would be nice to give more details. */
+        return SIEVE2_ERROR_NOT_FINALIZED;
+    }
+
+    try {
+        /* Get the header! FIXME: should have different error codes... */
+        if (libsieve_do_getallheaders(c, &(c->message->header)) != SIEVE2_OK) {
+            res = SIEVE2_ERROR_HEADER;
+        } else {
+            /* Our "internal callback" instead of the user's getheader. */
+            c->callbacks.getheader = libsieve_message2_getheader;
+            if (libsieve_message2_parseheader(c) != SIEVE2_OK)
+                res = SIEVE2_ERROR_HEADER;
+        }
+    } catch(SIEVE2_ERROR_INTERNAL) {
+        res = SIEVE2_ERROR_INTERNAL;
+    } endtry;
+
+    return res;
+}
+
+/* The headers parsed above point into the getallheaders reply, which
+ * only has to last as long as the call which asked for it; so once that
+ * returns, the internal parser is taken out again, and the next call
+ * fetches and parses the headers of its own message. */
+static void static_getheaders_done(struct sieve2_context *c)
+{
+    if (c != NULL && c->callbacks.getheader == libsieve_message2_getheader)
+        c->callbacks.getheader = NULL;
+}
+
+/* Parse the script that was just fetched, and turn it into bytecode.
+ * The tree is only needed until the bytecode is written. If strict,
+ * errors the parser recovered from fail the compile, too; otherwise
+ * whatever could be parsed is run, as sieve2_execute always has. */
+static int static_compile(struct sieve2_context *c, struct sieve2_script **script,
+                          int strict)
+{
+    struct sieve2_script *s;
+    struct bc_header *image = NULL;
+    commandlist_t *cmds = NULL;
+    int res = SIEVE2_OK;
+
+    c->parse_errors = 0;
+
+    /* The script should only carry what it requires. */
+    memset(&c->require, 0, sizeof(struct support2));
+
+    try {
+        cmds = libsieve_sieve_parse_buffer(c);
+    } catch(SIEVE2_ERROR_INTERNAL) {
+        res = SIEVE2_ERROR_INTERNAL;
+    } endtry;
+
+    if (res == SIEVE2_OK && ((strict && c->parse_errors > 0) || c->script.error_count > 0))
+        res = SIEVE2_ERROR_PARSE;
+
+    if (res == SIEVE2_OK) {
+        cmds = libsieve_optimize(c, cmds);
+        res = libsieve_bc_emit(cmds, &c->require, &image);
+    }
+    if (cmds)
+        libsieve_free_tree(cmds);
+    libsieve_arena_clear(&c->exec_arena);
+    if (res != SIEVE2_OK)
+        return res;
+
+    s = (struct sieve2_script *)libsieve_malloc(sizeof(struct sieve2_script));
+    if (s == NULL) {
+        libsieve_free(image);
+        return SIEVE2_ERROR_NOMEM;
+    }
+    memset(s, 0, sizeof(struct sieve2_script));
+    s->allocator = *libsieve_allocator();
+    s->refcount = 1;
+    s->image = image;
+    s->length = BC_LENGTH(image);
+    s->mapped = FALSE;
+
+    if ((res = libsieve_bc_bind(s)) != SIEVE2_OK) {
+        sieve2_script_free(&s);
+        return res;
+    }
+
+    *script = s;
+
+    return SIEVE2_OK;
+}
+
+static int static_execute(struct sieve2_context *c, struct sieve2_script *script,
+                          const bc_word_t *slots, int which);
+
 /* This is where we really do it:
  * run a script over a message to produce an action list
  *
@@ -215,10 +536,11 @@ VISIBLE int sieve2_validate(sieve2_context_t *context, void *user_data)
  * SIEVE2_ERROR_PARSE for script parse errors
  * SIEVE2_ERROR_EXEC for script evaluation errors
  */
-VISIBLE int sieve2_execute(sieve2_context_t *context, void *user_data)
+static int static_execute_once(sieve2_context_t *context, void *user_data)
 {
     struct sieve2_context *c = context;
-    const char *errmsg = NULL;
+    struct sieve2_script *s = NULL;
+    int res;
 
     if (context == NULL)
         return SIEVE2_ERROR_BADARGS;
@@ -228,52 +550,456 @@ VISIBLE int sieve2_execute(sieve2_context_t *context, void *user_data)
     c->script.error_count = 0;         /* Reset error count */
     c->script.error_lineno = 1;        /* Reset line number */
 
+    /* If we don't get as far as running it, the list is a keep. */
+    if ((res = libsieve_actionlist_begin(c, 1)) != SIEVE2_OK)
+        return res;
+
     /* First callback already! Get the script! */
     if (libsieve_do_getscript(c, "", "", &c->script.script, &c->script.length) != SIEVE2_OK)
         return SIEVE2_ERROR_GETSCRIPT;
 
-    try {
+    if ((res = static_getheaders(c)) != SIEVE2_OK)
+        return res;
 
-        /* If the client app doesn't have its own header parser,
-         * we will use an internal one. */
-        if (!c->callbacks.getheader) {
-            if (!c->callbacks.getallheaders) {
-                /* Incomplete function registration.
-                 * FIXME: Would be nice to give more details. */
-                return SIEVE2_ERROR_NOT_FINALIZED;
-            } else {
-            /* Get the header! FIXME: should have different error codes... */
-            if (libsieve_do_getallheaders(c, &(c->message->header)) != SIEVE2_OK)
-                return SIEVE2_ERROR_HEADER;
-            /* Our "internal callback" instead of the user's getheader. */
-            c->callbacks.getheader = libsieve_message2_getheader;
-            if (libsieve_message2_parseheader(c) != SIEVE2_OK)
-                return SIEVE2_ERROR_HEADER;
-            }
-        }
- 
-        c->script.cmds = libsieve_sieve_parse_buffer(c);
-        if (c->script.error_count > 0) {
-            if (c->script.cmds) {
-                libsieve_free_tree(c->script.cmds);
-            }
-            c->script.cmds = NULL;
-            return SIEVE2_ERROR_PARSE;
-        }
+    /* This is sieve2_compile and sieve2_execute_script in one go. */
+    if ((res = static_compile(c, &s, 0)) != SIEVE2_OK)
+        return res;
 
-        if (libsieve_eval(c, c->script.cmds, &errmsg) < 0)
-            return SIEVE2_ERROR_EXEC;
+    libsieve_do_getheader_reset(c);
 
-    } catch(SIEVE2_ERROR_INTERNAL) {
-        return SIEVE2_ERROR_INTERNAL;
-    } endtry;
+    res = static_execute(c, s, NULL, 0);
+
+    sieve2_script_free(&s);
 
     /* If no action was taken, libsieve_eval will have
      * returned > 0. But we're going to hide that and
      * just return SIEVE2_OK. It is up to the client app
      * to notice that no callbacks occurred and therefore
-     * a keep MUST be performed.
+     * a keep MUST be performed. With the action list on,
+     * the keep is on it.
      * */
+    return res;
+}
+
+VISIBLE int sieve2_execute(sieve2_context_t *context, void *user_data)
+{
+    int res;
+
+    WITH_ALLOCATOR(static_context_allocator(context), res,
+                   static_execute_once(context, user_data));
+    static_getheaders_done(context);
+    return res;
+}
+
+/* Parse the script once, and turn it into bytecode for sieve2_execute_script.
+ *
+ * Error codes:
+ * SIEVE2_ERROR_BADARGS if any of the arguments are NULL
+ * SIEVE2_ERROR_GETSCRIPT if the script callback failed
+ * SIEVE2_ERROR_PARSE for script parse errors
+ */
+static int static_compile_script(sieve2_context_t *context, void *user_data,
+                                 sieve2_script_t **script)
+{
+    struct sieve2_context *c = context;
+
+    if (context == NULL || script == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    *script = NULL;
+
+    c->user_data = user_data;
+
+    c->script.error_count = 0;         /* Reset error count */
+    c->script.error_lineno = 1;        /* Reset line number */
+
+    if (libsieve_do_getscript(c, "", "", &c->script.script, &c->script.length) != SIEVE2_OK)
+        return SIEVE2_ERROR_GETSCRIPT;
+
+    return static_compile(c, script, 1);
+}
+
+VISIBLE int sieve2_compile(sieve2_context_t *context, void *user_data,
+                           sieve2_script_t **script)
+{
+    int res;
+
+    WITH_ALLOCATOR(static_context_allocator(context), res,
+                   static_compile_script(context, user_data, script));
+    return res;
+}
+
+/* Write out the bytecode of a compiled script for sieve2_script_load.
+ * The file is written in place, so write to a temporary name and
+ * rename it if other processes might be loading it at the same time.
+ *
+ * Error codes:
+ * SIEVE2_ERROR_BADARGS if any of the arguments are NULL
+ * SIEVE2_ERROR_FAIL if the file could not be written
+ */
+VISIBLE int sieve2_script_write(sieve2_script_t *script, const char *filename)
+{
+    const char *p;
+    size_t left;
+    ssize_t n;
+    int fd;
+
+    if (script == NULL || filename == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return SIEVE2_ERROR_FAIL;
+
+    p = (const char *)script->image;
+    for (left = script->length; left > 0; left -= n, p += n) {
+        n = write(fd, p, left);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n <= 0) {
+            close(fd);
+            return SIEVE2_ERROR_FAIL;
+        }
+    }
+
+    if (close(fd) != 0)
+        return SIEVE2_ERROR_FAIL;
+
+    return SIEVE2_OK;
+}
+
+/* Map in a compiled script written by sieve2_script_write. There's no
+ * parsing, and the pages are shared with every other process which
+ * maps the same file. Only :regex patterns have to be compiled again.
+ *
+ * Error codes:
+ * SIEVE2_ERROR_BADARGS if any of the arguments are NULL
+ * SIEVE2_ERROR_FAIL if the file could not be read
+ * SIEVE2_ERROR_BYTECODE if the file isn't a compiled script for
+ *                       this version of libSieve on this machine
+ */
+VISIBLE int sieve2_script_load(const char *filename, sieve2_script_t **script)
+{
+    struct sieve2_script *s;
+    struct stat st;
+    void *image;
+    int fd, res;
+
+    if (filename == NULL || script == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    *script = NULL;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return SIEVE2_ERROR_FAIL;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return SIEVE2_ERROR_FAIL;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct bc_header)) {
+        close(fd);
+        return SIEVE2_ERROR_BYTECODE;
+    }
+
+    s = (struct sieve2_script *)libsieve_malloc(sizeof(struct sieve2_script));
+    if (s == NULL) {
+        close(fd);
+        return SIEVE2_ERROR_NOMEM;
+    }
+    memset(s, 0, sizeof(struct sieve2_script));
+    s->allocator = *libsieve_allocator();
+    s->refcount = 1;
+    s->length = st.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+    image = mmap(NULL, s->length, PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        close(fd);
+        libsieve_free(s);
+        return SIEVE2_ERROR_FAIL;
+    }
+    s->mapped = TRUE;
+#else
+    image = libsieve_malloc(s->length);
+    if (image == NULL || read(fd, image, s->length) != (ssize_t)s->length) {
+        close(fd);
+        libsieve_free(image);
+        libsieve_free(s);
+        return image ? SIEVE2_ERROR_FAIL : SIEVE2_ERROR_NOMEM;
+    }
+    s->mapped = FALSE;
+#endif
+    close(fd);
+
+    s->image = image;
+
+    if ((res = libsieve_bc_bind(s)) != SIEVE2_OK) {
+        sieve2_script_free(&s);
+        return res;
+    }
+
+    *script = s;
+
+    return SIEVE2_OK;
+}
+
+/* The context executing a compiled script might not be the one
+ * which compiled it, so make sure it supports what the script requires. */
+static int static_check_require(struct sieve2_context *c, struct sieve2_script *s)
+{
+    return !((s->require.fileinto && !c->support.fileinto)
+          || (s->require.reject && !c->support.reject)
+          || (s->require.envelope && !c->support.envelope)
+          || (s->require.vacation && !c->support.vacation)
+          || (s->require.notify && !c->support.notify)
+          || (s->require.subaddress && !c->support.subaddress));
+}
+
+/* Run one compiled script, once the message's headers are ready.
+ * Slots are from an index, if the memo is shared; see libsieve_eval.
+ * Which is where its actions go in the action list, if it's on. */
+static int static_execute(struct sieve2_context *c, struct sieve2_script *script,
+                          const bc_word_t *slots, int which)
+{
+    const char *errmsg = NULL;
+    int res = SIEVE2_OK;
+
+    /* Start over with a clean slate for this script. */
+    if (c->exec.slflags)
+        libsieve_free_sl_only(c->exec.slflags);
+    memset(&c->exec, 0, sizeof(struct exec2));
+
+    /* Those which aren't answered now can still be asked for one by one. */
+    libsieve_do_getheaders(c, script->headers, script->nheaders);
+
+    try {
+        if (libsieve_eval(c, script, slots, &errmsg) < 0)
+            res = SIEVE2_ERROR_EXEC;
+    } catch(SIEVE2_ERROR_INTERNAL) {
+        res = SIEVE2_ERROR_INTERNAL;
+    } endtry;
+
+    /* Everything the script needed only while it ran goes at once. */
+    libsieve_arena_clear(&c->exec_arena);
+
+    /* As with sieve2_execute, no action means an implicit keep. */
+    return libsieve_actionlist_end(c, which, res);
+}
+
+/* Run a script from sieve2_compile over a message.
+ *
+ * Error codes:
+ * SIEVE2_ERROR_BADARGS if any of the arguments are NULL
+ * SIEVE2_ERROR_UNSUPPORTED if the script requires a missing callback
+ * SIEVE2_ERROR_EXEC for script evaluation errors
+ */
+static int static_execute_script(sieve2_context_t *context,
+                                 sieve2_script_t *script, void *user_data)
+{
+    struct sieve2_context *c = context;
+    int res;
+
+    if (context == NULL || script == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    c->user_data = user_data;
+
+    if ((res = libsieve_actionlist_begin(c, 1)) != SIEVE2_OK)
+        return res;
+
+    if (!static_check_require(c, script))
+        return SIEVE2_ERROR_UNSUPPORTED;
+
+    if ((res = static_getheaders(c)) != SIEVE2_OK)
+        return res;
+
+    /* Headers fetched for the last message don't belong to this one. */
+    libsieve_do_getheader_reset(c);
+
+    return static_execute(c, script, NULL, 0);
+}
+
+VISIBLE int sieve2_execute_script(sieve2_context_t *context,
+                                  sieve2_script_t *script, void *user_data)
+{
+    int res;
+
+    WITH_ALLOCATOR(static_context_allocator(context), res,
+                   static_execute_script(context, script, user_data));
+    static_getheaders_done(context);
+    return res;
+}
+
+/* Run the scripts of every recipient of one message. The headers are
+ * fetched and parsed once, with the first user_data, and are shared by
+ * all of the scripts. Each script then runs with its own user_data,
+ * which is what its envelope, size and action callbacks are given.
+ * The result of each script goes in results, as if it had been run
+ * by sieve2_execute_script.
+ *
+ * Error codes:
+ * SIEVE2_ERROR_BADARGS if any of the arguments are NULL
+ * SIEVE2_ERROR_HEADER if the headers could not be fetched
+ */
+static int static_execute_scripts(sieve2_context_t *context,
+                                  sieve2_script_t **scripts, void **user_data,
+                                  int count, int *results)
+{
+    struct sieve2_context *c = context;
+    int i, res;
+
+    if (context == NULL || scripts == NULL || user_data == NULL
+     || results == NULL || count < 0)
+        return SIEVE2_ERROR_BADARGS;
+
+    if ((res = libsieve_actionlist_begin(c, count)) != SIEVE2_OK)
+        return res;
+
+    if (count == 0)
+        return SIEVE2_OK;
+
+    c->user_data = user_data[0];
+
+    if ((res = static_getheaders(c)) != SIEVE2_OK)
+        return res;
+
+    libsieve_do_getheader_reset(c);
+
+    for (i = 0; i < count; i++) {
+        c->user_data = user_data[i];
+        if (scripts[i] == NULL)
+            results[i] = SIEVE2_ERROR_BADARGS;
+        else if (!static_check_require(c, scripts[i]))
+            results[i] = SIEVE2_ERROR_UNSUPPORTED;
+        else
+            results[i] = static_execute(c, scripts[i], NULL, i);
+    }
+
+    return SIEVE2_OK;
+}
+
+VISIBLE int sieve2_execute_scripts(sieve2_context_t *context,
+                                   sieve2_script_t **scripts, void **user_data,
+                                   int count, int *results)
+{
+    int res;
+
+    WITH_ALLOCATOR(static_context_allocator(context), res,
+                   static_execute_scripts(context, scripts, user_data, count, results));
+    static_getheaders_done(context);
+    return res;
+}
+
+/* As sieve2_execute_scripts, but for scripts picked out of an index by
+ * their position in it. A test of the message which any number of them
+ * have is only worked out once. The memo is as long as the number of
+ * distinct tests in the whole index, and is cleared once per call; the
+ * envelope tests of a script are cleared again before each run of it,
+ * since any number of recipients may share its position.
+ *
+ * Error codes:
+ * SIEVE2_ERROR_BADARGS if any of the arguments are NULL
+ * SIEVE2_ERROR_HEADER if the headers could not be fetched
+ * SIEVE2_ERROR_NOMEM if there's no memory for the memo
+ */
+static int static_execute_index(sieve2_context_t *context, sieve2_index_t *index,
+                                const int *which, void **user_data,
+                                int count, int *results)
+{
+    struct sieve2_context *c = context;
+    struct sieve2_script *s;
+    const bc_word_t *envelope;
+    int i, res;
+
+    if (context == NULL || index == NULL || which == NULL
+     || user_data == NULL || results == NULL || count < 0)
+        return SIEVE2_ERROR_BADARGS;
+
+    if ((res = libsieve_actionlist_begin(c, count)) != SIEVE2_OK)
+        return res;
+
+    if (count == 0)
+        return SIEVE2_OK;
+
+    c->user_data = user_data[0];
+
+    if ((res = static_getheaders(c)) != SIEVE2_OK)
+        return res;
+
+    libsieve_do_getheader_reset(c);
+
+    if (libsieve_eval_memo(c, index->memo_len) != SIEVE2_OK)
+        return SIEVE2_ERROR_NOMEM;
+
+    for (i = 0; i < count; i++) {
+        c->user_data = user_data[i];
+        if (which[i] < 0 || which[i] >= index->count) {
+            results[i] = SIEVE2_ERROR_BADARGS;
+            continue;
+        }
+        s = index->scripts[which[i]];
+        envelope = &index->envelope[2 * which[i]];
+        memset(c->memo + envelope[0], -1, envelope[1]);
+        if (!static_check_require(c, s))
+            results[i] = SIEVE2_ERROR_UNSUPPORTED;
+        else
+            results[i] = static_execute(c, s, index->slots[which[i]], i);
+    }
+
+    return SIEVE2_OK;
+}
+
+VISIBLE int sieve2_execute_index(sieve2_context_t *context, sieve2_index_t *index,
+                                 const int *which, void **user_data,
+                                 int count, int *results)
+{
+    int res;
+
+    WITH_ALLOCATOR(static_context_allocator(context), res,
+                   static_execute_index(context, index, which, user_data, count, results));
+    static_getheaders_done(context);
+    return res;
+}
+
+/* Take another reference to a compiled script, e.g. for another thread.
+ * Each reference is dropped with its own call to sieve2_script_free. */
+VISIBLE int sieve2_script_ref(sieve2_script_t *script)
+{
+    if (script == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    static_ref_inc(script->refcount);
+
+    return SIEVE2_OK;
+}
+
+VISIBLE int sieve2_script_free(sieve2_script_t **script)
+{
+    struct sieve2_script *s;
+
+    if (script == NULL)
+        return SIEVE2_ERROR_BADARGS;
+    s = *script;
+
+    /* The last reference out frees the bytecode,
+     * with the allocator it came from. */
+    if (s && static_ref_dec(s->refcount) <= 0) {
+        const sieve2_allocator_t *prev = libsieve_allocator_push(&s->allocator);
+        libsieve_bc_unbind(s);
+#ifdef HAVE_SYS_MMAN_H
+        if (s->mapped)
+            munmap((void *)s->image, s->length);
+        else
+#endif
+            libsieve_free((void *)s->image);
+        libsieve_free(s);
+        libsieve_allocator_pop(prev);
+    }
+    *script = NULL;
+
     return SIEVE2_OK;
 }
 
@@ -281,6 +1007,9 @@ VISIBLE char * sieve2_listextensions(sieve2_context_t *sieve2_context)
 {
     char *ext;
     struct sieve2_context *c = sieve2_context;
+    const sieve2_allocator_t *prev;
+
+    prev = libsieve_allocator_push(&c->allocator);
 
     ext = libsieve_strconcat(     "regex ",
                                   "imap4flags ",
@@ -293,7 +1022,10 @@ VISIBLE char * sieve2_listextensions(sieve2_context_t *sieve2_context)
         ( c->support.notify     ? "notify "    : "" ),
 	NULL );
 
-    return libsieve_strbuf(c->strbuf, ext, strlen(ext), FREEME);
+    ext = libsieve_strbuf(c->strbuf, ext, strlen(ext), FREEME);
+    libsieve_allocator_pop(prev);
+
+    return ext;
 }
 
 #if (MSDOS || WIN32)
@@ -53,6 +53,7 @@ patternlist_t *libsieve_new_pl(regex_t *pat, patternlist_t *n)
     patternlist_t *p = (patternlist_t *) libsieve_malloc(sizeof(patternlist_t));
     p->p = pat;
     p->next = n;
+    p->s = NULL;
     return p;
 }
 
@@ -76,6 +77,8 @@ test_t *libsieve_new_test(int type)
 {
     test_t *p = (test_t *) libsieve_malloc(sizeof(test_t));
     p->type = type;
+    p->depth = 0;
+    p->cost = 0;
     return p;
 }
 
@@ -91,10 +94,23 @@ commandlist_t *libsieve_new_command(int type)
 {
     commandlist_t *p = (commandlist_t *) libsieve_malloc(sizeof(commandlist_t));
     p->type = type;
+    p->depth = 0;
     p->next = NULL;
     return p;
 }
 
+static int static_depth(commandlist_t *cl)
+{
+    int depth = 0;
+
+    for (; cl != NULL; cl = cl->next) {
+        if (cl->depth > depth)
+            depth = cl->depth;
+    }
+
+    return depth;
+}
+
 commandlist_t *libsieve_new_if(test_t *t, commandlist_t *y, commandlist_t *n)
 {
     commandlist_t *p = (commandlist_t *) libsieve_malloc(sizeof(commandlist_t));
@@ -103,6 +119,19 @@ commandlist_t *libsieve_new_if(test_t *t, commandlist_t *y, commandlist_t *n)
     p->u.i.do_then = y;
     p->u.i.do_else = n;
     p->next = NULL;
+
+    /* An elsif chain is no deeper than its deepest arm,
+     * so that long chains don't run into the depth limit. */
+    p->depth = (t ? t->depth : 0);
+    if (1 + static_depth(y) > p->depth)
+        p->depth = 1 + static_depth(y);
+    if (n && n->type == IF && n->next == NULL) {
+        if (n->depth > p->depth)
+            p->depth = n->depth;
+    } else if (1 + static_depth(n) > p->depth) {
+        p->depth = 1 + static_depth(n);
+    }
+
     return p;
 }
 
@@ -136,11 +165,10 @@ void libsieve_free_pl(patternlist_t *pl, int comptag)
 
     while (pl != NULL) {
 	if (pl->p) {
-#ifdef ENABLE_REGEX
 	    if (comptag == REGEX) {
 		libsieve_regfree((regex_t *) pl->p);
+		libsieve_free(pl->s);
 	    }
-#endif
 	    libsieve_free(pl->p);
 	}
 	pl2 = pl->next;
@@ -214,7 +242,12 @@ void libsieve_free_tree(commandlist_t *cl)
 	case IF:
 	    libsieve_free_test(cl->u.i.t);
 	    libsieve_free_tree(cl->u.i.do_then);
-	    libsieve_free_tree(cl->u.i.do_else);
+	    /* Walk down an elsif chain rather than recursing. */
+	    if (cl2 == NULL) {
+		cl2 = cl->u.i.do_else;
+	    } else {
+		libsieve_free_tree(cl->u.i.do_else);
+	    }
 	    break;
 
 	case FILEINTO:
@@ -49,6 +49,7 @@ struct Stringlist {
 struct Patternlist {
     void *p;
     patternlist_t *next;
+    char *s; /* the source of a regex, for compiled scripts */
 };
 
 struct Tag {
@@ -63,12 +64,15 @@ struct Taglist {
 
 struct Test {
     int type;
+    int depth; /* how deeply anyof, allof and not nest in here */
+    int cost; /* a rough guess at the work to run it, from the optimizer */
     union {
 	testlist_t *tl; /* anyof, allof */
 	stringlist_t *sl; /* exists */
 	struct { /* it's a header test */
 	    int comptag;
 	    comparator_t *comp;
+	    int compid;
 	    stringlist_t *sl;
 	    patternlist_t *pl;
 	} h;
@@ -80,6 +84,7 @@ struct Test {
 	struct { /* it's an address or envelope test */
 	    int comptag;
 	    comparator_t *comp;
+	    int compid;
 	    stringlist_t *sl;
 	    patternlist_t *pl;
             int addrpart;
@@ -99,6 +104,7 @@ struct Testlist {
 
 struct Commandlist {
     int type;
+    int depth; /* how deeply blocks and tests nest in here */
     union {
         char *str;
 	stringlist_t *sl; /* the parameters */
@@ -149,6 +155,7 @@ commandlist_t *libsieve_new_if(test_t *t, commandlist_t *y, commandlist_t *n);
 void libsieve_free_sl(stringlist_t *sl);
 void libsieve_free_sl_only(stringlist_t *sl);
 void libsieve_free_pl(patternlist_t *pl, int comptag);
+void libsieve_free_tl(testlist_t *tl);
 void libsieve_free_test(test_t *t);
 void libsieve_free_tree(commandlist_t *cl);
 
@@ -38,6 +38,8 @@ OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 /* sv_util */
 #include "src/sv_util/util.h"
+#define YYMALLOC libsieve_malloc
+#define YYFREE libsieve_free
 
 /* sv_parser */
 #include "addr.h"
@@ -45,7 +47,6 @@ OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include "addr-lex.h"
 extern YY_DECL;
 static void libsieve_addrappend(struct sieve2_context *context);
-static struct address *libsieve_addrstructcopy(struct sieve2_context *context);
 
 /* sv_interface */
 #include "src/sv_interface/callbacks2.h"
@@ -99,37 +100,42 @@ mailbox:
 		TRACE_DEBUG( "mailbox: phrase angle_addr: %s %s", $1, $2 );
 		// This is a "top terminal" state...
 		TRACE_DEBUG( "context->addr_addr->name: %s", $1 );
-		context->addr_addr->name = libsieve_strdup( $1 );
+		context->addr_addr->name = $1;
 		};
 
-angle_addr: '<' addr_spec '>'		{ TRACE_DEBUG( "angle_addr: addr_spec: %s", $2 ); }
+angle_addr: '<' addr_spec '>'		{
+		TRACE_DEBUG( "angle_addr: addr_spec: %s", $2 );
+		$$ = $2;
+		}
 	| '<' route ':' addr_spec '>'	{
 		TRACE_DEBUG( "angle_addr: route addr_spec: %s:%s", $2, $4 );
 		// This is a "top terminal" state...
 		TRACE_DEBUG( "context->addr_addr->route: %s", $2 );
-		context->addr_addr->route = libsieve_strdup( $2 );
+		context->addr_addr->route = $2;
+		$$ = $4;
 		}
 	| '<' '>'			{
 		TRACE_DEBUG("angle_addr: <>");
-		context->addr_addr->mailbox = libsieve_strdup( "" );
+		context->addr_addr->mailbox = libsieve_arena_strdup(&context->exec_arena, "");
+		$$ = context->addr_addr->mailbox;
 		};
 
 addr_spec: local_part '@' domain		{
 		TRACE_DEBUG( "addr_spec: local_part domain: %s %s", $1, $3 );
 		// This is a "top terminal" state...
 		TRACE_DEBUG( "context->addr_addr->mailbox: %s", $1 );
-		context->addr_addr->mailbox = libsieve_strdup( $1 );
+		context->addr_addr->mailbox = $1;
 		TRACE_DEBUG( "context->addr_addr->domain: %s", $3 );
-		context->addr_addr->domain = libsieve_strdup( $3 );
+		context->addr_addr->domain = $3;
 		};
 
 route: '@' domain			{
 		TRACE_DEBUG( "route: domain: %s", $2 );
-                $$ = libsieve_strbuf(context->strbuf, libsieve_strconcat( "@", $2, NULL ), strlen($2)+1, FREEME);
+                $$ = libsieve_arena_strconcat(&context->exec_arena, "@", $2, NULL);
 		}
 	| '@' domain ',' route		{
 		TRACE_DEBUG( "route: domain route: %s %s", $2, $4 );
-		$$ = libsieve_strbuf(context->strbuf, libsieve_strconcat( "@", $2, ",", $4, NULL ), strlen($2)+strlen($4)+2, FREEME);
+		$$ = libsieve_arena_strconcat(&context->exec_arena, "@", $2, ",", $4, NULL);
 		};
 
 local_part: DOTATOM { TRACE_DEBUG( "local_part: DOTATOM: %s", $1 ); }
@@ -148,11 +154,11 @@ domainlit: '[' DTEXT ']'	{
 phrase: word			{ TRACE_DEBUG( "phrase: word: %s", $1 ); }
 	| phrase word		{
 		TRACE_DEBUG( "phrase: phrase word: %s %s", $1, $2 );
-		$$ = libsieve_strbuf(context->strbuf, libsieve_strconcat( $1, " ", $2, NULL ), strlen($1)+strlen($2)+1, FREEME);
+		$$ = libsieve_arena_strconcat(&context->exec_arena, $1, " ", $2, NULL);
 		}
 	| phrase DOTATOM	{
 		TRACE_DEBUG( "phrase: phrase DOTATOM: %s %s", $1, $2 );
-		$$ = libsieve_strbuf(context->strbuf, libsieve_strconcat( $1, " ", $2, NULL ), strlen($1)+strlen($2)+1, FREEME);
+		$$ = libsieve_arena_strconcat(&context->exec_arena, $1, " ", $2, NULL);
 		}
 
 word: ATOM			{ TRACE_DEBUG( "word: ATOM: %s", $1 ); }
@@ -168,13 +174,16 @@ qstring: QUOTE QTEXT QUOTE	{
 /* Run an execution error callback. */
 void libsieve_addrerror(struct sieve2_context *context, void *yyscanner, const char *msg)
 {
-    context->exec_errors++;
+    context->exec.errors++;
 
     libsieve_do_error_address(context, msg);
 }
 
 /* Wrapper for addrparse() which sets up the 
- * required environment and allocates variables
+ * required environment and allocates variables.
+ * The addresses, and all of their strings, are in
+ * the context's arena for this execution, and are
+ * let go of with it.
  */
 struct address *libsieve_addr_parse_buffer(struct sieve2_context *context, struct address **data, const char **ptr)
 {
@@ -184,33 +193,21 @@ struct address *libsieve_addr_parse_buffer(struct sieve2_context *context, struc
     context->addr_addr = NULL;
     libsieve_addrappend(context);
     YY_BUFFER_STATE buf = libsieve_addr_scan_string((char*)*ptr, addr_scan);
-/*
-        serr = libsieve_strconcat("address '", s, "': ", aerr, NULL);
-        libsieve_sieveerror(serr);
-        libsieve_free(serr);
-        libsieve_free(aerr);
-	*/
 
     if(libsieve_addrparse(context, addr_scan)) {
-        // FIXME: Make sure that this is sufficient cleanup
-        libsieve_addrstructfree(context, context->addr_addr, CHARSALSO);
         libsieve_addr_delete_buffer(buf, addr_scan);
         return NULL;
     }
 
-    /* Get to the tail end... */
-    newdata = *data;
-    while (newdata != NULL) {
-        newdata = newdata->next;
-    }
-
     /* While adding the new results onto the current set,
      * we notice that addrparse() leaves an extra struct
      * at the top, but at least we can hide that here!
      */
-    newdata = libsieve_addrstructcopy(context);
+    newdata = context->addr_addr->next;
     libsieve_addr_delete_buffer(buf, addr_scan);
-    libsieve_addrstructfree(context, context->addr_addr, STRUCTONLY);
+
+    if (newdata == NULL)
+        TRACE_DEBUG("No addresses found at all, returning NULL.");
 
     if (*data == NULL)
         *data = newdata;
@@ -218,76 +215,9 @@ struct address *libsieve_addr_parse_buffer(struct sieve2_context *context, struc
     return *data;
 }
 
-void libsieve_addrstructfree(struct sieve2_context *context, struct address *addr, int freeall)
-{
-    struct address *bddr;
-
-    while (addr != NULL) {
-        bddr = addr;
-        if(freeall) {
-            TRACE_DEBUG("I'd like to free this: %s", bddr->mailbox);
-            libsieve_free(bddr->mailbox);
-            TRACE_DEBUG("I'd like to free this: %s", bddr->domain);
-            libsieve_free(bddr->domain);
-            TRACE_DEBUG("I'd like to free this: %s", bddr->route);
-            libsieve_free(bddr->route);
-            TRACE_DEBUG("I'd like to free this: %s", bddr->name);
-            libsieve_free(bddr->name);
-        }
-        addr = bddr->next;
-        libsieve_free(bddr);
-    }
-}
-
-struct address *libsieve_addrstructcopy(struct sieve2_context *context)
-{
-    struct address *new;
-    struct address *tmp = context->addr_addr->next;
-    struct address *top;
-
-    if (!tmp) {
-        TRACE_DEBUG("No addresses found at all, returning NULL.");
-	return NULL;
-    }
-
-    top = libsieve_malloc(sizeof(struct address));
-
-    TRACE_DEBUG("I'd like to copy this pointer: %p: %s", tmp->mailbox, tmp->mailbox);
-    top->mailbox = tmp->mailbox;
-    TRACE_DEBUG("I'd like to copy this pointer: %p: %s", tmp->domain, tmp->domain);
-    top->domain = tmp->domain;
-    TRACE_DEBUG("I'd like to copy this pointer: %p: %s", tmp->route, tmp->route);
-    top->route = tmp->route;
-    TRACE_DEBUG("I'd like to copy this pointer: %p: %s", tmp->name, tmp->name);
-    top->name = tmp->name;
-    tmp = tmp->next;
-    new = top;
-    while (tmp != NULL) {
-        new->next = (struct address *)libsieve_malloc(sizeof(struct address));
-        if (new->next == NULL) {
-            TRACE_DEBUG("malloc failed, returning what we have so far.");
-	    return top;
-        } else {
-            new = new->next;
-	}
-        TRACE_DEBUG("I'd like to copy this pointer: %p: %s", tmp->mailbox, tmp->mailbox);
-        new->mailbox = tmp->mailbox;
-        TRACE_DEBUG("I'd like to copy this pointer: %p: %s", tmp->domain, tmp->domain);
-        new->domain = tmp->domain;
-        TRACE_DEBUG("I'd like to copy this pointer: %p: %s", tmp->route, tmp->route);
-        new->route = tmp->route;
-        TRACE_DEBUG("I'd like to copy this pointer: %p: %s", tmp->name, tmp->name);
-        new->name = tmp->name;
-        tmp = tmp->next;
-    }
-    new->next = NULL; /* Clear the last entry */
-
-    return top;
-}
-
 void libsieve_addrappend(struct sieve2_context *context)
 {
-    struct address *new = (struct address *)libsieve_malloc(sizeof(struct address));
+    struct address *new = (struct address *)libsieve_arena_alloc(&context->exec_arena, sizeof(struct address));
     TRACE_DEBUG( "Prepending a new addr struct" );
     new->mailbox = NULL;
     new->domain = NULL;
@@ -8,8 +8,4 @@
 int libsieve_addrparse(struct sieve2_context *context, void *yyscanner);
 void libsieve_addrerror(struct sieve2_context *context, void *yyscanner, const char *str);
 
-#define STRUCTONLY 0
-#define CHARSALSO 1
-void libsieve_addrstructfree(struct sieve2_context *context, struct address *addr, int freeall);
-
 #endif /* ADDRINC_H */
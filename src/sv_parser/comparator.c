@@ -30,9 +30,19 @@ OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #endif
 
 #include <stdlib.h>
+#include <limits.h>
 #include <ctype.h>
 #include <string.h>
 
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_CONTAINS
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_CONTAINS
+#endif
+#endif
+
 #include "comparator.h"
 #include "src/sv_interface/tree.h"
 #include "sieve.h"
@@ -41,6 +51,11 @@ OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define THIS_MODULE "sv_comparator"
 
+/* i;ascii-casemap folds a-z and nothing else, whatever the locale;
+ * everything which matches with it goes through this, so that no path
+ * folds a byte another one leaves alone. c is an unsigned char. */
+#define ASCII_UPPER(c) ((c) >= 'a' && (c) <= 'z' ? (c) - ('a' - 'A') : (c))
+
 /* --- i;octet comparators --- */
 
 /* just compare the two; these should be NULL terminated */
@@ -58,67 +73,7 @@ static int octet_contains(struct sieve2_context *context, const char *pat, const
     return (strstr(text, pat) != NULL);
 }
 
-static int octet_matches_(struct sieve2_context *context, const char *pat, const char *text, int casemap)
-{
-    const char *p;
-    const char *t;
-    char c;
-
-    t = text;
-    p = pat;
-    for (;;) {
-	if (*p == '\0') {
-	    /* ran out of pattern */
-	    return (*t == '\0');
-	}
-	c = *p++;
-	switch (c) {
-	case '?':
-	    if (*t == '\0') {
-		return 0;
-	    }
-	    t++;
-	    break;
-	case '*':
-	    while (*p == '*' || *p == '?') {
-		if (*p == '?') {
-		    /* eat the character now */
-		    if (*t == '\0') {
-			return 0;
-		    }
-		    t++;
-		}
-		/* coalesce into a single wildcard */
-		p++;
-	    }
-	    if (*p == '\0') {
-		/* wildcard at end of string, any remaining text is ok */
-		return 1;
-	    }
-
-	    while (*t != '\0') {
-		/* recurse */
-	        if (octet_matches_(context, p, t, casemap)) return 1;
-		t++;
-	    }
-	case '\\':
-	    p++;
-	    /* falls through */
-	default:
-	    if (casemap && (toupper((int)(unsigned char)c) ==
-			    toupper((int)(unsigned char)*t))) {
-		t++;
-	    } else if (!casemap && (c == *t)) {
-		t++;
-	    } else {
-		/* literal char doesn't match */
-		return 0;
-	    }
-	}
-    }
-    /* never reaches */
-    abort();
-}
+static int octet_matches_(struct sieve2_context *context, const char *pat, const char *text, int casemap);
 
 static int octet_matches(struct sieve2_context *context, const char *pat, const char *text)
 {
@@ -143,8 +98,8 @@ static int ascii_casemap_contains(struct sieve2_context *context, const char *pa
     i = 0;
     j = 0;
     while ((j < M) && (i < N)) {
-	if (toupper((int)(unsigned char)text[i]) ==
-	    toupper((int)(unsigned char)pat[j])) {
+	if (ASCII_UPPER((unsigned char)text[i]) ==
+	    ASCII_UPPER((unsigned char)pat[j])) {
 	    i++; j++;
 	} else {
 	    i = i - j + 1;
@@ -159,12 +114,447 @@ static int ascii_casemap_matches(struct sieve2_context *context, const char *pat
     return octet_matches_(context, pat, text, 1);
 }
 
+
+/* --- :matches --- */
+
+/* A :matches pattern is compiled to a list of items, one for each
+ * character of it: a byte to match, folded to upper case for
+ * i;ascii-casemap, or one of these. A run of stars is a single star. */
+#define GLOB_END  (-1)
+#define GLOB_ANY  (-2)      /* ? */
+#define GLOB_STAR (-3)      /* * */
+
+/* Bits in each word of a shift-and state. */
+#define GLOB_BITS (CHAR_BIT * sizeof(unsigned long))
+
+struct matches_set {
+    int casemap;
+    size_t n;
+    short *globs;           /* n lists, each ending in GLOB_END */
+    size_t *fail;           /* for each item, see static_glob_prepare */
+};
+
+/* g has room for strlen(pat) + 1 items. Returns how many were used. */
+static size_t static_glob_compile(const char *pat, short *g, int casemap)
+{
+    const unsigned char *p = (const unsigned char *)pat;
+    size_t n = 0;
+
+    for (; *p; p++) {
+        switch (*p) {
+        case '*':
+            if (n == 0 || g[n - 1] != GLOB_STAR)
+                g[n++] = GLOB_STAR;
+            continue;
+        case '?':
+            g[n++] = GLOB_ANY;
+            continue;
+        case '\\':
+            /* The next character is matched as it is. */
+            if (p[1] != '\0')
+                p++;
+            break;
+        }
+        g[n++] = (short)(casemap ? ASCII_UPPER(*p) : *p);
+    }
+    g[n++] = GLOB_END;
+
+    return n;
+}
+
+/* The pieces between the stars are looked for with Knuth-Morris-Pratt:
+ * for the item i of a piece, fail[i] is the length of the longest
+ * proper prefix of the piece which also ends at i. fail has as many
+ * entries as g has items. */
+static void static_glob_prepare(const short *g, size_t *fail)
+{
+    size_t i, k, m;
+
+    for (;;) {
+        for (m = 0; g[m] != GLOB_STAR && g[m] != GLOB_END; m++) ;
+
+        for (k = 0, i = 0; i < m; i++) {
+            while (k > 0 && g[i] != g[k])
+                k = fail[k - 1];
+            if (i > 0 && g[i] == g[k])
+                k++;
+            fail[i] = k;
+        }
+        fail[m] = 0;
+
+        if (g[m] == GLOB_END)
+            return;
+        g += m + 1;
+        fail += m + 1;
+    }
+}
+
+/* Does the piece g[0..m) match the text at t, which has at least m
+ * characters left? */
+static int static_glob_at(const short *g, size_t m, const unsigned char *t, int casemap)
+{
+    size_t i;
+
+    for (i = 0; i < m; i++) {
+        if (g[i] != GLOB_ANY && g[i] != (casemap ? ASCII_UPPER(t[i]) : t[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/* Where the piece g[0..m), which has no ? in it, first occurs in
+ * t[0..n), or NULL. */
+static const unsigned char *static_glob_find(const short *g, const size_t *fail,
+        size_t m, const unsigned char *t, size_t n, int casemap)
+{
+    size_t i, j = 0;
+    int c;
+
+    for (i = 0; i < n; i++) {
+        c = casemap ? ASCII_UPPER(t[i]) : t[i];
+        while (j > 0 && g[j] != c)
+            j = fail[j - 1];
+        if (g[j] == c && ++j == m)
+            return t + i + 1 - m;
+    }
+    return NULL;
+}
+
+/* The same for a piece with a ?, which KMP can't shift over: shift-and
+ * keeps one bit for each item of the piece which could end where the
+ * text has got to. That's a word of state up to GLOB_BITS items; a
+ * longer piece needs more, and returns NULL if they can't be had. */
+static const unsigned char *static_glob_find_any(const short *g,
+        size_t m, const unsigned char *t, size_t n, int casemap)
+{
+    unsigned long buf[256 + 2], *mask = buf, *any, *d, *row, carry, next;
+    size_t w = (m + GLOB_BITS - 1) / GLOB_BITS, i, k;
+    const unsigned char *res = NULL;
+
+    if (w > 1) {
+        mask = (unsigned long *)libsieve_malloc((256 + 2) * w * sizeof(unsigned long));
+        if (mask == NULL)
+            return NULL;
+    }
+    memset(mask, 0, (256 + 2) * w * sizeof(unsigned long));
+    any = mask + 256 * w;
+    d = any + w;
+
+    for (i = 0; i < m; i++) {
+        row = (g[i] == GLOB_ANY) ? any : mask + g[i] * w;
+        row[i / GLOB_BITS] |= 1UL << (i % GLOB_BITS);
+    }
+
+    for (i = 0; i < n; i++) {
+        row = mask + (casemap ? ASCII_UPPER(t[i]) : t[i]) * w;
+        for (carry = 1, k = 0; k < w; k++) {
+            next = d[k] >> (GLOB_BITS - 1);
+            d[k] = ((d[k] << 1) | carry) & (row[k] | any[k]);
+            carry = next;
+        }
+        if (d[(m - 1) / GLOB_BITS] & (1UL << ((m - 1) % GLOB_BITS))) {
+            res = t + i + 1 - m;
+            break;
+        }
+    }
+
+    if (mask != buf)
+        libsieve_free(mask);
+    return res;
+}
+
+/* The piece before the first star has to be at the start of the text
+ * and the one after the last star at its end. Each piece in between is
+ * taken where it first occurs after the one before it: if the pattern
+ * matches at all, it matches that way too, as a star can take whatever
+ * a later placing would have left over. Every search starts where the
+ * last one stopped, so no character of the text is looked at more than
+ * once, however many stars there are. */
+static int static_glob_match(const short *g, const size_t *fail, const char *text, int casemap)
+{
+    const unsigned char *t = (const unsigned char *)text, *at;
+    size_t n = strlen(text), m, i, last;
+    int any;
+
+    for (m = 0; g[m] != GLOB_STAR && g[m] != GLOB_END; m++) ;
+    if (g[m] == GLOB_END)
+        return (n == m && static_glob_at(g, m, t, casemap));
+    if (m > n || !static_glob_at(g, m, t, casemap))
+        return 0;
+    t += m;
+    n -= m;
+    g += m + 1;
+    fail += m + 1;
+
+    for (last = 0, i = 0; g[i] != GLOB_END; i++) {
+        if (g[i] == GLOB_STAR)
+            last = i + 1;
+    }
+    m = i - last;
+    if (m > n || !static_glob_at(g + last, m, t + n - m, casemap))
+        return 0;
+    n -= m;
+
+    for (i = 0; i < last; i += m + 1) {
+        for (any = 0, m = 0; g[i + m] != GLOB_STAR; m++)
+            any |= (g[i + m] == GLOB_ANY);
+
+        if (any)
+            at = static_glob_find_any(g + i, m, t, n, casemap);
+        else
+            at = static_glob_find(g + i, fail + i, m, t, n, casemap);
+        if (at == NULL)
+            return 0;
+
+        n -= (size_t)(at - t) + m;
+        t = at + m;
+    }
+
+    return 1;
+}
+
+/* For a pattern which hasn't been compiled ahead of time. */
+static int octet_matches_(struct sieve2_context *context, const char *pat, const char *text, int casemap)
+{
+    short buf[128], *g = buf;
+    size_t fbuf[128], *fail = fbuf;
+    size_t len = strlen(pat) + 1;
+    int res;
+
+    if (len > sizeof(buf) / sizeof(buf[0])) {
+        fail = (size_t *)libsieve_malloc(len * (sizeof(size_t) + sizeof(short)));
+        if (fail == NULL)
+            return 0;
+        g = (short *)(fail + len);
+    }
+
+    static_glob_compile(pat, g, casemap);
+    static_glob_prepare(g, fail);
+    res = static_glob_match(g, fail, text, casemap);
+
+    if (fail != fbuf)
+        libsieve_free(fail);
+    return res;
+}
+
+matches_set_t *libsieve_matches_compile(const char * const *pats, size_t n, int casemap)
+{
+    matches_set_t *set;
+    size_t i, len, k;
+    short *g;
+
+    for (len = 0, i = 0; i < n; i++)
+        len += strlen(pats[i]) + 1;
+
+    set = (matches_set_t *)libsieve_malloc(sizeof(matches_set_t));
+    if (set == NULL)
+        return NULL;
+    set->casemap = casemap;
+    set->n = n;
+    set->globs = (short *)libsieve_malloc(len * sizeof(short));
+    set->fail = (size_t *)libsieve_malloc(len * sizeof(size_t));
+    if (set->globs == NULL || set->fail == NULL) {
+        libsieve_free(set->globs);
+        libsieve_free(set->fail);
+        libsieve_free(set);
+        return NULL;
+    }
+
+    for (g = set->globs, i = 0; i < n; i++, g += k) {
+        k = static_glob_compile(pats[i], g, casemap);
+        static_glob_prepare(g, set->fail + (g - set->globs));
+    }
+
+    return set;
+}
+
+void libsieve_matches_free(matches_set_t *set)
+{
+    if (set == NULL)
+        return;
+    libsieve_free(set->globs);
+    libsieve_free(set->fail);
+    libsieve_free(set);
+}
+
+int libsieve_matches_match(struct sieve2_context *context, const char *pat, const char *text)
+{
+    const matches_set_t *set = (const matches_set_t *)pat;
+    const short *g = set->globs;
+    const size_t *fail = set->fail;
+    size_t i, k;
+
+    for (i = 0; i < set->n; i++, g += k, fail += k) {
+        if (static_glob_match(g, fail, text, set->casemap))
+            return 1;
+        for (k = 1; g[k - 1] != GLOB_END; k++) ;
+    }
+
+    return 0;
+}
+
+
+/* --- :contains with many patterns --- */
+
+/* Spam keyword lists run to hundreds of patterns, and trying each
+ * one in turn goes over every header that many times. Instead, the
+ * patterns are made into one Aho-Corasick automaton, which finds
+ * whether any of them is in the text in a single pass over it.
+ *
+ * The automaton is a table of transitions, one row per state. Bytes
+ * which appear in no pattern all behave alike, so bytes are first
+ * mapped to a class, which keeps the rows short. For i;ascii-casemap,
+ * a letter is mapped to the same class in either case. */
+struct contains_set {
+    int nclass;
+    unsigned char class[256];
+    int *next;              /* [state * nclass + class] */
+    unsigned char *out;     /* does some pattern end at this state? */
+};
+
+/* Past this many cells in the table, the patterns are tried one by one. */
+#define CONTAINS_MAX_CELLS (1 << 20)
+
+contains_set_t *libsieve_contains_compile(const char * const *pats, size_t n, int casemap)
+{
+    contains_set_t *set;
+    size_t i, len, states, used, head, tail;
+    const unsigned char *p;
+    int *queue = NULL, *fail = NULL;
+    int s, t, k, c;
+
+    set = (contains_set_t *)libsieve_malloc(sizeof(contains_set_t));
+    if (set == NULL)
+        return NULL;
+    memset(set, 0, sizeof(contains_set_t));
+
+    /* Class 0 is for bytes in no pattern. */
+    set->nclass = 1;
+    for (len = 0, i = 0; i < n; i++) {
+        for (p = (const unsigned char *)pats[i]; *p; p++, len++) {
+            c = casemap ? ASCII_UPPER(*p) : *p;
+            if (set->class[c] == 0)
+                set->class[c] = set->nclass++;
+        }
+    }
+    if (casemap) {
+        for (c = 0; c < 256; c++)
+            set->class[c] = set->class[ASCII_UPPER(c)];
+    }
+
+    states = len + 1;
+    if (states > CONTAINS_MAX_CELLS / set->nclass)
+        goto fail;
+
+    set->next = (int *)libsieve_malloc(states * set->nclass * sizeof(int));
+    set->out = (unsigned char *)libsieve_malloc(states);
+    fail = (int *)libsieve_malloc(states * sizeof(int));
+    queue = (int *)libsieve_malloc(states * sizeof(int));
+    if (set->next == NULL || set->out == NULL || fail == NULL || queue == NULL)
+        goto fail;
+    memset(set->next, 0, states * set->nclass * sizeof(int));
+    memset(set->out, 0, states);
+
+    /* First the trie of the patterns; no edge of it goes back to the
+     * root, state 0, so a 0 in the table is an edge not there yet. */
+    for (used = 1, i = 0; i < n; i++) {
+        for (s = 0, p = (const unsigned char *)pats[i]; *p; p++) {
+            k = set->class[*p];
+            if (set->next[s * set->nclass + k] == 0)
+                set->next[s * set->nclass + k] = used++;
+            s = set->next[s * set->nclass + k];
+        }
+        set->out[s] = 1;
+    }
+
+    /* Then, breadth first, each missing edge goes wherever the longest
+     * suffix which is also in the trie would go. */
+    head = tail = 0;
+    for (k = 0; k < set->nclass; k++) {
+        if ((t = set->next[k]) != 0) {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        s = queue[head++];
+        set->out[s] |= set->out[fail[s]];
+        for (k = 0; k < set->nclass; k++) {
+            t = set->next[s * set->nclass + k];
+            if (t != 0) {
+                fail[t] = set->next[fail[s] * set->nclass + k];
+                queue[tail++] = t;
+            } else {
+                set->next[s * set->nclass + k] = set->next[fail[s] * set->nclass + k];
+            }
+        }
+    }
+
+    libsieve_free(fail);
+    libsieve_free(queue);
+    return set;
+
+fail:
+    libsieve_free(fail);
+    libsieve_free(queue);
+    libsieve_contains_free(set);
+    return NULL;
+}
+
+void libsieve_contains_free(contains_set_t *set)
+{
+    if (set == NULL)
+        return;
+    libsieve_free(set->next);
+    libsieve_free(set->out);
+    libsieve_free(set);
+}
+
+int libsieve_contains_match(struct sieve2_context *context, const char *pat, const char *text)
+{
+    const contains_set_t *set = (const contains_set_t *)pat;
+    const unsigned char *t = (const unsigned char *)text;
+    int s = 0;
+
+    /* An empty pattern is in any text. */
+    if (set->out[0])
+        return 1;
+
+    for (; *t; t++) {
+        s = set->next[s * set->nclass + set->class[*t]];
+        if (set->out[s])
+            return 1;
+    }
+
+    return 0;
+}
+
 static int ascii_numeric_unknown(struct sieve2_context *context, const char *pat, const char *text)
 {
     TRACE_DEBUG("Unknown numeric comparison requested");
     return 0;
 }
 
+static int static_numeric(enum num num, int pat, int text)
+{
+    switch (num) {
+    case gt:
+        return pat <  text;
+    case ge:
+        return pat <= text;
+    case lt:
+        return pat >  text;
+    case le:
+        return pat >= text;
+    case eq:
+        return pat == text;
+    case ne:
+        return pat != text;
+    default:
+        return 0;
+    }
+}
+
 /* i;ascii-numeric
  * Note that the inequalities are backwards.
  * This is because pat is the RHS and text is the LHS.
@@ -175,22 +565,7 @@ static int ascii_numeric(struct sieve2_context *context, enum num num, const cha
     if (isdigit((int)(unsigned char)*pat)) {
 	if (isdigit((int)(unsigned char)*text)) {
             TRACE_DEBUG("Testing [%d] [%d] [%d]", atoi(pat), num, atoi(text));
-	    switch (num) {
-	    case gt:
-	        return atoi(pat) <  atoi(text);
-	    case ge:
-	        return atoi(pat) <= atoi(text);
-	    case lt:
-	        return atoi(pat) >  atoi(text);
-	    case le:
-	        return atoi(pat) >= atoi(text);
-	    case eq:
-	        return atoi(pat) == atoi(text);
-	    case ne:
-	        return atoi(pat) != atoi(text);
-            default:
-	        return 0;
-            }
+	    return static_numeric(num, atoi(pat), atoi(text));
 	} else {
 	    return 0;
 	}
@@ -278,12 +653,28 @@ int libsieve_relational_lookup(const char *rel)
     }
 }
 
+VISIBLE int libsieve_comparator_id(const char *comp)
+{
+    if (!strcmp(comp, "i;octet"))
+	return COMPARATOR_OCTET;
+    if (!strcmp(comp, "i;ascii-casemap"))
+	return COMPARATOR_ASCII_CASEMAP;
+    if (!strcmp(comp, "i;ascii-numeric"))
+	return COMPARATOR_ASCII_NUMERIC;
+    return 0;
+}
+
 VISIBLE comparator_t *libsieve_comparator_lookup(struct sieve2_context *context, const char *comp, int mode)
+{
+    return libsieve_comparator_byid(context, libsieve_comparator_id(comp), mode);
+}
+
+comparator_t *libsieve_comparator_byid(struct sieve2_context *context, int id, int mode)
 {
     comparator_t *ret;
 
     ret = NULL;
-    if (!strcmp(comp, "i;octet")) {
+    if (id == COMPARATOR_OCTET) {
 	switch (mode) {
 	case IS:
 	    ret = &octet_is;
@@ -298,7 +689,7 @@ VISIBLE comparator_t *libsieve_comparator_lookup(struct sieve2_context *context,
 	    ret = &octet_regex;
 	    break;
 	}
-    } else if (!strcmp(comp, "i;ascii-casemap")) {
+    } else if (id == COMPARATOR_ASCII_CASEMAP) {
 	switch (mode) {
 	case IS:
 	    ret = &ascii_casemap_eq;
@@ -344,7 +735,7 @@ VISIBLE comparator_t *libsieve_comparator_lookup(struct sieve2_context *context,
 	    	ret = &ascii_casemap_unknown;
 	    }
 	}
-    } else if (!strcmp(comp, "i;ascii-numeric")) {
+    } else if (id == COMPARATOR_ASCII_NUMERIC) {
 	switch (mode) {
 	case IS:
 	    ret = &ascii_numeric_eq;
@@ -395,3 +786,346 @@ int libsieve_relational_count(struct sieve2_context *context, int mode)
     }
     return 0;
 }
+
+
+/* --- patterns made ready ahead of time --- */
+
+/* An i;octet or i;ascii-casemap pattern with its length, and for
+ * i;ascii-casemap, already in upper case. */
+struct prepared_string {
+    size_t len;
+    unsigned char s[1];
+};
+
+/* A :contains pattern, with a table of how far it may be moved along
+ * the text past each byte (Boyer-Moore-Horspool). */
+struct prepared_needle {
+    size_t len;
+    size_t skip[256];
+    unsigned char s[1];
+};
+
+/* An i;ascii-numeric pattern, already read. */
+struct prepared_number {
+    enum num num;
+    int digit;
+    int value;
+};
+
+static void *static_prepare_string(const char *pat, int casemap)
+{
+    struct prepared_string *p;
+    size_t i, len = strlen(pat);
+
+    p = (struct prepared_string *)libsieve_malloc(sizeof(struct prepared_string) + len);
+    if (p == NULL)
+        return NULL;
+    p->len = len;
+    for (i = 0; i <= len; i++)
+        p->s[i] = casemap ? ASCII_UPPER((unsigned char)pat[i]) : pat[i];
+
+    return p;
+}
+
+static void *static_prepare_needle(const char *pat, int casemap)
+{
+    struct prepared_needle *p;
+    size_t i, len = strlen(pat);
+    int c;
+
+    p = (struct prepared_needle *)libsieve_malloc(sizeof(struct prepared_needle) + len);
+    if (p == NULL)
+        return NULL;
+    p->len = len;
+    for (i = 0; i <= len; i++)
+        p->s[i] = casemap ? ASCII_UPPER((unsigned char)pat[i]) : pat[i];
+
+    for (c = 0; c < 256; c++)
+        p->skip[c] = len;
+    for (i = 0; i + 1 < len; i++)
+        p->skip[p->s[i]] = len - 1 - i;
+    /* A letter moves the pattern as far in either case. */
+    if (casemap) {
+        for (c = 0; c < 256; c++)
+            p->skip[c] = p->skip[ASCII_UPPER(c)];
+    }
+
+    return p;
+}
+
+static void *static_prepare_number(const char *pat, int num)
+{
+    struct prepared_number *p;
+
+    p = (struct prepared_number *)libsieve_malloc(sizeof(struct prepared_number));
+    if (p == NULL)
+        return NULL;
+    p->num = (enum num)num;
+    p->digit = isdigit((int)(unsigned char)*pat) ? 1 : 0;
+    p->value = p->digit ? atoi(pat) : 0;
+
+    return p;
+}
+
+static int octet_is_prepared(struct sieve2_context *context, const char *pat, const char *text)
+{
+    const struct prepared_string *p = (const struct prepared_string *)pat;
+
+    /* This stops at the end of a shorter text, which won't match. */
+    return (strncmp((const char *)p->s, text, p->len) == 0 && text[p->len] == '\0');
+}
+
+static int ascii_casemap_is_prepared(struct sieve2_context *context, const char *pat, const char *text)
+{
+    const struct prepared_string *p = (const struct prepared_string *)pat;
+    const unsigned char *t = (const unsigned char *)text;
+    size_t i;
+
+    for (i = 0; i < p->len; i++) {
+        if (ASCII_UPPER(t[i]) != p->s[i])
+            return 0;
+    }
+
+    return (t[p->len] == '\0');
+}
+
+/* Looks for the needle at each place from start on. */
+static int static_needle_match(const struct prepared_needle *p, const unsigned char *t,
+        size_t n, size_t start, int casemap)
+{
+    size_t i, j;
+    int c;
+
+    for (i = start; i + p->len <= n; i += p->skip[t[i + p->len - 1]]) {
+        for (j = p->len; j > 0; j--) {
+            c = casemap ? ASCII_UPPER(t[i + j - 1]) : t[i + j - 1];
+            if (c != p->s[j - 1])
+                break;
+        }
+        if (j == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* i;ascii-casemap :contains is what a plain :contains is, so it is run
+ * more than any other comparator. With SSE2 or AVX2, the first and the
+ * last byte of the needle are looked for at 16 or 32 places at once,
+ * with the text folded to upper case as it's loaded, and only where
+ * both are there is the rest of it compared. Each of these leaves off
+ * where a whole block no longer fits, and says where that is, so the
+ * rest is done above. */
+#ifdef HAVE_SSE2_CONTAINS
+static int static_needle_verify(const struct prepared_needle *p, const unsigned char *t)
+{
+    size_t j;
+
+    for (j = 1; j + 1 < p->len; j++) {
+        if (ASCII_UPPER(t[j]) != p->s[j])
+            return 0;
+    }
+    return 1;
+}
+
+/* Letters to upper case; bytes past 127 compare as negative, so they
+ * are left alone, as is everything else. */
+static __m128i static_fold_sse2(__m128i x)
+{
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(x, _mm_set1_epi8('z' + 1)));
+    return _mm_sub_epi8(x, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+}
+
+static int static_casemap_sse2(const struct prepared_needle *p, const unsigned char *t,
+        size_t n, size_t *done)
+{
+    const __m128i first = _mm_set1_epi8((char)p->s[0]);
+    const __m128i last = _mm_set1_epi8((char)p->s[p->len - 1]);
+    unsigned int mask;
+    size_t i;
+
+    for (i = 0; i + p->len + 15 <= n; i += 16) {
+        __m128i a = static_fold_sse2(_mm_loadu_si128((const __m128i *)(t + i)));
+        __m128i b = static_fold_sse2(_mm_loadu_si128((const __m128i *)(t + i + p->len - 1)));
+        mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                             _mm_cmpeq_epi8(b, last)));
+        for (; mask != 0; mask &= mask - 1) {
+            if (static_needle_verify(p, t + i + __builtin_ctz(mask)))
+                return 1;
+        }
+    }
+
+    *done = i;
+    return 0;
+}
+#endif /* HAVE_SSE2_CONTAINS */
+
+#ifdef HAVE_AVX2_CONTAINS
+__attribute__((target("avx2")))
+static __m256i static_fold_avx2(__m256i x)
+{
+    __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), x));
+    return _mm256_sub_epi8(x, _mm256_and_si256(lower, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static int static_casemap_avx2(const struct prepared_needle *p, const unsigned char *t,
+        size_t n, size_t *done)
+{
+    const __m256i first = _mm256_set1_epi8((char)p->s[0]);
+    const __m256i last = _mm256_set1_epi8((char)p->s[p->len - 1]);
+    unsigned int mask;
+    size_t i;
+
+    for (i = 0; i + p->len + 31 <= n; i += 32) {
+        __m256i a = static_fold_avx2(_mm256_loadu_si256((const __m256i *)(t + i)));
+        __m256i b = static_fold_avx2(_mm256_loadu_si256((const __m256i *)(t + i + p->len - 1)));
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                                   _mm256_cmpeq_epi8(b, last)));
+        for (; mask != 0; mask &= mask - 1) {
+            if (static_needle_verify(p, t + i + __builtin_ctz(mask)))
+                return 1;
+        }
+    }
+
+    *done = i;
+    return 0;
+}
+#endif /* HAVE_AVX2_CONTAINS */
+
+static int octet_contains_prepared(struct sieve2_context *context, const char *pat, const char *text)
+{
+    const struct prepared_needle *p = (const struct prepared_needle *)pat;
+
+    if (p->len == 0)
+        return 1;
+    return static_needle_match(p, (const unsigned char *)text, strlen(text), 0, 0);
+}
+
+static int ascii_casemap_contains_prepared(struct sieve2_context *context, const char *pat, const char *text)
+{
+    const struct prepared_needle *p = (const struct prepared_needle *)pat;
+    const unsigned char *t = (const unsigned char *)text;
+    size_t n, done = 0;
+
+    if (p->len == 0)
+        return 1;
+    n = strlen(text);
+
+#ifdef HAVE_AVX2_CONTAINS
+    if (__builtin_cpu_supports("avx2")) {
+        if (static_casemap_avx2(p, t, n, &done))
+            return 1;
+    } else
+#endif
+#ifdef HAVE_SSE2_CONTAINS
+    if (static_casemap_sse2(p, t, n, &done))
+        return 1;
+#endif
+
+    return static_needle_match(p, t, n, done, 1);
+}
+
+static int ascii_numeric_prepared(struct sieve2_context *context, const char *pat, const char *text)
+{
+    const struct prepared_number *p = (const struct prepared_number *)pat;
+
+    if (!isdigit((int)(unsigned char)*text))
+        return !p->digit;
+    if (!p->digit)
+        return 0;
+    return static_numeric(p->num, p->value, atoi(text));
+}
+
+static void static_free_contains(void *set)
+{
+    libsieve_contains_free((contains_set_t *)set);
+}
+
+static void static_free_matches(void *set)
+{
+    libsieve_matches_free((matches_set_t *)set);
+}
+
+/* Past this many :contains patterns, they are made into one automaton. */
+#define CONTAINS_SET_MIN 4
+
+VISIBLE comparator_patterns_t *libsieve_comparator_compile(int id, int mode,
+        const char * const *pats, size_t n)
+{
+    comparator_patterns_t *cp;
+    void *(*prepare)(const char *, int) = NULL;
+    int arg = 0;
+    size_t i;
+
+    cp = (comparator_patterns_t *)libsieve_malloc(sizeof(comparator_patterns_t)
+            + n * sizeof(void *));
+    if (cp == NULL)
+        return NULL;
+    memset(cp, 0, sizeof(comparator_patterns_t) + n * sizeof(void *));
+    cp->pats = (void **)(cp + 1);
+    cp->free = &libsieve_free;
+
+    if (id == COMPARATOR_OCTET || id == COMPARATOR_ASCII_CASEMAP) {
+        arg = (id == COMPARATOR_ASCII_CASEMAP);
+        switch (mode) {
+        case IS:
+            prepare = &static_prepare_string;
+            cp->match = arg ? &ascii_casemap_is_prepared : &octet_is_prepared;
+            break;
+        case CONTAINS:
+            /* Many patterns are all looked for at once. */
+            if (n >= CONTAINS_SET_MIN
+             && (cp->pats[0] = libsieve_contains_compile(pats, n, arg)) != NULL) {
+                cp->match = &libsieve_contains_match;
+                cp->free = &static_free_contains;
+                cp->n = 1;
+                return cp;
+            }
+            prepare = &static_prepare_needle;
+            cp->match = arg ? &ascii_casemap_contains_prepared : &octet_contains_prepared;
+            break;
+        case MATCHES:
+            if ((cp->pats[0] = libsieve_matches_compile(pats, n, arg)) == NULL)
+                break;
+            cp->match = &libsieve_matches_match;
+            cp->free = &static_free_matches;
+            cp->n = 1;
+            return cp;
+        }
+    } else if (id == COMPARATOR_ASCII_NUMERIC) {
+        arg = (mode == IS ? eq : (mode >> 10));
+        if (arg >= gt && arg <= ne) {
+            prepare = &static_prepare_number;
+            cp->match = &ascii_numeric_prepared;
+        }
+    }
+
+    if (prepare == NULL) {
+        libsieve_free(cp);
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        if ((cp->pats[i] = prepare(pats[i], arg)) == NULL) {
+            libsieve_comparator_free(cp);
+            return NULL;
+        }
+        cp->n++;
+    }
+
+    return cp;
+}
+
+VISIBLE void libsieve_comparator_free(comparator_patterns_t *cp)
+{
+    size_t i;
+
+    if (cp == NULL)
+        return;
+    for (i = 0; i < cp->n; i++)
+        cp->free(cp->pats[i]);
+    libsieve_free(cp);
+}
@@ -37,6 +37,18 @@ typedef int comparator_t(struct sieve2_context *context, const char *, const cha
 /* returns a pointer to a comparator function given it's name */
 comparator_t *libsieve_comparator_lookup(struct sieve2_context *context, const char *comp, int mode);
 
+/* compiled scripts can't hold function pointers,
+   so they refer to the comparators by number */
+enum comparator_id {
+    COMPARATOR_OCTET = 1,
+    COMPARATOR_ASCII_CASEMAP,
+    COMPARATOR_ASCII_NUMERIC
+};
+
+/* returns the number of a comparator given it's name, or 0 */
+int libsieve_comparator_id(const char *comp);
+comparator_t *libsieve_comparator_byid(struct sieve2_context *context, int id, int mode);
+
 enum num {
     gt = 1, // >
     ge    , // >=
@@ -46,6 +58,36 @@ enum num {
     ne      // !=
 };
 
+/* :contains with a list of patterns, matched all at once; the set is
+   passed to libsieve_contains_match in place of a pattern, as a regex
+   is passed to its comparator */
+typedef struct contains_set contains_set_t;
+contains_set_t *libsieve_contains_compile(const char * const *pats, size_t n, int casemap);
+void libsieve_contains_free(contains_set_t *set);
+int libsieve_contains_match(struct sieve2_context *context, const char *set, const char *text);
+
+/* :matches, with each pattern compiled once and matched without
+   backtracking; passed in place of a pattern like a contains_set_t */
+typedef struct matches_set matches_set_t;
+matches_set_t *libsieve_matches_compile(const char * const *pats, size_t n, int casemap);
+void libsieve_matches_free(matches_set_t *set);
+int libsieve_matches_match(struct sieve2_context *context, const char *set, const char *text);
+
+/* patterns made ready for a comparator ahead of time; match takes
+   each of pats in place of a pattern. There may be fewer of them
+   than there were patterns, when they have been combined into one. */
+typedef struct comparator_patterns {
+    comparator_t *match;
+    void (*free)(void *);
+    size_t n;
+    void **pats;
+} comparator_patterns_t;
+
+/* returns NULL if the comparator has nothing to do ahead of time */
+comparator_patterns_t *libsieve_comparator_compile(int id, int mode,
+        const char * const *pats, size_t n);
+void libsieve_comparator_free(comparator_patterns_t *cp);
+
 /* returns a magic number of the relational comparator. */
 int libsieve_relational_lookup(const char *rel);
 int libsieve_relational_count(struct sieve2_context *context, int mode);
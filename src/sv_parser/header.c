@@ -0,0 +1,178 @@
+/* header.c -- RFC 2/822 Header Scanner
+ * $Id$
+ */
+/* * * *
+ * Licensed under the GNU Lesser General Public License (LGPL)
+ * version 2.1, and other versions at the author's discretion.
+ * * * */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+/* sv_util */
+#include "src/sv_util/util.h"
+/* sv_interface */
+#include "src/sv_interface/callbacks2.h"
+/* sv_parser */
+#include "parser.h"
+/* sv_include */
+#include "src/sv_include/sieve2_error.h"
+
+#define THIS_MODULE "sv_parser"
+
+/* One pass over the buffer, in place. Each header becomes a name and
+ * a body pointing into the buffer itself; the body runs across any
+ * folded lines and is unfolded later, if a script ever asks for it.
+ * The list of headers is kept from one message to the next, so a
+ * context that has seen a message as long as this one doesn't
+ * allocate anything here at all. */
+
+#define HEADERLISTSIZE 64
+
+#define IS_EOL(ch) ((ch) == '\r' || (ch) == '\n')
+#define IS_WSP(ch) ((ch) == ' ' || (ch) == '\t')
+
+/* Steps over one line ending, counting it. CRLF, LF and a
+ * lone CR all end a line, as they did for the old lexer. */
+static const char *static_eol(const char *p, int *lineno)
+{
+    if (*p == '\r' && p[1] == '\n')
+        p += 2;
+    else if (IS_EOL(*p))
+        p++;
+    (*lineno)++;
+    return p;
+}
+
+/* Finds the end of the line at p. */
+static const char *static_eoline(const char *p)
+{
+    while (*p && !IS_EOL(*p))
+        p++;
+    return p;
+}
+
+static int static_append(sieve2_message_t *m, const char *name, size_t namelen,
+        const char *body, size_t bodylen)
+{
+    header_t *h;
+
+    if (m->count == m->space) {
+        int space = m->space ? m->space * 2 : HEADERLISTSIZE;
+        header_t *tmp = (header_t *)libsieve_realloc(m->list, sizeof(header_t) * space);
+        if (tmp == NULL)
+            return SIEVE2_ERROR_NOMEM;
+        m->list = tmp;
+        m->space = space;
+    }
+
+    h = &m->list[m->count++];
+    h->name = name;
+    h->namelen = namelen;
+    h->body = body;
+    h->bodylen = bodylen;
+    h->next = -1;
+    h->contents = NULL;
+
+    return SIEVE2_OK;
+}
+
+static int static_error(struct sieve2_context *context, int lineno, const char *msg)
+{
+    TRACE_DEBUG( "Header parse error on line %d: %s", lineno, msg );
+    libsieve_do_error_header(context, lineno, msg);
+    return SIEVE2_ERROR_HEADER;
+}
+
+/* Fills m->list from m->header, stopping at the end of the
+ * buffer or at the blank line that ends the header. */
+int libsieve_header_parse_buffer(struct sieve2_context *context, sieve2_message_t *m)
+{
+    const char *p = m->header;
+    const char *name, *body, *end;
+    size_t namelen;
+    int lineno = 1;
+    int res;
+
+    m->count = 0;
+
+    if (p == NULL)
+        return SIEVE2_ERROR_HEADER;
+
+    while (*p && !IS_EOL(*p)) {
+        if (IS_WSP(*p))
+            return static_error(context, lineno, "folded line without a header to continue");
+
+        /* Field names are anything up to the colon. */
+        name = p;
+        while (*p && *p != ':' && !IS_EOL(*p))
+            p++;
+        if (*p != ':')
+            return static_error(context, lineno, "header line without a colon");
+        namelen = p - name;
+        while (namelen && IS_WSP(name[namelen - 1]))
+            namelen--;
+        if (namelen == 0)
+            return static_error(context, lineno, "header without a name");
+        p++;
+
+        /* Whitespace after the colon isn't part of the body, nor is
+         * a fold right after it, if the body starts on the next line. */
+        for (;;) {
+            while (IS_WSP(*p))
+                p++;
+            if (IS_EOL(*p)) {
+                int next = lineno;
+                const char *q = static_eol(p, &next);
+                if (IS_WSP(*q)) {
+                    p = q;
+                    lineno = next;
+                    continue;
+                }
+            }
+            break;
+        }
+
+        /* The body runs on through each line starting with whitespace. */
+        body = p;
+        end = static_eoline(p);
+        while (*end) {
+            p = static_eol(end, &lineno);
+            if (!IS_WSP(*p))
+                break;
+            end = static_eoline(p);
+        }
+        if (!*end)
+            p = end;
+
+        TRACE_DEBUG( "header: %.*s: %.*s", (int)namelen, name, (int)(end - body), body );
+        if ((res = static_append(m, name, namelen, body, end - body)) != SIEVE2_OK)
+            return res;
+    }
+
+    return SIEVE2_OK;
+}
+
+/* Copies the body of h without its folds: each line ending
+ * goes, and the whitespace that follows it stays. */
+char *libsieve_header_unfold(struct arena *a, const header_t *h)
+{
+    char *str, *s;
+    size_t i;
+
+    str = s = (char *)libsieve_arena_alloc(a, h->bodylen + 1);
+    if (str == NULL)
+        return NULL;
+
+    for (i = 0; i < h->bodylen; i++) {
+        if (!IS_EOL(h->body[i]))
+            *s++ = h->body[i];
+    }
+    *s = '\0';
+
+    return str;
+}
@@ -12,7 +12,7 @@ struct address {
 
 struct addr_marker {
     struct address *where;
-    char *freeme;
+    struct arena *arena;    /* where the addresses are kept */
 };
 
 /* SIEVE */
@@ -27,8 +27,7 @@ commandlist_t *libsieve_sieve_parse_buffer(struct sieve2_context *context);
 int libsieve_sievelex_destroy(void *yyscanner);
 int libsieve_sievelex_init(void **yyscanner);
 
-header_list_t *libsieve_header_parse_buffer(struct sieve2_context *context, char **ptr);
-int libsieve_headerlex_destroy(void* yyscanner);
-int libsieve_headerlex_init(void** yyscanner);
+int libsieve_header_parse_buffer(struct sieve2_context *context, sieve2_message_t *m);
+char *libsieve_header_unfold(struct arena *a, const header_t *h);
 
 #endif /* PARSER_H */
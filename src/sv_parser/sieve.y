@@ -47,6 +47,8 @@ OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 /* sv_util */
 #include "src/sv_util/util.h"
+#define YYMALLOC libsieve_malloc
+#define YYFREE libsieve_free
 #include "sieve.h"
 #include "sieve-lex.h"
 #define THIS_MODULE "sv_parser"
@@ -115,6 +117,8 @@ static int static_verify_flag(struct sieve2_context *context, const char *s);
 static regex_t *static_verify_regex(struct sieve2_context *context, const char *s, int cflags);
 static patternlist_t *static_verify_regexs(struct sieve2_context *context, stringlist_t *sl, char *comp);
 static int static_ok_header(char *s);
+static int static_verify_depth(struct sieve2_context *context, int depth);
+static int static_testlist_depth(testlist_t *tl);
 
 static int static_check_reqs(struct sieve2_context *context, char *req);
 
@@ -221,12 +225,18 @@ commands: command		{ $$ = $1; }
 	;
 
 command: action ';'		{ $$ = $1; }
-	| IF test block elsif   { $$ = libsieve_new_if($2, $3, $4); }
+	| IF test block elsif   { $$ = libsieve_new_if($2, $3, $4);
+				  if (!static_verify_depth(context, $$->depth)) {
+				    YYERROR; /* vd should call sieveerror() */
+				  } }
 	| error ';'		{ $$ = libsieve_new_command(STOP); }
 	;
 
 elsif: /* empty */               { $$ = NULL; }
-	| ELSIF test block elsif { $$ = libsieve_new_if($2, $3, $4); }
+	| ELSIF test block elsif { $$ = libsieve_new_if($2, $3, $4);
+				  if (!static_verify_depth(context, $$->depth)) {
+				    YYERROR; /* vd should call sieveerror() */
+				  } }
 	| ELSE block             { $$ = $2; }
 	;
 
@@ -411,8 +421,16 @@ block: '{' commands '}'		 { $$ = $2; }
 	| '{' '}'		 { $$ = NULL; }
 	;
 
-test: ANYOF testlist		 { $$ = libsieve_new_test(ANYOF); $$->u.tl = $2; }
-	| ALLOF testlist	 { $$ = libsieve_new_test(ALLOF); $$->u.tl = $2; }
+test: ANYOF testlist		 { $$ = libsieve_new_test(ANYOF); $$->u.tl = $2;
+				   $$->depth = static_testlist_depth($2);
+				   if (!static_verify_depth(context, $$->depth)) {
+				     YYERROR; /* vd should call sieveerror() */
+				   } }
+	| ALLOF testlist	 { $$ = libsieve_new_test(ALLOF); $$->u.tl = $2;
+				   $$->depth = static_testlist_depth($2);
+				   if (!static_verify_depth(context, $$->depth)) {
+				     YYERROR; /* vd should call sieveerror() */
+				   } }
 	| EXISTS stringlist      { $$ = libsieve_new_test(EXISTS); $$->u.sl = $2; }
 	| SFALSE		 { $$ = libsieve_new_test(SFALSE); }
 	| STRUE			 { $$ = libsieve_new_test(STRUE); }
@@ -464,7 +482,11 @@ test: ANYOF testlist		 { $$ = libsieve_new_test(ANYOF); $$->u.tl = $2; }
 				       
 				   $$ = static_build_address(context, $1, $2, $3, pl);
 				   if ($$ == NULL) { YYERROR; } }
-	| NOT test		 { $$ = libsieve_new_test(NOT); $$->u.t = $2; }
+	| NOT test		 { $$ = libsieve_new_test(NOT); $$->u.t = $2;
+				   $$->depth = 1 + ($2 ? $2->depth : 0);
+				   if (!static_verify_depth(context, $$->depth)) {
+				     YYERROR; /* vd should call sieveerror() */
+				   } }
 	| SIZE sizetag NUMBER    { $$ = libsieve_new_test(SIZE); $$->u.sz.t = $2;
 		                   $$->u.sz.n = $3; }
 	| error			 { $$ = NULL; }
@@ -576,6 +598,7 @@ static test_t *static_build_address(struct sieve2_context *context, int t,
     if (ret) {
 	ret->u.ae.comptag = ae->comptag;
 	ret->u.ae.comp = libsieve_comparator_lookup(context, ae->comparator, ae->comptag);
+	ret->u.ae.compid = libsieve_comparator_id(ae->comparator);
 	ret->u.ae.sl = sl;
 	ret->u.ae.pl = pl;
 	ret->u.ae.addrpart = ae->addrtag;
@@ -597,6 +620,7 @@ static test_t *static_build_header(struct sieve2_context *context, int t, struct
     if (ret) {
 	ret->u.h.comptag = h->comptag;
 	ret->u.h.comp = libsieve_comparator_lookup(context, h->comparator, h->comptag);
+	ret->u.h.compid = libsieve_comparator_id(h->comparator);
 	ret->u.h.sl = sl;
 	ret->u.h.pl = pl;
 	static_free_htags(h);
@@ -623,6 +647,24 @@ static commandlist_t *static_build_vacation(struct sieve2_context *context, int
 	ret->u.v.addresses = v->addresses; v->addresses = NULL;
 	static_free_vtags(v);
 	ret->u.v.message = reason;
+
+	/* Without a :handle, calculate one from subject, from, mime and
+	 * reason, RFC 5230, Section 4.2. This is done here rather than
+	 * in libsieve_eval so that the tree isn't written to at runtime. */
+	if (ret->u.v.handle == NULL) {
+	    int j = 0;
+	    if (ret->u.v.subject) j += strlen(ret->u.v.subject);
+	    if (ret->u.v.from) j += strlen(ret->u.v.from);
+	    /* Add 3 for the separators between the items, 11 for
+	     * the mime value and one for the terminating '\0' */
+	    j += strlen(ret->u.v.message) + 15;
+	    ret->u.v.handle = libsieve_malloc(j);
+	    sprintf(ret->u.v.handle, "%s:%s:%s:%i",
+		ret->u.v.subject ? ret->u.v.subject : "",
+		ret->u.v.from ? ret->u.v.from : "",
+		ret->u.v.message,
+		ret->u.v.mime);
+	}
     }
     return ret;
 }
@@ -795,6 +837,29 @@ static int static_verify_stringlist(struct sieve2_context *context, stringlist_t
     return (sl == NULL);
 }
 
+/* Checked as the tree is built from the bottom up, so that nothing
+ * which walks the tree later can be made to recurse too deeply. */
+static int static_verify_depth(struct sieve2_context *context, int depth)
+{
+    if (depth > context->max_depth) {
+        libsieve_sieveerror(context, context->sieve_scan, "script nests too deeply");
+        return 0;
+    }
+    return 1;
+}
+
+static int static_testlist_depth(testlist_t *tl)
+{
+    int depth = 0;
+
+    for (; tl != NULL; tl = tl->next) {
+        if (tl->t && tl->t->depth > depth)
+            depth = tl->t->depth;
+    }
+
+    return 1 + depth;
+}
+
 static int static_verify_flag(struct sieve2_context *context, const char *s)
 {
     /* xxx if not a flag, call sieveerror */
@@ -805,11 +870,11 @@ static int static_verify_address(struct sieve2_context *context, const char *s)
 {
     struct address *addr = NULL;
 
+    /* It's in the arena, which is cleared once the script is parsed. */
     addr = libsieve_addr_parse_buffer(context, &addr, &s);
     if (addr == NULL) {
         return 0;
     }
-    libsieve_addrstructfree(context, addr, CHARSALSO);
     return 1;
 }
 
@@ -908,9 +973,11 @@ static patternlist_t *static_verify_regexs(struct sieve2_context *context, strin
 	    break;
 	}
 	pl = libsieve_new_pl(reg, pl);
+	pl->s = sl2->s;
     }
     if (sl2 == NULL) {
-	libsieve_free_sl(sl);
+	/* The sources now belong to the patternlist. */
+	libsieve_free_sl_only(sl);
 	return pl;
     }
     return NULL;
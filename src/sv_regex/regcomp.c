@@ -20,6 +20,10 @@
 
 static reg_errcode_t re_compile_internal (regex_t *preg, const char * pattern,
 					  int length, reg_syntax_t syntax);
+static reg_errcode_t re_compile_internal_set (regex_t *preg,
+					      const char * const *patterns,
+					      int npatterns,
+					      reg_syntax_t syntax);
 static void re_compile_fastmap_iter (regex_t *bufp,
 				     const re_dfastate_t *init_state,
 				     char *fastmap);
@@ -55,6 +59,9 @@ static int peek_token_bracket (re_token_t *token, re_string_t *input,
 			       reg_syntax_t syntax);
 static bin_tree_t *parse (re_string_t *regexp, regex_t *preg,
 			  reg_syntax_t syntax, reg_errcode_t *err);
+static bin_tree_t *parse_set (re_string_t *regexps, int nregexps,
+			      regex_t *preg, reg_syntax_t syntax,
+			      reg_errcode_t *err);
 static bin_tree_t *parse_reg_exp (re_string_t *regexp, regex_t *preg,
 				  re_token_t *token, reg_syntax_t syntax,
 				  int nest, reg_errcode_t *err);
@@ -410,7 +417,7 @@ re_compile_fastmap_iter (bufp, init_state, fastmap)
    It returns 0 if it succeeds, nonzero if it doesn't.  (See regex.h for
    the return codes and their meanings.)  */
 
-int
+VISIBLE int
 libsieve_regcomp (preg, pattern, cflags)
     regex_t *__restrict preg;
     const char *__restrict pattern;
@@ -469,6 +476,67 @@ libsieve_regcomp (preg, pattern, cflags)
 weak_alias (__regcomp, regcomp)
 #endif
 
+/* libSieve addition: compile NPATTERNS patterns into PREG, which then
+   matches wherever any one of them would, in a single pass over the
+   string, as though they had been joined with `|'.  Each pattern is
+   parsed on its own, so nothing in one can change how another is read.
+
+   Only whether the set matched can be asked for, so REG_NOSUB must be
+   given.  Subexpressions are numbered across all of the patterns, so
+   a pattern with a back reference is refused with REG_ESUBREG; the
+   caller should then compile the patterns one by one.  */
+
+VISIBLE int
+libsieve_regcomp_set (preg, patterns, npatterns, cflags)
+    regex_t *__restrict preg;
+    const char * const *patterns;
+    int npatterns;
+    int cflags;
+{
+  reg_errcode_t ret;
+  reg_syntax_t syntax = ((cflags & REG_EXTENDED) ? RE_SYNTAX_POSIX_EXTENDED
+			 : RE_SYNTAX_POSIX_BASIC);
+
+  if (!(cflags & REG_NOSUB) || npatterns < 1)
+    return REG_BADPAT;
+
+  preg->buffer = NULL;
+  preg->allocated = 0;
+  preg->used = 0;
+
+  preg->fastmap = re_malloc (char, SBC_MAX);
+  if (BE (preg->fastmap == NULL, 0))
+    return REG_ESPACE;
+
+  syntax |= (cflags & REG_ICASE) ? RE_ICASE : 0;
+
+  if (cflags & REG_NEWLINE)
+    {
+      syntax &= ~RE_DOT_NEWLINE;
+      syntax |= RE_HAT_LISTS_NOT_NEWLINE;
+      preg->newline_anchor = 1;
+    }
+  else
+    preg->newline_anchor = 0;
+  preg->no_sub = 1;
+  preg->translate = NULL;
+
+  ret = re_compile_internal_set (preg, patterns, npatterns, syntax);
+
+  if (ret == REG_ERPAREN)
+    ret = REG_EPAREN;
+
+  if (BE (ret == REG_NOERROR, 1))
+    (void) libsieve_re_compile_fastmap (preg);
+  else
+    {
+      re_free (preg->fastmap);
+      preg->fastmap = NULL;
+    }
+
+  return (int) ret;
+}
+
 /* Returns a message corresponding to an error code, ERRCODE, returned
    from either regcomp or regexec.   We don't use PREG here.  */
 
@@ -523,6 +591,7 @@ free_dfa_content (re_dfa_t *dfa)
   int i, j;
 
   re_free (dfa->subexps);
+  lock_fini (dfa->lock);
 
   for (i = 0; i < dfa->nodes_len; ++i)
     {
@@ -574,15 +643,25 @@ free_dfa_content (re_dfa_t *dfa)
 
 /* Free dynamically allocated space used by PREG.  */
 
-void
+VISIBLE void
 libsieve_regfree (preg)
     regex_t *preg;
 {
   re_dfa_t *dfa = (re_dfa_t *) preg->buffer;
+  sieve2_allocator_t allocator;
+  const sieve2_allocator_t *prev = NULL;
+
+  /* libSieve: back to where it came from; the DFA itself goes first.  */
   if (BE (dfa != NULL, 1))
-    free_dfa_content (dfa);
+    {
+      allocator = dfa->allocator;
+      prev = libsieve_allocator_push (&allocator);
+      free_dfa_content (dfa);
+    }
 
   re_free (preg->fastmap);
+  if (BE (dfa != NULL, 1))
+    libsieve_allocator_pop (prev);
 }
 #ifdef _LIBC
 weak_alias (__regfree, regfree)
@@ -750,6 +829,93 @@ re_compile_internal (preg, pattern, length, syntax)
   return err;
 }
 
+/* As re_compile_internal, but for libsieve_regcomp_set.  */
+
+static reg_errcode_t
+re_compile_internal_set (preg, patterns, npatterns, syntax)
+     regex_t *preg;
+     const char * const *patterns;
+     int npatterns;
+     reg_syntax_t syntax;
+{
+  reg_errcode_t err = REG_NOERROR;
+  re_dfa_t *dfa;
+  re_string_t *regexps;
+  int i, length, nconstructed = 0;
+
+  preg->fastmap_accurate = 0;
+  preg->syntax = syntax;
+  preg->not_bol = preg->not_eol = 0;
+  preg->used = 0;
+  preg->re_nsub = 0;
+  preg->can_be_null = 0;
+  preg->regs_allocated = REGS_UNALLOCATED;
+
+  for (length = 0, i = 0; i < npatterns; i++)
+    length += strlen (patterns[i]) + 1;
+
+  regexps = re_malloc (re_string_t, npatterns);
+  if (BE (regexps == NULL, 0))
+    return REG_ESPACE;
+
+  dfa = re_realloc (preg->buffer, re_dfa_t, 1);
+  if (BE (dfa == NULL, 0))
+    {
+      re_free (regexps);
+      return REG_ESPACE;
+    }
+  preg->allocated = sizeof (re_dfa_t);
+  preg->buffer = (unsigned char *) dfa;
+  preg->used = sizeof (re_dfa_t);
+
+  err = init_dfa (dfa, length);
+  if (BE (err != REG_NOERROR, 0))
+    {
+      re_free (dfa);
+      re_free (regexps);
+      preg->buffer = NULL;
+      preg->allocated = 0;
+      return err;
+    }
+
+  for (i = 0; i < npatterns && err == REG_NOERROR; i++)
+    {
+      err = re_string_construct (&regexps[i], patterns[i],
+				 strlen (patterns[i]), preg->translate,
+				 syntax & RE_ICASE);
+      if (err == REG_NOERROR)
+	nconstructed++;
+    }
+  if (BE (err != REG_NOERROR, 0))
+    goto re_compile_internal_set_free_return;
+
+  dfa->str_tree = parse_set (regexps, npatterns, preg, syntax, &err);
+  if (BE (dfa->str_tree == NULL, 0))
+    goto re_compile_internal_set_free_return;
+
+  err = analyze (dfa);
+  if (BE (err != REG_NOERROR, 0))
+    goto re_compile_internal_set_free_return;
+
+  err = create_initial_state (dfa);
+
+  free_workarea_compile (preg);
+
+  if (BE (err != REG_NOERROR, 0))
+    {
+    re_compile_internal_set_free_return:
+      free_dfa_content (dfa);
+      preg->buffer = NULL;
+      preg->allocated = 0;
+    }
+
+  for (i = 0; i < nconstructed; i++)
+    re_string_destruct (&regexps[i]);
+  re_free (regexps);
+
+  return err;
+}
+
 /* Initialize DFA.  We use the length of the regular expression PAT_LEN
    as the initial length of some arrays.  */
 
@@ -761,6 +927,7 @@ init_dfa (dfa, pat_len)
   int table_size;
 
   memset (dfa, '\0', sizeof (re_dfa_t));
+  dfa->allocator = *libsieve_allocator ();
 
   dfa->nodes_alloc = pat_len + 1;
   dfa->nodes = re_malloc (re_token_t, dfa->nodes_alloc);
@@ -780,7 +947,7 @@ init_dfa (dfa, pat_len)
   dfa->word_char = NULL;
 
   if (BE (dfa->nodes == NULL || dfa->state_table == NULL
-	  || dfa->subexps == NULL, 0))
+	  || dfa->subexps == NULL || lock_init (dfa->lock) != 0, 0))
     {
       /* We don't bother to free anything which was allocated.  Very
 	 soon the process will go down anyway.  */
@@ -1804,6 +1971,81 @@ parse (regexp, preg, syntax, err)
   return root;
 }
 
+/* As parse, but the trees of all of REGEXPS are joined with ALT nodes,
+   as though the patterns had been written <regexp1>|<regexp2>|...  */
+
+static bin_tree_t *
+parse_set (regexps, nregexps, preg, syntax, err)
+     re_string_t *regexps;
+     int nregexps;
+     regex_t *preg;
+     reg_syntax_t syntax;
+     reg_errcode_t *err;
+{
+  re_dfa_t *dfa = (re_dfa_t *) preg->buffer;
+  bin_tree_t *tree = NULL, *branch, *eor, *root;
+  re_token_t current_token, alt_token;
+  int i, j, first, new_idx;
+
+  memset (&alt_token, '\0', sizeof (re_token_t));
+  alt_token.type = OP_ALT;
+
+  for (i = 0; i < nregexps; i++)
+    {
+      first = dfa->nodes_len;
+      current_token = fetch_token (&regexps[i], syntax);
+      branch = parse_reg_exp (&regexps[i], preg, &current_token, syntax, 0,
+			      err);
+      if (BE (*err != REG_NOERROR && branch == NULL, 0))
+	{
+	  free_bin_tree (tree);
+	  return NULL;
+	}
+      if (BE (current_token.type != END_OF_RE, 0))
+	{
+	  free_bin_tree (tree);
+	  free_bin_tree (branch);
+	  *err = REG_BADPAT;
+	  return NULL;
+	}
+      for (j = first; j < dfa->nodes_len; j++)
+	if (dfa->nodes[j].type == OP_BACK_REF)
+	  {
+	    free_bin_tree (tree);
+	    free_bin_tree (branch);
+	    *err = REG_ESUBREG;
+	    return NULL;
+	  }
+      if (i == 0)
+	{
+	  tree = branch;
+	  continue;
+	}
+      new_idx = re_dfa_add_node (dfa, alt_token, 0);
+      tree = create_tree (tree, branch, 0, new_idx);
+      if (BE (new_idx == -1 || tree == NULL, 0))
+	{
+	  *err = REG_ESPACE;
+	  return NULL;
+	}
+      dfa->has_plural_match = 1;
+    }
+
+  /* The last pattern left its END_OF_RE in current_token.  */
+  new_idx = re_dfa_add_node (dfa, current_token, 0);
+  eor = create_tree (NULL, NULL, 0, new_idx);
+  if (tree != NULL)
+    root = create_tree (tree, eor, CONCAT, 0);
+  else
+    root = eor;
+  if (BE (new_idx == -1 || eor == NULL || root == NULL, 0))
+    {
+      *err = REG_ESPACE;
+      return NULL;
+    }
+  return root;
+}
+
 /* This function build the following tree, from regular expression
    <branch1>|<branch2>:
 	   ALT
@@ -45,8 +45,20 @@
    <regex.h>.  */
 #include <sys/types.h>
 #include "regex.h"
+/* libSieve: compiled patterns and the state of matching them come
+   from wherever the rest of libSieve's memory does.  */
+#include "src/sv_util/util.h"
 #include "regex_internal.h"
 
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+#define malloc(n) libsieve_malloc (n)
+#define calloc(n, s) libsieve_calloc (n, s)
+#define realloc(p, n) libsieve_realloc (p, n)
+#define free(p) libsieve_free (p)
+
 #include "regex_internal.c"
 #include "regcomp.c"
 #include "regexec.c"
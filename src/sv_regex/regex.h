@@ -558,6 +558,11 @@ extern size_t libsieve_regerror _RE_ARGS ((int __errcode, const regex_t *__preg,
 
 extern void libsieve_regfree _RE_ARGS ((regex_t *__preg));
 
+/* libSieve addition; see regcomp.c.  */
+extern int libsieve_regcomp_set _RE_ARGS ((regex_t *__restrict __preg,
+			      const char *const *__patterns, int __npatterns,
+			      int __cflags));
+
 
 #ifdef __cplusplus
 }
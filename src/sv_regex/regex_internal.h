@@ -42,6 +42,23 @@
 # include <wctype.h>
 #endif /* HAVE_WCTYPE_H || _LIBC */
 
+/* regexec() adds states to the DFA as it goes, so a pattern
+   which is shared between threads needs a lock around it.  */
+#if defined HAVE_PTHREAD_H && !defined _LIBC
+# include <pthread.h>
+# define lock_define(name) pthread_mutex_t name;
+# define lock_init(lock) pthread_mutex_init (&(lock), NULL)
+# define lock_fini(lock) pthread_mutex_destroy (&(lock))
+# define lock_lock(lock) pthread_mutex_lock (&(lock))
+# define lock_unlock(lock) pthread_mutex_unlock (&(lock))
+#else
+# define lock_define(name)
+# define lock_init(lock) 0
+# define lock_fini(lock) 0
+# define lock_lock(lock) ((void) 0)
+# define lock_unlock(lock) ((void) 0)
+#endif
+
 /* In case that the system doesn't have isblank().  */
 #if !defined _LIBC && !defined HAVE_ISBLANK && !defined isblank
 # define isblank(ch) ((ch) == ' ' || (ch) == '\t')
@@ -596,6 +613,11 @@ struct re_dfa_t
      a node which can accept multibyte character or multi character
      collating element.  */
   unsigned int has_mb_node : 1;
+  lock_define (lock)
+  /* libSieve: what the pattern was compiled with.  regexec keeps the
+     states it adds to the DFA, and they go with the pattern, so they
+     come from here too, whoever is executing.  */
+  sieve2_allocator_t allocator;
 };
 typedef struct re_dfa_t re_dfa_t;
 
@@ -207,7 +207,7 @@ static reg_errcode_t extend_buffers (re_match_context_t *mctx);
 
    We return 0 if we find a match and REG_NOMATCH if not.  */
 
-int
+VISIBLE int
 libsieve_regexec (preg, string, nmatch, pmatch, eflags)
     const regex_t *__restrict preg;
     const char *__restrict string;
@@ -217,12 +217,20 @@ libsieve_regexec (preg, string, nmatch, pmatch, eflags)
 {
   reg_errcode_t err;
   int length = strlen (string);
+  re_dfa_t *dfa = (re_dfa_t *) preg->buffer;
+  const sieve2_allocator_t *prev;
+
+  /* libSieve: see re_dfa_t.  */
+  prev = libsieve_allocator_push (&dfa->allocator);
+  lock_lock (dfa->lock);
   if (preg->no_sub)
     err = re_search_internal (preg, string, length, 0, length, length, 0,
 			      NULL, eflags);
   else
     err = re_search_internal (preg, string, length, 0, length, length, nmatch,
 			      pmatch, eflags);
+  lock_unlock (dfa->lock);
+  libsieve_allocator_pop (prev);
   return err != REG_NOERROR;
 }
 #ifdef _LIBC
@@ -72,6 +72,52 @@ static int end_of_nothing(char *buf, int pos);
 static int end_of_header(char *buf, int pos);
 
 static int debug = 0;
+static int precompile = 0;
+static char *bytecode = NULL;
+static int recipients = 0;
+static int use_index = 0;
+static int use_callbacks3 = 0;
+static int use_actionlist = 0;
+static int use_getheaders = 0;
+static int use_allocator = 0;
+
+/* An allocator of our own, which counts what's still allocated,
+ * to show that libSieve gives back everything it took from it. */
+struct my_allocations {
+	long count;
+	long total;
+};
+
+static void *my_malloc(size_t size, void *user_data)
+{
+	struct my_allocations *a = (struct my_allocations *)user_data;
+	void *ptr = malloc(size);
+
+	if (ptr) {
+		a->count++;
+		a->total++;
+	}
+	return ptr;
+}
+
+static void *my_realloc(void *ptr, size_t size, void *user_data)
+{
+	return realloc(ptr, size);
+}
+
+static void my_free(void *ptr, void *user_data)
+{
+	struct my_allocations *a = (struct my_allocations *)user_data;
+
+	a->count--;
+	free(ptr);
+}
+
+static struct my_allocations my_allocations;
+static sieve2_allocator_t my_allocator = {
+	my_malloc, my_realloc, my_free, &my_allocations
+};
+
 int my_debug(sieve2_context_t *s, void *my)
 {
 	if (debug) {
@@ -319,6 +365,63 @@ int my_getheader(sieve2_context_t *s, void *my)
 	return SIEVE2_OK;
 }
 
+static void my_free_later(struct my_context *m, void *p)
+{
+	struct freelist *tmp = malloc(sizeof(struct freelist));
+	tmp->next = m->freelist;
+	tmp->free = p;
+	m->freelist = tmp;
+}
+
+/* Find every value of one header in the message, unfolded. A real
+ * server would more likely have these in its database already. */
+static char **my_find_header(struct my_context *m, const char *name)
+{
+	size_t len = strlen(name), n = 0, vlen;
+	char **body, *line, *end, *value;
+
+	body = malloc(sizeof(char *));
+	body[0] = NULL;
+
+	for (line = m->m_buf; line && *line && *line != '\n'; line = end) {
+		for (end = line; *end && (*end != '\n' || end[1] == ' ' || end[1] == '\t'); end++);
+		if (*end)
+			end++;
+		if (strncasecmp(line, name, len) != 0 || line[len] != ':')
+			continue;
+		for (value = line + len + 1; *value == ' ' || *value == '\t'; value++);
+		for (vlen = end - value; vlen > 0 && isspace((unsigned char)value[vlen - 1]); vlen--);
+		body = realloc(body, (n + 2) * sizeof(char *));
+		body[n] = strndup(value, vlen);
+		my_free_later(m, body[n]);
+		body[++n] = NULL;
+	}
+	my_free_later(m, body);
+
+	return body;
+}
+
+/* Answer for every header the script might look at in one go. */
+int my_getheaders_bulk(sieve2_context_t *s, void *my)
+{
+	struct my_context *m = (struct my_context *)my;
+	char **headers;
+	int i;
+
+	headers = sieve2_getvalue_stringlist(s, "headers");
+	if (!headers)
+		return SIEVE2_ERROR_BADARGS;
+
+	printf("Requested %s", headers[0] ? "headers" : "no headers");
+	for (i = 0; headers[i]; i++) {
+		printf(" [%s]", headers[i]);
+		sieve2_setvalue_stringlist(s, headers[i], my_find_header(m, headers[i]));
+	}
+	printf("\n");
+
+	return SIEVE2_OK;
+}
+
 /* Feed back null values as a crash test. */
 int my_getenvelope(sieve2_context_t *s, void *my)
 {
@@ -485,12 +588,213 @@ sieve2_callback_t my_callbacks[] = {
 { SIEVE2_MESSAGE_GETSIZE,       my_getsize       },
 { 0 } };
 
+/* The same callbacks written for the version 3 interface,
+ * which hands each one a struct with its values in it. */
+int my_redirect3(sieve2_context_t *s, void *my, void *values)
+{
+	struct my_context *m = (struct my_context *)my;
+	sieve2_redirect_t *redirect = (sieve2_redirect_t *)values;
+
+	printf( "Action is REDIRECT: \n" );
+	printf( "  Destination is [%s]\n", redirect->address);
+
+	m->actiontaken = 1;
+	return SIEVE2_OK;
+}
+
+int my_fileinto3(sieve2_context_t *s, void *my, void *values)
+{
+	struct my_context *m = (struct my_context *)my;
+	sieve2_fileinto_t *fileinto = (sieve2_fileinto_t *)values;
+	int i;
+
+	printf( "Action is KEEP or FILEINTO: \n" );
+	printf( "  Destination is %s\n", fileinto->mailbox);
+	if (fileinto->flags) {
+		printf( "  Flags are:");
+		for (i = 0; fileinto->flags[i]; i++)
+			printf( " %s", fileinto->flags[i]);
+		printf( ".\n");
+	} else {
+			printf( "  No flags specified.\n");
+	}
+
+	m->actiontaken = 1;
+	return SIEVE2_OK;
+}
+
+/* KEEP is essentially the default case of FILEINTO "INBOX". */
+int my_keep3(sieve2_context_t *s, void *my, void *values)
+{
+	sieve2_fileinto_t fileinto;
+
+	fileinto.mailbox = NULL;
+	fileinto.flags = ((sieve2_keep_t *)values)->flags;
+
+	return my_fileinto3(s, my, &fileinto);
+}
+
+int my_getheaders3(sieve2_context_t *s, void *my, void *values)
+{
+	struct my_context *m = (struct my_context *)my;
+
+	((sieve2_getallheaders_t *)values)->allheaders = m->m_buf;
+
+	return SIEVE2_OK;
+}
+
+int my_getsize3(sieve2_context_t *s, void *my, void *values)
+{
+	struct my_context *m = (struct my_context *)my;
+
+	((sieve2_getsize_t *)values)->size = m->m_size;
+
+	return SIEVE2_OK;
+}
+
+sieve2_callback3_t my_callbacks3[] = {
+{ SIEVE2_ACTION_FILEINTO,       my_fileinto3     },
+{ SIEVE2_ACTION_REDIRECT,       my_redirect3     },
+{ SIEVE2_ACTION_KEEP,           my_keep3         },
+{ SIEVE2_MESSAGE_GETALLHEADERS, my_getheaders3   },
+{ SIEVE2_MESSAGE_GETSIZE,       my_getsize3      },
+{ 0 } };
+
+/* Instead of having libSieve parse all of the headers. */
+sieve2_callback_t my_callbacks_bulk[] = {
+{ SIEVE2_MESSAGE_GETALLHEADERS, NULL             },
+{ SIEVE2_MESSAGE_GETHEADERS,    my_getheaders_bulk },
+{ 0 } };
+
+/* With the action list on, the actions come back all at once after the
+ * script has run, instead of through the callbacks, and the implicit
+ * keep is already on the list if nothing cancelled it. */
+static void print_flags(char **flags)
+{
+	int i;
+
+	if (flags && flags[0]) {
+		printf( "  Flags are:");
+		for (i = 0; flags[i]; i++)
+			printf( " %s", flags[i]);
+		printf( ".\n");
+	} else {
+		printf( "  No flags specified.\n");
+	}
+}
+
+static int print_actionlist(sieve2_context_t *sieve2_context, int which)
+{
+	const sieve2_action_t *actions;
+	int i, j, count, res;
+
+	res = sieve2_getactionlist(sieve2_context, which, &actions, &count);
+	if (res != SIEVE2_OK)
+		return res;
+
+	printf("Action list has %d entries:\n", count);
+	for (i = 0; i < count; i++) {
+		const sieve2_action_t *a = &actions[i];
+		switch (a->code) {
+		case SIEVE2_ACTION_KEEP:
+			printf( "Action is %sKEEP\n", a->implicit ? "implicit " : "");
+			print_flags(a->u.keep.flags);
+			break;
+		case SIEVE2_ACTION_FILEINTO:
+			printf( "Action is FILEINTO: \n" );
+			printf( "  Destination is %s\n", a->u.fileinto.mailbox);
+			print_flags(a->u.fileinto.flags);
+			break;
+		case SIEVE2_ACTION_REDIRECT:
+			printf( "Action is REDIRECT: \n" );
+			printf( "  Destination is [%s]\n", a->u.redirect.address);
+			break;
+		case SIEVE2_ACTION_REJECT:
+			printf( "Action is REJECT: \n" );
+			printf( "  Message is [%s]\n", a->u.reject.message);
+			break;
+		case SIEVE2_ACTION_VACATION:
+			printf("echo '%s' | mail -s '%s' '%s' for message '%s'\n",
+				a->u.vacation.message, a->u.vacation.subject,
+				a->u.vacation.address, a->u.vacation.hash);
+			break;
+		case SIEVE2_ACTION_NOTIFY:
+			printf( "Action is NOTIFY: \n" );
+			printf( "    Method is %s\n", a->u.notify.method);
+			printf( "    Priority is %s\n", a->u.notify.priority);
+			printf( "    Message is %s\n", a->u.notify.message);
+			for (j = 0; a->u.notify.options && a->u.notify.options[j]; j++)
+				printf( "    Options are %s\n", a->u.notify.options[j] );
+			break;
+		default:
+			printf( "Action is %d\n", a->code);
+			break;
+		}
+	}
+
+	return SIEVE2_OK;
+}
+
+/* A real server would have a script and a context of its own for each
+ * recipient; here they all share ours, so each action is seen n times. */
+static int execute_recipients(sieve2_context_t *sieve2_context,
+	sieve2_script_t *sieve2_script, struct my_context *my_context)
+{
+	sieve2_script_t **scripts;
+	sieve2_index_t *index = NULL;
+	void **user_data;
+	int *results, *which;
+	int i, res;
+
+	scripts = malloc(recipients * sizeof(sieve2_script_t *));
+	user_data = malloc(recipients * sizeof(void *));
+	results = malloc(recipients * sizeof(int));
+	which = malloc(recipients * sizeof(int));
+	if (!scripts || !user_data || !results || !which) {
+		res = SIEVE2_ERROR_NOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < recipients; i++) {
+		scripts[i] = sieve2_script;
+		user_data[i] = my_context;
+		which[i] = i;
+	}
+
+	if (use_index) {
+		res = sieve2_index_build(scripts, recipients, &index);
+		if (res == SIEVE2_OK)
+			res = sieve2_execute_index(sieve2_context, index, which,
+				user_data, recipients, results);
+		sieve2_index_free(&index);
+	} else {
+		res = sieve2_execute_scripts(sieve2_context, scripts, user_data,
+			recipients, results);
+	}
+
+	for (i = 0; res == SIEVE2_OK && i < recipients; i++) {
+		if (results[i] != SIEVE2_OK)
+			res = results[i];
+	}
+
+	for (i = 0; use_actionlist && res == SIEVE2_OK && i < recipients; i++)
+		res = print_actionlist(sieve2_context, i);
+
+out:
+	free(scripts);
+	free(user_data);
+	free(results);
+	free(which);
+	return res;
+}
+
 int main(int argc, char *argv[])
 {
 	int usage_error = 0;
 	int res, exitcode = 0, s, m;
 	struct my_context *my_context;
 	sieve2_context_t *sieve2_context;
+	sieve2_script_t *sieve2_script = NULL;
 	char *message = NULL, *script = NULL;
 
 	if (argc < 2) {
@@ -506,8 +810,32 @@ int main(int argc, char *argv[])
 			exitcode = 0;
 			goto endnofree;
 		} else {
-			if (strcmp(argv[1], "-d") == 0) {
-				debug = 1;
+			while (argc > s && argv[s][0] == '-') {
+				if (strcmp(argv[s], "-d") == 0) {
+					debug = 1;
+				} else if (strcmp(argv[s], "-p") == 0) {
+					precompile = 1;
+				} else if (strcmp(argv[s], "-3") == 0) {
+					use_callbacks3 = 1;
+				} else if (strcmp(argv[s], "-a") == 0) {
+					use_actionlist = 1;
+				} else if (strcmp(argv[s], "-h") == 0) {
+					use_getheaders = 1;
+				} else if (strcmp(argv[s], "-m") == 0) {
+					use_allocator = 1;
+				} else if ((strcmp(argv[s], "-r") == 0 || strcmp(argv[s], "-i") == 0)
+						&& argc > s + 1) {
+					precompile = 1;
+					use_index = (argv[s][1] == 'i');
+					recipients = atoi(argv[s + 1]);
+					s++, m++;
+				} else if (strcmp(argv[s], "-b") == 0 && argc > s + 1) {
+					precompile = 1;
+					bytecode = argv[s + 1];
+					s++, m++;
+				} else {
+					break;
+				}
 				s++, m++;
 			}
 			if (argc >= m) {
@@ -525,6 +853,15 @@ int main(int argc, char *argv[])
 		printf("Usage:\n");
 		printf("%s script\n", argv[0]);
 		printf("%s script message\n", argv[0]);
+		printf("  -d to print debugging trace\n");
+		printf("  -p to compile the script before executing it\n");
+		printf("  -b file to compile the script into file and load it from there\n");
+		printf("  -r n to run the compiled script as if for n recipients at once\n");
+		printf("  -i n to do the same through an index of the n scripts\n");
+		printf("  -3 to use version 3 callbacks where there are any\n");
+		printf("  -a to get the actions as a list after executing\n");
+		printf("  -h to answer for the headers all at once\n");
+		printf("  -m to give the context an allocator of its own\n");
 		exitcode = 1;
 		goto endnofree;
 	}
@@ -552,7 +889,10 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	res = sieve2_alloc(&sieve2_context);
+	if (use_allocator)
+		res = sieve2_alloc_with(&sieve2_context, &my_allocator);
+	else
+		res = sieve2_alloc(&sieve2_context);
 	if (res != SIEVE2_OK) {
 		printf("Error %d when calling sieve2_alloc: %s\n",
 			res, sieve2_errstr(res));
@@ -568,6 +908,36 @@ int main(int argc, char *argv[])
 		goto freesieve;
 	}
 
+	if (use_callbacks3) {
+		res = sieve2_callbacks3(sieve2_context, my_callbacks3);
+		if (res != SIEVE2_OK) {
+			printf("Error %d when calling sieve2_callbacks3: %s\n",
+				res, sieve2_errstr(res));
+			exitcode = 1;
+			goto freesieve;
+		}
+	}
+
+	if (use_getheaders) {
+		res = sieve2_callbacks(sieve2_context, my_callbacks_bulk);
+		if (res != SIEVE2_OK) {
+			printf("Error %d when calling sieve2_callbacks: %s\n",
+				res, sieve2_errstr(res));
+			exitcode = 1;
+			goto freesieve;
+		}
+	}
+
+	if (use_actionlist) {
+		res = sieve2_setactionlist(sieve2_context, 1);
+		if (res != SIEVE2_OK) {
+			printf("Error %d when calling sieve2_setactionlist: %s\n",
+				res, sieve2_errstr(res));
+			exitcode = 1;
+			goto freesieve;
+		}
+	}
+
 	printf("Validating script...");
 	res = sieve2_validate(sieve2_context, my_context);
 	if (res != SIEVE2_OK) {
@@ -583,14 +953,44 @@ int main(int argc, char *argv[])
 
 	if (message) {
 		printf("Executing script...\n");
-		res = sieve2_execute(sieve2_context, my_context);
+		if (precompile) {
+			res = sieve2_compile(sieve2_context, my_context, &sieve2_script);
+			if (res != SIEVE2_OK) {
+				printf("Error %d when calling sieve2_compile: %s\n",
+					res, sieve2_errstr(res));
+				exitcode = 1;
+				goto freesieve;
+			}
+			if (bytecode) {
+				res = sieve2_script_write(sieve2_script, bytecode);
+				sieve2_script_free(&sieve2_script);
+				if (res == SIEVE2_OK)
+					res = sieve2_script_load(bytecode, &sieve2_script);
+				if (res != SIEVE2_OK) {
+					printf("Error %d when loading %s: %s\n",
+						res, bytecode, sieve2_errstr(res));
+					exitcode = 1;
+					goto freesieve;
+				}
+			}
+			if (recipients > 0) {
+				res = execute_recipients(sieve2_context, sieve2_script, my_context);
+			} else {
+				res = sieve2_execute_script(sieve2_context, sieve2_script, my_context);
+			}
+		} else {
+			res = sieve2_execute(sieve2_context, my_context);
+		}
 		if (res != SIEVE2_OK) {
 			printf("Error %d when calling sieve2_execute: %s\n",
 				res, sieve2_errstr(res));
 			exitcode = 1;
 			goto freesieve;
 		}
-		if (!my_context->actiontaken) {
+		if (use_actionlist) {
+			if (recipients == 0)
+				print_actionlist(sieve2_context, 0);
+		} else if (!my_context->actiontaken) {
 			printf("  no actions taken; keeping message.\n");
 			my_keep(NULL, my_context);
 		} else {
@@ -604,6 +1004,9 @@ int main(int argc, char *argv[])
 	exitcode |= my_context->error_runtime;
 
 freesieve:
+	if (sieve2_script)
+		sieve2_script_free(&sieve2_script);
+
 	res = sieve2_free(&sieve2_context);
 	if (res != SIEVE2_OK) {
 		printf("Error %d when calling sieve2_free: %s\n",
@@ -611,6 +1014,13 @@ freesieve:
 		exitcode = 1;
 	}
 
+	if (use_allocator) {
+		printf("Allocator: %ld allocations, %ld not given back\n",
+			my_allocations.total, my_allocations.count);
+		if (my_allocations.count != 0)
+			exitcode = 1;
+	}
+
 freecontext:
 	if (my_context->m_buf) free(my_context->m_buf);
 	if (my_context->s_buf) free(my_context->s_buf);
@@ -0,0 +1,20 @@
+require ["fileinto", "regex"];
+
+# Four patterns or more make one regex when the script is compiled;
+# whichever way it runs, the same messages have to be filed.
+if header :regex "subject" ["present|gift", "^[$]{3} ", "MILLIONAIRE! [$]+$", "^nothing$"] {
+	fileinto "regex.set";
+}
+
+if header :regex :comparator "i;ascii-casemap" ["from", "to"] ["^[A-Z]+@DESERT", "@ACME[.]", "^nobody@", "EXEMPLO[.]PT$"] {
+	fileinto "regex.icase";
+}
+
+# A back reference can't go in a set; these are tried one at a time.
+if header :regex "subject" ["(o)\\1 ", "no such thing", "^There is", "x{5}"] {
+	fileinto "regex.backref";
+}
+
+if header :regex "subject" ["^(.+) \\1$", "^nor this$", "[0-9]{7}", "^$"] {
+	fileinto "regex.none";
+}
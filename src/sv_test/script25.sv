@@ -0,0 +1,13 @@
+require ["envelope", "fileinto"];
+
+# Every recipient of a message may share one script, as they would a
+# site-wide one; each has to be filed by the envelope of their own.
+if envelope :is "to" "foo+AllowedBox@bar" {
+	fileinto "allowed";
+} elsif envelope :is "to" "bar+OtherBox@foo" {
+	fileinto "other";
+}
+
+if header :contains "subject" "present" {
+	fileinto "present";
+}
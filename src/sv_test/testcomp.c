@@ -1,7 +1,7 @@
 /* testcomp.c -- test and exercises for the comparator functions.
  * $Id$
  *
- * usage: "testcomp"
+ * usage: "testcomp [-b]"
  */
 
 #ifdef HAVE_CONFIG_H
@@ -16,6 +16,8 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <locale.h>
 
 /* THESE ARE INTERNAL HEADERS,
  * DO NOT TRY TO USE THEM IN
@@ -57,6 +59,44 @@ struct testcase tc[] = {
 	{ "i;octet", CONTAINS, "a", "bab", 1 },
 	{ "i;octet", CONTAINS, "a", "bb", 0 },
 	{ "i;octet", CONTAINS, "a", "bbb", 0 },
+	{ "i;octet", CONTAINS, "abc", "xxabcxx", 1 },
+	{ "i;octet", CONTAINS, "abc", "xxabxcx", 0 },
+	{ "i;octet", CONTAINS, "abab", "abaabab", 1 },
+	{ "i;octet", CONTAINS, "abab", "abaaba", 0 },
+	{ "i;octet", CONTAINS, "abc", "xxABCxx", 0 },
+
+	{ "i;ascii-casemap", CONTAINS, "", "", 1 },
+	{ "i;ascii-casemap", CONTAINS, "a", "", 0 },
+	{ "i;ascii-casemap", CONTAINS, "a", "bAb", 1 },
+	{ "i;ascii-casemap", CONTAINS, "aBc", "xxAbCxx", 1 },
+	{ "i;ascii-casemap", CONTAINS, "aBc", "xxAbxCx", 0 },
+	{ "i;ascii-casemap", CONTAINS, "abab", "ABAABAB", 1 },
+	/* long enough to be looked through a block at a time */
+	{ "i;ascii-casemap", CONTAINS, "spam",
+	  "Subject: this is not what you think it is at all, really", 0 },
+	{ "i;ascii-casemap", CONTAINS, "spam",
+	  "Subject: this is not what you think it is at all, SpAm", 1 },
+	{ "i;ascii-casemap", CONTAINS, "spam",
+	  "SPAM Subject: this is not what you think it is at all", 1 },
+	{ "i;ascii-casemap", CONTAINS, "spam",
+	  "Subject: this is not what you think it is, spa m, S[AM, s@am", 0 },
+	{ "i;ascii-casemap", CONTAINS, "x",
+	  "Subject: this is not what you think it is at all, really X", 1 },
+	{ "i;ascii-casemap", CONTAINS, "\xe9t\xe9",
+	  "Subject: un r\xe9sum\xe9 de l'\xc9T\xc9 et de l'\xe9T\xe9 pass\xe9", 1 },
+	{ "i;ascii-casemap", CONTAINS, "\xe9t\xe9",
+	  "Subject: un r\xe9sum\xe9 de l'\xc9T\xc9 et de l'hiver pass\xe9s", 0 },
+	{ "i;ascii-casemap", CONTAINS, "the end of a long subject line",
+	  "Subject: this is what is at THE END OF A LONG SUBJECT LINE", 1 },
+	{ "i;ascii-casemap", CONTAINS, "the end of a long subject line",
+	  "Subject: this is what is at THE END OF A LONG SUBJECT LIN", 0 },
+
+	{ "i;ascii-numeric", IS, "10", "10", 1 },
+	{ "i;ascii-numeric", IS, "10", "010", 1 },
+	{ "i;ascii-numeric", IS, "10", "9", 0 },
+	{ "i;ascii-numeric", IS, "10", "x", 0 },
+	{ "i;ascii-numeric", IS, "x", "10", 0 },
+	{ "i;ascii-numeric", IS, "x", "y", 1 },
 
 	{ "i;octet", MATCHES, "", "", 1 },
 	{ "i;octet", MATCHES, "", "a", 0 },
@@ -158,6 +198,32 @@ struct testcase tc[] = {
 	{ "i;octet", MATCHES, "a*?*b", "acb", 1 },
 	{ "i;octet", MATCHES, "a*?*b?", "acbc", 1 },
 
+	{ "i;octet", MATCHES, "a\\*b", "a*b", 1 },
+	{ "i;octet", MATCHES, "a\\*b", "acb", 0 },
+	{ "i;octet", MATCHES, "a\\?b", "a?b", 1 },
+	{ "i;octet", MATCHES, "a\\?b", "acb", 0 },
+	{ "i;octet", MATCHES, "a\\\\b", "a\\b", 1 },
+	{ "i;octet", MATCHES, "a\\", "a\\", 1 },
+
+	{ "i;octet", MATCHES, "*a*a*a*a*a*a*a*a*b",
+	  "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 0 },
+	{ "i;octet", MATCHES, "*a*a*a*a*a*a*a*a*b",
+	  "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab", 1 },
+
+	{ "i;octet", MATCHES, "*aab*", "aaab", 1 },
+	{ "i;octet", MATCHES, "*abac*", "ababac", 1 },
+	{ "i;octet", MATCHES, "*aba?a*", "xabababa", 1 },
+	{ "i;octet", MATCHES, "*aba?a*", "xababxba", 0 },
+	{ "i;octet", MATCHES, "*ab*ab", "ab", 0 },
+	{ "i;octet", MATCHES, "*ab*ab", "aab", 0 },
+	{ "i;octet", MATCHES, "*ab*ab", "abab", 1 },
+	{ "i;octet", MATCHES, "ab*ba", "aba", 0 },
+	{ "i;octet", MATCHES, "ab*ba", "abba", 1 },
+	{ "i;octet", MATCHES, "*a?c*d?f*", "xxabcyydef", 1 },
+	{ "i;octet", MATCHES, "*a?c*d?f*", "xxdefabc", 0 },
+	{ "i;ascii-casemap", MATCHES, "*AaB*", "xaAab", 1 },
+	{ "i;ascii-casemap", MATCHES, "*a?B*c", "xAzbAc", 1 },
+
 	{ "i;ascii-casemap", MATCHES, "a*b", "", 0 },
 	{ "i;ascii-casemap", MATCHES, "a*b", "a", 0 },
 	{ "i;ascii-casemap", MATCHES, "a*b", "ab", 1 },
@@ -182,6 +248,21 @@ struct testcase tc[] = {
 	{ "i;ascii-casemap", MATCHES, "a*b", "ACB", 1 },
 	{ "i;ascii-casemap", MATCHES, "a*b", "ACBC", 0 },
 
+	/* Only a-z fold, in any locale; long enough texts for the
+	 * needle to be found in a whole block, or only in what's left. */
+	{ "i;ascii-casemap", IS, "\xe9t\xe9", "\xc9T\xc9", 0 },
+	{ "i;ascii-casemap", IS, "\xe9t\xe9", "\xe9T\xe9", 1 },
+	{ "i;ascii-casemap", CONTAINS, "\xe9t\xe9",
+	  "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\xc9T\xc9xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", 0 },
+	{ "i;ascii-casemap", CONTAINS, "\xe9t\xe9",
+	  "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\xe9T\xe9xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", 1 },
+	{ "i;ascii-casemap", CONTAINS, "\xe9t\xe9",
+	  "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\xc9T\xc9", 0 },
+	{ "i;ascii-casemap", CONTAINS, "\xe9t\xe9",
+	  "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\xe9T\xe9", 1 },
+	{ "i;ascii-casemap", MATCHES, "*\xe9t\xe9*", "a\xc9T\xc9z", 0 },
+	{ "i;ascii-casemap", MATCHES, "*\xe9t\xe9*", "a\xe9T\xe9z", 1 },
+
 	{ NULL, 0, NULL, NULL, 0 } };
 
 static int test_comparator(void* context)
@@ -192,6 +273,7 @@ static int test_comparator(void* context)
 	for (t = tc; t->comp != NULL; t++) {
 		comparator_t *c =
          	  libsieve_comparator_lookup(context, t->comp, t->mode);
+		comparator_patterns_t *cp;
 		int res;
 		char *mode;
 
@@ -215,17 +297,300 @@ static int test_comparator(void* context)
 				t->pat, t->text, res, t->result);
 			didfail++;
 		}
+
+		/* and again with the pattern made ready ahead of time */
+		cp = libsieve_comparator_compile(libsieve_comparator_id(t->comp),
+			t->mode, &t->pat, 1);
+		if (cp != NULL) {
+			res = cp->match(context, cp->pats[0], t->text);
+			if (res != t->result) {
+				printf("FAIL: compiled %s/%s(%s, %s) = %d, not %d\n",
+					t->comp, mode,
+					t->pat, t->text, res, t->result);
+				didfail++;
+			}
+			libsieve_comparator_free(cp);
+		}
+	}
+
+	return didfail;
+}
+
+/* Four :contains patterns or more are made into one automaton. Whatever
+ * it finds has to be what looking for each pattern in turn finds. */
+struct containsset {
+	const char *pats[6];	/* up to the first NULL */
+	const char *text;
+	int octet;		/* what i;octet says */
+	int casemap;		/* and what i;ascii-casemap says */
+};
+
+struct containsset cs[] = {
+	/* Keys which overlap, so that a miss has to follow a failure link. */
+	{ { "he", "she", "his", "hers", NULL }, "ushers", 1, 1 },
+	{ { "he", "she", "his", "hers", NULL }, "shis", 1, 1 },
+	{ { "he", "she", "his", "hers", NULL }, "hhers", 1, 1 },
+	{ { "he", "she", "his", "hers", NULL }, "sxhxixsx", 0, 0 },
+	{ { "he", "she", "his", "hers", NULL }, "", 0, 0 },
+	{ { "he", "she", "his", "hers", NULL }, "USHERS", 0, 1 },
+	{ { "HE", "She", "hIs", "hERS", NULL }, "USHIS", 0, 1 },
+	/* A key which ends another one. */
+	{ { "abcd", "bcd", "cd", "xyz", NULL }, "abcx", 0, 0 },
+	{ { "abcd", "bcd", "cd", "xyz", NULL }, "zzbcd", 1, 1 },
+	{ { "abcd", "bcd", "cd", "xyz", NULL }, "abxcd", 1, 1 },
+	{ { "abcd", "bcd", "cd", "xyz", NULL }, "aBcD", 0, 1 },
+	{ { "abcd", "bcd", "cd", "xyz", NULL }, "xy", 0, 0 },
+	{ { "abcd", "bc", "xyz", "pq", NULL }, "abce", 1, 1 },
+	{ { "abcd", "bc", "xyz", "pq", NULL }, "abdc", 0, 0 },
+	/* The empty key is in everything. */
+	{ { "qqq", "", "rrr", "sss", NULL }, "", 1, 1 },
+	{ { "qqq", "", "rrr", "sss", NULL }, "anything", 1, 1 },
+	{ { NULL }, NULL, 0, 0 } };
+
+static int test_contains_set(void *context)
+{
+	static const char *comps[] = { "i;octet", "i;ascii-casemap" };
+	struct containsset *s;
+	comparator_patterns_t *cp;
+	comparator_t *c;
+	int didfail = 0, n, i, j, res, each, want;
+
+	for (s = cs; s->pats[0] != NULL; s++) {
+		for (n = 0; s->pats[n] != NULL; n++) ;
+
+		for (i = 0; i < 2; i++) {
+			want = (i == 0) ? s->octet : s->casemap;
+			c = libsieve_comparator_lookup(context, comps[i], CONTAINS);
+
+			for (each = 0, j = 0; j < n && !each; j++)
+				each = c(context, s->pats[j], s->text);
+			if (each != want) {
+				printf("FAIL: %s/CONTAINS([%s]... of %d, %s) = %d one at a time, not %d\n",
+					comps[i], s->pats[0], n, s->text, each, want);
+				didfail++;
+			}
+
+			cp = libsieve_comparator_compile(libsieve_comparator_id(comps[i]),
+				CONTAINS, s->pats, n);
+			if (cp == NULL || cp->n != 1) {
+				printf("FAIL: %s/CONTAINS([%s]... of %d) wasn't made into one set\n",
+					comps[i], s->pats[0], n);
+				didfail++;
+				libsieve_comparator_free(cp);
+				continue;
+			}
+			res = cp->match(context, cp->pats[0], s->text);
+			if (res != want) {
+				printf("FAIL: %s/CONTAINS([%s]... of %d, %s) = %d as a set, not %d\n",
+					comps[i], s->pats[0], n, s->text, res, want);
+				didfail++;
+			}
+			libsieve_comparator_free(cp);
+		}
 	}
 
 	return didfail;
 }
 
+/* :matches on a header as long as some mail has, with patterns which
+ * a matcher that backs up would try again at every character: each
+ * must be done in about the time it takes to read the text. */
+static int test_matches_large(void *context)
+{
+	static const char *comps[] = { "i;octet", "i;ascii-casemap" };
+	const size_t len = 1000000, plen = 2000;
+	char *text = malloc(len + 1), *pat[3];
+	int didfail = 0, res, i, j, k;
+	clock_t start;
+	double secs;
+
+	for (i = 0; i < 3; i++)
+		pat[i] = malloc(plen + 5);
+	if (text == NULL || pat[0] == NULL || pat[1] == NULL || pat[2] == NULL) {
+		printf("FAIL: out of memory\n");
+		return 1;
+	}
+
+	/* "*aaa...ab*", "*a*a*...*ab" and "*a?a?...?ab*" */
+	pat[0][0] = pat[1][0] = pat[2][0] = '*';
+	for (i = 1; i <= (int)plen; i++) {
+		pat[0][i] = 'a';
+		pat[1][i] = (i % 2) ? 'a' : '*';
+		pat[2][i] = (i % 2) ? 'a' : '?';
+	}
+	for (i = 0; i < 3; i++)
+		strcpy(pat[i] + plen + 1, (i == 1) ? "ab" : "ab*");
+
+	memset(text, 'a', len);
+	text[len] = '\0';
+	for (k = 0; k < 2; k++) {
+		/* No b at all, then one at the very end. */
+		if (k == 1)
+			text[len - 1] = 'b';
+		for (i = 0; i < 2; i++) {
+			comparator_t *c =
+			    libsieve_comparator_lookup(context, comps[i], MATCHES);
+			for (j = 0; j < 3; j++) {
+				start = clock();
+				res = c(context, pat[j], text);
+				secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+				if (res != k || secs > 2.0) {
+					printf("FAIL: %s/MATCHES(pattern %d, %lu characters) "
+						"= %d in %.3fs, not %d\n", comps[i], j,
+						(unsigned long)len, res, secs, k);
+					didfail++;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+		free(pat[i]);
+	free(text);
+	return didfail;
+}
+
+/* A :regex key list is compiled into one regex with libsieve_regcomp_set.
+ * On every text it has to match when one of the patterns compiled on its
+ * own would, and only then. A list it refuses is done a pattern at a
+ * time, as a script would do it; that has to give the same answers. */
+struct regexset {
+	int cflags;
+	const char *pats[6];	/* up to the first NULL */
+	int refused;
+	int hits;		/* how many of rs_texts it matches */
+};
+
+struct regexset rs[] = {
+	{ 0, { "present|gift", "^[$]{3} ", "MILLIONAIRE! [$]+$",
+	       "^[a-z]+@desert", NULL }, 0, 4 },
+	{ REG_ICASE, { "PRESENT|Gift", "^[$]{3} ", "millionaire! [$]+$",
+	       "^[A-Z]+@DESERT", NULL }, 0, 7 },
+	{ 0, { "(a|b)c$", NULL }, 0, 1 },
+	{ 0, { "^(ab)\\1$", "present", "^a", "c$", NULL }, 1, 6 },
+	{ 0, { "no such thing", "^nor this$", "x{5}", "gift$", "^ab", NULL }, 0, 5 },
+	{ 0, { NULL }, 0, 0 } };
+
+static const char *rs_texts[] = {
+	"",
+	"I have a present for you",
+	"I HAVE A PRESENT FOR YOU",
+	"a gift",
+	"$$$ YOU, TOO, CAN BE A MILLIONAIRE! $$$",
+	"you, too, can be a millionaire! $$",
+	"coyote@desert.example.org",
+	"Coyote@Desert.example.org",
+	"abab",
+	"ab",
+	"xxxxx",
+	"bc",
+	"abcd",
+	NULL };
+
+static int test_regex_set(void)
+{
+	struct regexset *r;
+	regex_t one[6], set;
+	int didfail = 0, n, i, j, res, want, err, hits;
+
+	for (r = rs; r->pats[0] != NULL; r++) {
+		int cflags = REG_EXTENDED | REG_NOSUB | r->cflags;
+
+		for (n = 0; r->pats[n] != NULL; n++) {
+			if (libsieve_regcomp(&one[n], r->pats[n], cflags) != 0) {
+				printf("FAIL: can't compile regex [%s]\n", r->pats[n]);
+				return didfail + 1;
+			}
+		}
+
+		err = libsieve_regcomp_set(&set, r->pats, n, cflags);
+		if (r->refused ? err != REG_ESUBREG : err != 0) {
+			printf("FAIL: regex set [%s]... of %d gave %d\n",
+				r->pats[0], n, err);
+			didfail++;
+		}
+
+		for (hits = 0, i = 0; rs_texts[i] != NULL; i++) {
+			for (want = 0, j = 0; j < n && !want; j++)
+				want = (libsieve_regexec(&one[j], rs_texts[i], 0, NULL, 0) == 0);
+			hits += want;
+
+			if (err == 0) {
+				res = (libsieve_regexec(&set, rs_texts[i], 0, NULL, 0) == 0);
+				if (res != want) {
+					printf("FAIL: regex set [%s]... of %d on [%s] = %d, not %d\n",
+						r->pats[0], n, rs_texts[i], res, want);
+					didfail++;
+				}
+			}
+		}
+
+		if (hits != r->hits) {
+			printf("FAIL: regexes [%s]... of %d matched %d texts, not %d\n",
+				r->pats[0], n, hits, r->hits);
+			didfail++;
+		}
+
+		if (err == 0)
+			libsieve_regfree(&set);
+		for (j = 0; j < n; j++)
+			libsieve_regfree(&one[j]);
+	}
+
+	/* Without REG_NOSUB it would have to say where, which it can't. */
+	if (libsieve_regcomp_set(&set, rs[0].pats, 4, REG_EXTENDED) != REG_BADPAT) {
+		printf("FAIL: regex set without REG_NOSUB was made\n");
+		didfail++;
+	}
+
+	return didfail;
+}
+
+/* "testcomp -b": time i;ascii-casemap :contains on a typical header,
+ * as the plain comparator and with its pattern made ready. */
+static void bench_contains(void *context)
+{
+	static const char *pat = "viagra";
+	static const char *text =
+	    "Subject: Re: [list] Minutes of the meeting on Thursday, "
+	    "with the actions which were agreed and who will do them";
+	comparator_t *c = libsieve_comparator_lookup(context,
+		"i;ascii-casemap", CONTAINS);
+	comparator_patterns_t *cp = libsieve_comparator_compile(
+		COMPARATOR_ASCII_CASEMAP, CONTAINS, &pat, 1);
+	const int rounds = 1000000;
+	clock_t start;
+	int i, hits = 0;
+
+	start = clock();
+	for (i = 0; i < rounds; i++)
+		hits += c(context, pat, text);
+	printf("plain:    %.3fs\n", (double)(clock() - start) / CLOCKS_PER_SEC);
+
+	start = clock();
+	for (i = 0; i < rounds; i++)
+		hits += cp->match(context, cp->pats[0], text);
+	printf("compiled: %.3fs\n", (double)(clock() - start) / CLOCKS_PER_SEC);
+
+	if (hits != 0)
+		printf("FAIL: found [%s] %d times\n", pat, hits);
+	libsieve_comparator_free(cp);
+}
+
 int main(int argc, char *argv[])
 {
 	int res;
 	sieve2_context_t *context;
+
+	/* i;ascii-casemap must not fold what the locale would. */
+	setlocale(LC_CTYPE, "");
 	sieve2_alloc(&context);
+	if (argc > 1 && strcmp(argv[1], "-b") == 0)
+		bench_contains(context);
 	res = test_comparator(context);
+	res += test_contains_set(context);
+	res += test_matches_large(context);
+	res += test_regex_set();
 	if (res > 0) {
 		printf("Failed %d tests.\n", res);
 		sieve2_free(&context);
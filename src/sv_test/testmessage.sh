@@ -14,3 +14,12 @@ for i in `seq 1 12`; do
 		echo script$i.sv failed!
 	fi
 done
+
+# A script loaded from bytecode has the library's allocator, and example -m
+# runs it with its own; the regex states it builds must go back to the first.
+echo "Testing script24.sv messagea.mbox from bytecode, with an allocator"
+./example -m -b script24.bc script24.sv messagea.mbox > /dev/null
+if [ "$?" -ne "0" ]; then
+	echo script24.sv failed!
+fi
+rm -f script24.bc
@@ -0,0 +1,483 @@
+/* testthreads.c -- run one script over messages in many threads at once.
+ * $Id$
+ *
+ * usage: "testthreads [-t threads] [-n rounds] script message..."
+ *
+ * Each thread has a context of its own, as a server would have one for
+ * each worker, and they all share one compiled script. Every thread runs
+ * the script over every message, both parsing it each time and from the
+ * compiled script, and what comes out has to be the same as it was when
+ * the script was run just once, with no other threads around. Every other
+ * round, the threads go on to the next message without sieve2_reset.
+ *
+ * The compiled script is also put in an index, and every message is run
+ * through it for two recipients who share the script's place there, as
+ * they would a site-wide script, but each with an envelope of their own.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "sieve2.h"
+
+#define DEFAULT_THREADS 64
+#define DEFAULT_ROUNDS 50
+#define SUMMARY_LEN 4096
+
+/* Who the message is for, by default and for a second recipient. */
+#define ENVELOPE_TO "foo+AllowedBox@bar"
+#define OTHER_TO "bar+OtherBox@foo"
+
+struct my_message {
+	char *buf;
+	int size;
+	/* What came of running the script once, by itself;
+	 * parsed, compiled, and compiled for OTHER_TO. */
+	char summary[3][SUMMARY_LEN];
+};
+
+struct my_thread {
+	pthread_t thread;
+	sieve2_context_t *context;
+	struct my_message *message;
+	const char *envelope_to;
+	int error_parse;
+	int error_runtime;
+	char **freelist;
+	int nfree;
+	int failures;
+};
+
+static char *script_buf;
+static sieve2_script_t *script;
+static sieve2_index_t *script_index;
+static struct my_message *messages;
+static int nmessages;
+static int rounds = DEFAULT_ROUNDS;
+
+static int read_file(const char *filename, char **ret_buf, int *ret_len)
+{
+	FILE *f;
+	char *buf;
+	long len;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		printf("Could not open file '%s'\n", filename);
+		return SIEVE2_ERROR_FAIL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	buf = malloc(len + 1);
+	if (!buf || fread(buf, 1, len, f) != (size_t)len) {
+		free(buf);
+		fclose(f);
+		return SIEVE2_ERROR_FAIL;
+	}
+	buf[len] = '\0';
+	fclose(f);
+
+	*ret_buf = buf;
+	if (ret_len)
+		*ret_len = (int)len;
+	return SIEVE2_OK;
+}
+
+/* Strings handed to libSieve last until the message is done with. */
+static char *my_strdup(struct my_thread *t, const char *str)
+{
+	char **tmp = realloc(t->freelist, (t->nfree + 1) * sizeof(char *));
+	if (!tmp)
+		return NULL;
+	t->freelist = tmp;
+	return t->freelist[t->nfree++] = strdup(str);
+}
+
+static void my_free_all(struct my_thread *t)
+{
+	while (t->nfree > 0)
+		free(t->freelist[--t->nfree]);
+}
+
+int my_getscript(sieve2_context_t *s, void *my)
+{
+	sieve2_setvalue_string(s, "script", script_buf);
+	return SIEVE2_OK;
+}
+
+/* The headers are copied for each execution, and the copy is freed
+ * as soon as it's over, as a server's buffer for a message would be. */
+int my_getheaders(sieve2_context_t *s, void *my)
+{
+	struct my_thread *t = (struct my_thread *)my;
+	char *headers = my_strdup(t, t->message->buf);
+
+	if (!headers)
+		return SIEVE2_ERROR_NOMEM;
+	sieve2_setvalue_string(s, "allheaders", headers);
+	return SIEVE2_OK;
+}
+
+int my_getsize(sieve2_context_t *s, void *my)
+{
+	struct my_thread *t = (struct my_thread *)my;
+
+	sieve2_setvalue_int(s, "size", t->message->size);
+	return SIEVE2_OK;
+}
+
+int my_getenvelope(sieve2_context_t *s, void *my)
+{
+	struct my_thread *t = (struct my_thread *)my;
+
+	sieve2_setvalue_string(s, "to", t->envelope_to ? t->envelope_to : ENVELOPE_TO);
+	sieve2_setvalue_string(s, "from", "from@nothing");
+	return SIEVE2_OK;
+}
+
+int my_getsubaddress(sieve2_context_t *s, void *my)
+{
+	struct my_thread *t = (struct my_thread *)my;
+	char *user, *detail, *localpart, *domain;
+
+	localpart = my_strdup(t, sieve2_getvalue_string(s, "address"));
+	if (!localpart)
+		return SIEVE2_ERROR_NOMEM;
+	domain = strchr(localpart, '@');
+	if (domain)
+		*domain++ = '\0';
+
+	user = my_strdup(t, localpart);
+	if (!user)
+		return SIEVE2_ERROR_NOMEM;
+	detail = strchr(user, '+');
+	if (detail)
+		*detail++ = '\0';
+
+	sieve2_setvalue_string(s, "user", user);
+	sieve2_setvalue_string(s, "detail", detail);
+	sieve2_setvalue_string(s, "localpart", localpart);
+	sieve2_setvalue_string(s, "domain", domain);
+	return SIEVE2_OK;
+}
+
+int my_getbody(sieve2_context_t *s, void *my)
+{
+	return SIEVE2_ERROR_UNSUPPORTED;
+}
+
+int my_errparse(sieve2_context_t *s, void *my)
+{
+	((struct my_thread *)my)->error_parse++;
+	return SIEVE2_OK;
+}
+
+int my_errexec(sieve2_context_t *s, void *my)
+{
+	((struct my_thread *)my)->error_runtime++;
+	return SIEVE2_OK;
+}
+
+int my_errother(sieve2_context_t *s, void *my)
+{
+	return SIEVE2_OK;
+}
+
+/* The actions come back as a list, so none of them need a callback. */
+sieve2_callback_t my_callbacks[] = {
+{ SIEVE2_ERRCALL_PARSE,         my_errparse      },
+{ SIEVE2_ERRCALL_RUNTIME,       my_errexec       },
+{ SIEVE2_ERRCALL_ADDRESS,       my_errother      },
+{ SIEVE2_ERRCALL_HEADER,        my_errother      },
+{ SIEVE2_SCRIPT_GETSCRIPT,      my_getscript     },
+{ SIEVE2_MESSAGE_GETALLHEADERS, my_getheaders    },
+{ SIEVE2_MESSAGE_GETSUBADDRESS, my_getsubaddress },
+{ SIEVE2_MESSAGE_GETENVELOPE,   my_getenvelope   },
+{ SIEVE2_MESSAGE_GETBODY,       my_getbody       },
+{ SIEVE2_MESSAGE_GETSIZE,       my_getsize       },
+{ 0 } };
+
+static void summarize(char *out, size_t *pos, const char *fmt, const char *str)
+{
+	int n;
+
+	if (*pos >= SUMMARY_LEN)
+		return;
+	n = snprintf(out + *pos, SUMMARY_LEN - *pos, fmt, str ? str : "(null)");
+	if (n > 0)
+		*pos += n;
+}
+
+static void summarize_list(char *out, size_t *pos, char **list)
+{
+	int i;
+
+	for (i = 0; list && list[i]; i++)
+		summarize(out, pos, " %s", list[i]);
+}
+
+/* Everything that came of one execution, as a string to compare;
+ * which is the recipient, for an execution with several. */
+static void summarize_actions(struct my_thread *t, int which, int res, char *out)
+{
+	const sieve2_action_t *actions = NULL;
+	char num[32];
+	size_t pos = 0;
+	int i, count = 0;
+
+	snprintf(num, sizeof(num), "%d/%d/%d", res, t->error_parse, t->error_runtime);
+	summarize(out, &pos, "result %s;", num);
+
+	if (res == SIEVE2_OK)
+		sieve2_getactionlist(t->context, which, &actions, &count);
+
+	for (i = 0; i < count; i++) {
+		const sieve2_action_t *a = &actions[i];
+
+		snprintf(num, sizeof(num), "%d/%d", a->code, a->implicit);
+		summarize(out, &pos, " action %s", num);
+		switch (a->code) {
+		case SIEVE2_ACTION_REDIRECT:
+			summarize(out, &pos, " %s", a->u.redirect.address);
+			break;
+		case SIEVE2_ACTION_REJECT:
+			summarize(out, &pos, " %s", a->u.reject.message);
+			break;
+		case SIEVE2_ACTION_FILEINTO:
+			summarize(out, &pos, " %s", a->u.fileinto.mailbox);
+			summarize_list(out, &pos, a->u.fileinto.flags);
+			break;
+		case SIEVE2_ACTION_KEEP:
+			summarize_list(out, &pos, a->u.keep.flags);
+			break;
+		case SIEVE2_ACTION_NOTIFY:
+			summarize(out, &pos, " %s", a->u.notify.method);
+			summarize(out, &pos, " %s", a->u.notify.message);
+			summarize_list(out, &pos, a->u.notify.options);
+			break;
+		case SIEVE2_ACTION_VACATION:
+			summarize(out, &pos, " %s", a->u.vacation.address);
+			summarize(out, &pos, " %s", a->u.vacation.subject);
+			summarize(out, &pos, " %s", a->u.vacation.message);
+			summarize(out, &pos, " %s", a->u.vacation.hash);
+			break;
+		default:
+			break;
+		}
+		summarize(out, &pos, "%s", ";");
+	}
+}
+
+/* Run the script over one message, parsed or compiled. */
+static void run_one(struct my_thread *t, struct my_message *m, int compiled,
+	int reset, char *out)
+{
+	int res;
+
+	t->message = m;
+	t->error_parse = 0;
+	t->error_runtime = 0;
+
+	if (compiled)
+		res = sieve2_execute_script(t->context, script, t);
+	else
+		res = sieve2_execute(t->context, t);
+
+	summarize_actions(t, 0, res, out);
+
+	if (reset)
+		sieve2_reset(t->context);
+	my_free_all(t);
+}
+
+/* Run the compiled script over one message from the index, for two
+ * recipients in the same place in it: t, and another for OTHER_TO. */
+static void run_index(struct my_thread *t, struct my_message *m,
+	char out[2][SUMMARY_LEN])
+{
+	struct my_thread other;
+	void *user_data[2];
+	int which[2] = { 0, 0 }, results[2], res, i;
+
+	memset(&other, 0, sizeof(other));
+	other.context = t->context;
+	other.message = m;
+	other.envelope_to = OTHER_TO;
+	t->message = m;
+	t->error_parse = 0;
+	t->error_runtime = 0;
+	user_data[0] = t;
+	user_data[1] = &other;
+
+	res = sieve2_execute_index(t->context, script_index, which,
+		user_data, 2, results);
+
+	for (i = 0; i < 2; i++)
+		summarize_actions(user_data[i], i,
+			res == SIEVE2_OK ? results[i] : res, out[i]);
+
+	my_free_all(t);
+	my_free_all(&other);
+	free(other.freelist);
+}
+
+static int my_context_alloc(struct my_thread *t)
+{
+	int res;
+
+	res = sieve2_alloc(&t->context);
+	if (res == SIEVE2_OK)
+		res = sieve2_callbacks(t->context, my_callbacks);
+	if (res == SIEVE2_OK)
+		res = sieve2_setactionlist(t->context, 1);
+	if (res != SIEVE2_OK)
+		printf("Error %d when setting up a context: %s\n",
+			res, sieve2_errstr(res));
+	return res;
+}
+
+static void *run_thread(void *arg)
+{
+	struct my_thread *t = (struct my_thread *)arg;
+	char summary[SUMMARY_LEN], each[2][SUMMARY_LEN];
+	int r, i, compiled;
+
+	if (my_context_alloc(t) != SIEVE2_OK) {
+		t->failures++;
+		return NULL;
+	}
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < nmessages; i++) {
+			for (compiled = 0; compiled <= (script != NULL); compiled++) {
+				run_one(t, &messages[i], compiled, r % 2 == 0, summary);
+				if (strcmp(summary, messages[i].summary[compiled]) != 0)
+					t->failures++;
+			}
+			if (script_index != NULL) {
+				run_index(t, &messages[i], each);
+				if (strcmp(each[0], messages[i].summary[1]) != 0
+				 || strcmp(each[1], messages[i].summary[2]) != 0)
+					t->failures++;
+			}
+		}
+	}
+
+	sieve2_free(&t->context);
+	free(t->freelist);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct my_thread *threads, first, ref;
+	int nthreads = DEFAULT_THREADS;
+	int i, s = 1, res, failures = 0;
+
+	while (argc > s + 1 && argv[s][0] == '-') {
+		if (strcmp(argv[s], "-t") == 0)
+			nthreads = atoi(argv[s + 1]);
+		else if (strcmp(argv[s], "-n") == 0)
+			rounds = atoi(argv[s + 1]);
+		else
+			break;
+		s += 2;
+	}
+
+	if (argc < s + 2 || nthreads < 1 || rounds < 1) {
+		printf("Usage:\n");
+		printf("%s [-t threads] [-n rounds] script message...\n", argv[0]);
+		return 1;
+	}
+
+	if (read_file(argv[s], &script_buf, NULL) != SIEVE2_OK)
+		return 1;
+
+	nmessages = argc - s - 1;
+	messages = calloc(nmessages, sizeof(struct my_message));
+	if (!messages)
+		return 1;
+	for (i = 0; i < nmessages; i++) {
+		if (read_file(argv[s + 1 + i], &messages[i].buf, &messages[i].size) != SIEVE2_OK)
+			return 1;
+	}
+
+	/* The script is compiled once, if it can be, and is
+	 * shared from there. */
+	memset(&first, 0, sizeof(first));
+	if (my_context_alloc(&first) != SIEVE2_OK)
+		return 1;
+
+	res = sieve2_compile(first.context, &first, &script);
+	if (res != SIEVE2_OK)
+		script = NULL;
+	else if (sieve2_index_build(&script, 1, &script_index) != SIEVE2_OK)
+		script_index = NULL;
+
+	/* The reference has a new context for each message, so that the
+	 * threads, which reset theirs from one message to the next, are
+	 * checked against what a context that has seen nothing else does. */
+	for (i = 0; i < nmessages; i++) {
+		memset(&ref, 0, sizeof(ref));
+		if (my_context_alloc(&ref) != SIEVE2_OK)
+			return 1;
+		run_one(&ref, &messages[i], 0, 1, messages[i].summary[0]);
+		if (script) {
+			run_one(&ref, &messages[i], 1, 1, messages[i].summary[1]);
+			ref.envelope_to = OTHER_TO;
+			run_one(&ref, &messages[i], 1, 1, messages[i].summary[2]);
+		}
+		sieve2_free(&ref.context);
+		free(ref.freelist);
+	}
+
+	threads = calloc(nthreads, sizeof(struct my_thread));
+	if (!threads)
+		return 1;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, run_thread, &threads[i]) != 0) {
+			printf("FAIL: can't start thread %d\n", i);
+			nthreads = i;
+			failures++;
+			break;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].failures) {
+			printf("FAIL: thread %d differed %d times\n", i, threads[i].failures);
+			failures += threads[i].failures;
+		}
+	}
+
+	sieve2_index_free(&script_index);
+	if (script)
+		sieve2_script_free(&script);
+	sieve2_free(&first.context);
+	free(first.freelist);
+
+	for (i = 0; i < nmessages; i++)
+		free(messages[i].buf);
+	free(messages);
+	free(threads);
+	free(script_buf);
+
+	if (failures) {
+		printf("Failed %d tests.\n", failures);
+		return 1;
+	}
+
+	printf("Passed all tests.\n");
+	return 0;
+}
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# Every script over every message, in 64 threads at once.
+
+# Not built when configured with --disable-threads.
+if [ ! -x ./testthreads ]; then
+	echo "testthreads not built; skipping"
+	exit 0
+fi
+
+for i in script*.sv; do
+	./testthreads $i message*.mbox > /dev/null
+	if [ "$?" -ne "0" ]; then
+		echo $i failed!
+	fi
+done
@@ -16,9 +16,9 @@
 #include <stdlib.h>
 #include "exception.h"
 
-/* global stack of exception context */
+/* per thread stack of exception context */
 struct _exceptionContext_ *const _returnExceptionContext_ = NULL;
-struct _exceptionContext_ *_currentExceptionContext_ = NULL;
+TLS struct _exceptionContext_ *_currentExceptionContext_ = NULL;
 
 /* delete protected pointers and throw exception */
 void
@@ -21,6 +21,17 @@
 
 #include <setjmp.h>
 
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+/* Each thread has its own stack of exception contexts.  Only a build
+   configured with --disable-threads goes without a thread-local storage
+   class, and then there's only the one, for the one thread allowed. */
+#ifndef TLS
+#  define TLS
+#endif
+
 /*
   some useful macros
 */
@@ -62,7 +73,7 @@ struct _exceptionContext_ {
 };
 
 extern struct _exceptionContext_ *const _returnExceptionContext_;
-extern struct _exceptionContext_ *_currentExceptionContext_;
+extern TLS struct _exceptionContext_ *_currentExceptionContext_;
 
 /* exception keywords */
 #define try								 \
@@ -27,12 +27,74 @@ void *libsieve_memset(void *ptr, int c, size_t len)
     return NULL;
 }
 
+static void *static_malloc(size_t size, void *user_data UNUSED)
+{
+    return malloc(size);
+}
+
+static void *static_realloc(void *ptr, size_t size, void *user_data UNUSED)
+{
+    return realloc(ptr, size);
+}
+
+static void static_free(void *ptr, void *user_data UNUSED)
+{
+    free(ptr);
+}
+
+/* The C library's, unless the application set another. */
+static sieve2_allocator_t static_allocator = {
+    static_malloc, static_realloc, static_free, NULL
+};
+
+/* While a context or a script with an allocator of its own is being
+ * worked on, its allocator is pushed here; it's per thread, since
+ * other threads may be working on other contexts at the same time. */
+static TLS const sieve2_allocator_t *static_current = NULL;
+
+const sieve2_allocator_t *libsieve_allocator(void)
+{
+    return static_current ? static_current : &static_allocator;
+}
+
+const sieve2_allocator_t *libsieve_allocator_push(const sieve2_allocator_t *a)
+{
+    const sieve2_allocator_t *prev = static_current;
+
+    if (a != NULL)
+        static_current = a;
+    return prev;
+}
+
+void libsieve_allocator_pop(const sieve2_allocator_t *prev)
+{
+    static_current = prev;
+}
+
+int libsieve_allocator_set(const sieve2_allocator_t *a)
+{
+    if (a == NULL) {
+        static_allocator.malloc_fn = static_malloc;
+        static_allocator.realloc_fn = static_realloc;
+        static_allocator.free_fn = static_free;
+        static_allocator.user_data = NULL;
+        return SIEVE2_OK;
+    }
+
+    if (a->malloc_fn == NULL || a->realloc_fn == NULL || a->free_fn == NULL)
+        return SIEVE2_ERROR_BADARGS;
+
+    static_allocator = *a;
+    return SIEVE2_OK;
+}
+
 /* Wrapper around free() */
 void libsieve_free(void *ptr)
 {
+    const sieve2_allocator_t *a = libsieve_allocator();
+
     if(ptr)
-        free(ptr);
-    ptr = NULL;
+        a->free_fn(ptr, a->user_data);
 }
 
 /* Repeatedly call libsieve_free. */
@@ -48,26 +110,34 @@ void libsieve_freev(void **ptr)
 
 /* Wrapper around malloc() */
 void *libsieve_malloc (size_t size)
+{
+    const sieve2_allocator_t *a = libsieve_allocator();
+
+    return a->malloc_fn(size, a->user_data);
+}
+
+/* Wrapper around calloc() */
+void *libsieve_calloc (size_t count, size_t size)
 {
     void *ret;
 
-    ret = (void *)malloc(size);
+    if (size && count > (size_t)-1 / size)
+        return NULL;
+
+    ret = libsieve_malloc(count * size);
     if (ret != NULL)
-        return ret;
+        memset(ret, 0, count * size);
 
-    return 0;
+    return ret;
 }
 
 /* Wrapper around realloc() */
 void *libsieve_realloc (void *ptr, size_t size)
 {
-    void *ret;
-
-    ret = (!ptr ? (void *)malloc(size) : (void *)realloc(ptr, size));
-    if (ret != NULL)
-        return ret;
+    const sieve2_allocator_t *a = libsieve_allocator();
 
-    return 0;
+    return (!ptr ? a->malloc_fn(size, a->user_data)
+                 : a->realloc_fn(ptr, size, a->user_data));
 }
 
 /* Convert a string to lower case
@@ -246,62 +316,42 @@ char *libsieve_catbuf_free(struct catbuf *s)
 }
 
 /* This is a spiffy function that helps to maintain
- * a single buffer holding pointers to multiple strings.
+ * a single buffer holding copies of multiple strings.
  *
  * The caller must have the ml... variables declared
  * and in scope and is responsible for freeing mlbuf. */
 char *libsieve_strbuf(struct mlbuf *ml, char *str, size_t len, int freeme)
 {
     char *stmp; /* Temporary for a pointer */
-    char **sstmp; /* Temporary for a pointer to a pointer */
-
-    if (ml->pos + 1 >= ml->siz)
-      {
-        /* This gives a logarithmic growth, reducing the need for realloc's */
-        sstmp = (char **)libsieve_realloc(ml->buf, sizeof(char *) * (ml->siz *= 2));
-        /* Point to the new memory */
-        if (sstmp != NULL)
-            ml->buf = sstmp;
-        /* Get out of here if there's no memory */
-        else
-            return NULL;
-      }
 
-    stmp = (char *)libsieve_strndup(str, len);
-    /* Point to the new memory */
-    if (stmp != NULL)
-        ml->buf[ml->pos] = stmp;
+    stmp = (char *)libsieve_arena_alloc(&ml->arena, sizeof(char) * (len + 1));
     /* Get out of here if there's no memory */
-    else
+    if (stmp == NULL)
         return NULL;
 
-    /* Advance the pointer to the next free space */
-    ml->pos += 1;
-
-    /* NULL terminate it, too! */
-    ml->buf[ml->pos] = NULL;
+    /* The nul is not copied */
+    strncpy(stmp, str, len);
+    /* A new nul is added */
+    stmp[len] = '\0';
 
     /* Free the incoming string, if requested */
     if (freeme)
         libsieve_free(str);
 
-    return ml->buf[ml->pos-1];
+    return stmp;
 }
 
-void libsieve_strbuffree(struct mlbuf **ml, int freeall)
+/* Let go of every string at once, but keep the space for more. */
+void libsieve_strbufclear(struct mlbuf *ml)
 {
-    size_t i;
+    libsieve_arena_clear(&ml->arena);
+}
 
-    /* Loop through and free the allocated strings */
-    if (freeall)
-      {
-        for (i = 0; i < (*ml)->pos; i++)
-          {
-            libsieve_free((*ml)->buf[i]);
-          }
-      }
-    /* Free the buf array */
-    libsieve_free((*ml)->buf);
+/* The strings are always freed, as they're all in the one arena;
+ * freeall is kept for the callers' sake. */
+void libsieve_strbuffree(struct mlbuf **ml, int freeall UNUSED)
+{
+    libsieve_arena_free(&(*ml)->arena);
     /* Free the mlbuf itself */
     libsieve_free((*ml));
     /* NULLify the free()'d pointer */
@@ -317,13 +367,144 @@ int libsieve_strbufalloc(struct mlbuf **ml)
     if (!*ml) {
 	    return SIEVE2_ERROR_NOMEM;
     }
-    (*ml)->pos = 0; /* Naturally, we start at position zero */
-    (*ml)->siz = 256; /* This is the initial number of buffers we can hold */
-    (*ml)->buf = (char **)libsieve_malloc(sizeof(char *) * (*ml)->siz);
-    if (!((*ml)->buf)) {
-	    libsieve_free(*ml);
-	    return SIEVE2_ERROR_NOMEM;
-    }
+    /* Nothing is allocated for the strings until the first one. */
+    (*ml)->arena.block = NULL;
+    (*ml)->arena.spare = NULL;
+    (*ml)->arena.pos = 0;
     return SIEVE2_OK;
 }
 
+/* An arena is a list of blocks, allocated from front to back.
+ * Nothing in it is freed by itself; it's all cleared at once,
+ * and the blocks are kept around to be used again, so that an
+ * arena which is cleared over and over settles at its largest. */
+#define ARENA_BLOCK 4096
+#define ARENA_ALIGN (sizeof(void *) > sizeof(double) ? sizeof(void *) : sizeof(double))
+
+struct arenablock {
+    struct arenablock *next;
+    size_t size;
+    /* The memory follows, aligned for anything. */
+};
+
+#define ARENA_HEAD ((sizeof(struct arenablock) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+void *libsieve_arena_alloc(struct arena *a, size_t len)
+{
+    struct arenablock *b;
+    size_t size;
+    void *p;
+
+    len = (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (a->block == NULL || a->block->size - a->pos < len) {
+        if (a->spare != NULL && a->spare->size >= len) {
+            b = a->spare;
+            a->spare = b->next;
+        } else {
+            size = (len > ARENA_BLOCK ? len : ARENA_BLOCK);
+            b = (struct arenablock *)libsieve_malloc(ARENA_HEAD + size);
+            if (b == NULL)
+                return NULL;
+            b->size = size;
+        }
+        b->next = a->block;
+        a->block = b;
+        a->pos = 0;
+    }
+
+    p = (char *)a->block + ARENA_HEAD + a->pos;
+    a->pos += len;
+
+    return p;
+}
+
+char *libsieve_arena_strdup(struct arena *a, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *p;
+
+    p = (char *)libsieve_arena_alloc(a, len);
+    if (p != NULL)
+        memcpy(p, str, len);
+
+    return p;
+}
+
+char *libsieve_arena_strndup(struct arena *a, const char *str, size_t len)
+{
+    char *p;
+
+    p = (char *)libsieve_arena_alloc(a, len + 1);
+    if (p != NULL) {
+        /* The nul is not copied */
+        strncpy(p, str, len);
+        /* A new nul is added */
+        p[len] = '\0';
+    }
+
+    return p;
+}
+
+/* As libsieve_strconcat, but the result is in the arena. */
+char *libsieve_arena_strconcat(struct arena *a, const char *str, ...)
+{
+    va_list va;
+    const char *s;
+    char *buf, *p;
+    size_t len = 0;
+
+    if (str == NULL)
+        return NULL;
+
+    va_start(va, str);
+    for (s = str; s != NULL; s = va_arg(va, const char *))
+        len += strlen(s);
+    va_end(va);
+
+    buf = p = (char *)libsieve_arena_alloc(a, len + 1);
+    if (buf == NULL)
+        return NULL;
+
+    va_start(va, str);
+    for (s = str; s != NULL; s = va_arg(va, const char *)) {
+        len = strlen(s);
+        memcpy(p, s, len);
+        p += len;
+    }
+    va_end(va);
+    *p = '\0';
+
+    return buf;
+}
+
+void libsieve_arena_clear(struct arena *a)
+{
+    struct arenablock *b, *next;
+
+    if (a->block == NULL)
+        return;
+
+    for (b = a->block->next; b != NULL; b = next) {
+        next = b->next;
+        b->next = a->spare;
+        a->spare = b;
+    }
+    a->block->next = NULL;
+    a->pos = 0;
+}
+
+void libsieve_arena_free(struct arena *a)
+{
+    struct arenablock *b, *next;
+
+    libsieve_arena_clear(a);
+    libsieve_free(a->block);
+    a->block = NULL;
+
+    for (b = a->spare; b != NULL; b = next) {
+        next = b->next;
+        libsieve_free(b);
+    }
+    a->spare = NULL;
+}
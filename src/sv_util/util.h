@@ -14,6 +14,7 @@
 /* Needed for printf. */
 #include <stdio.h>
 #include "exception.h"
+#include "sieve2.h"
 
 /* Define several macros for GCC specific attributes.
  * Although the __attribute__ macro can be easily defined
@@ -46,9 +47,18 @@
 void libsieve_free(void *ptr);
 void libsieve_freev(void **ptr);
 void *libsieve_malloc(size_t size);
+void *libsieve_calloc(size_t count, size_t size);
 void *libsieve_realloc(void *ptr, size_t size);
 void *libsieve_memset(void *ptr, int c, size_t len);
 
+/* The allocator the functions above use, for the calling thread:
+ * the last one pushed, or else the one given to sieve2_setallocator.
+ * Push returns the one it replaces, to be popped back afterwards. */
+const sieve2_allocator_t *libsieve_allocator(void);
+const sieve2_allocator_t *libsieve_allocator_push(const sieve2_allocator_t *a);
+void libsieve_allocator_pop(const sieve2_allocator_t *prev);
+int libsieve_allocator_set(const sieve2_allocator_t *a);
+
 /* These are the string oriented functions */
 
 char *libsieve_strtolower(char *str, size_t len);
@@ -61,18 +71,35 @@ char *libsieve_strconcat(const char *str, ...);
 int libsieve_strisatom(const char *str, size_t len);
 int libsieve_strtonum(const char *str);
 
-/* These functions hold onto many strings at once */
+/* These hand out memory which is all given back at once. */
+
+struct arenablock;
+
+struct arena {
+    struct arenablock *block; /* The newest block, which the rest hang off */
+    struct arenablock *spare; /* Blocks cleared, to be used again */
+    size_t pos;               /* Where the next allocation goes in it */
+};
+
+void *libsieve_arena_alloc(struct arena *a, size_t len);
+char *libsieve_arena_strdup(struct arena *a, const char *str);
+char *libsieve_arena_strndup(struct arena *a, const char *str, size_t len);
+char *libsieve_arena_strconcat(struct arena *a, const char *str, ...);
+void libsieve_arena_clear(struct arena *a);
+void libsieve_arena_free(struct arena *a);
+
+/* These functions hold onto many strings at once, until
+ * they're all let go of together, or cleared for reuse. */
 
 struct mlbuf {
-    char **buf; /* The buffer! */
-    size_t siz; /* Total size */
-    size_t pos; /* Current position */
+    struct arena arena; /* Where the strings are kept */
 };
 
 #define FREEME 1
 #define NOFREE 0
 
 char *libsieve_strbuf(struct mlbuf *ml, char *str, size_t len, int freeme);
+void libsieve_strbufclear(struct mlbuf *ml);
 void libsieve_strbuffree(struct mlbuf **ml, int freeall);
 int libsieve_strbufalloc(struct mlbuf **ml);
 
@@ -88,6 +115,7 @@ char *libsieve_catbuf(struct catbuf *s, char *str, size_t len);
 struct catbuf *libsieve_catbuf_alloc(void);
 char *libsieve_catbuf_free(struct catbuf *s);
 
+
 /* The MD5 implementation is in md5.c */
 char *libsieve_makehash(char *s1, char *s2);
 